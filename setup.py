@@ -176,10 +176,35 @@ def _get_settings():
         settings['libraries']    = ['pq']
 
         # Python functions take a lot of 'char *' that really should be const.  gcc complains about this *a lot*
-        settings['extra_compile_args'] = ['-Wno-write-strings']
+        settings['extra_compile_args'] = ['-Wno-write-strings', '-pthread']
+
+        # parallel_copy uses std::thread.
+        settings['extra_link_args'] = ['-pthread']
+
+    if os.name != 'nt':
+        _add_compression(settings)
 
     return settings
 
+
+def _add_compression(settings):
+    """
+    Adds zlib and libzstd, used to compress and decompress COPY data, if pkg-config can find
+    them.  Both are optional.
+    """
+    for package, macro in [('zlib', 'PGLIB_HAVE_ZLIB'), ('libzstd', 'PGLIB_HAVE_ZSTD')]:
+        try:
+            subprocess.check_output(['pkg-config', '--exists', package])
+            cflags = subprocess.check_output(['pkg-config', '--cflags-only-I', package]).decode('utf-8').split()
+            libs   = subprocess.check_output(['pkg-config', '--libs', package]).decode('utf-8').split()
+        except (OSError, subprocess.CalledProcessError):
+            continue
+
+        settings['define_macros'].append((macro, 1))
+        settings.setdefault('include_dirs', []).extend(f[2:] for f in cflags if f.startswith('-I'))
+        settings.setdefault('library_dirs', []).extend(f[2:] for f in libs if f.startswith('-L'))
+        settings.setdefault('libraries', []).extend(f[2:] for f in libs if f.startswith('-l'))
+
 setup(
     name='pglib',
     version = get_version(),
@@ -0,0 +1,783 @@
+
+// Exports results using the Arrow C data interface.
+//
+// The arrays are built from the PGresult with the GIL released and own copies of all of their
+// data, so they stay valid after the ResultSet is freed.  Arrow consumers can call the release
+// callbacks from any thread, so nothing here holds references to Python objects.
+
+#include "pglib.h"
+#include <string>
+#include <vector>
+#include "arrow.h"
+#include "columnbuffer.h"
+#include "byteswap.h"
+
+struct Field
+{
+    std::string name;
+    std::string format;
+};
+
+// -----------------------------------------------------------------------------------------------
+// Schemas
+
+struct SchemaData
+{
+    std::string format;
+    std::string name;
+    std::vector<ArrowSchema> children;
+    std::vector<ArrowSchema*> pointers;
+};
+
+static void ReleaseSchema(ArrowSchema* schema)
+{
+    SchemaData* data = (SchemaData*)schema->private_data;
+
+    for (size_t i = 0; i < data->pointers.size(); i++)
+        if (data->pointers[i]->release)
+            data->pointers[i]->release(data->pointers[i]);
+
+    delete data;
+    schema->release = 0;
+}
+
+static SchemaData* InitSchema(ArrowSchema* schema, const std::string& format, const std::string& name, size_t cChildren)
+{
+    SchemaData* data = new SchemaData();
+    data->format = format;
+    data->name   = name;
+    data->children.resize(cChildren);
+    for (size_t i = 0; i < cChildren; i++)
+        data->pointers.push_back(&data->children[i]);
+
+    schema->format       = data->format.c_str();
+    schema->name         = data->name.c_str();
+    schema->metadata     = 0;
+    schema->flags        = 0;
+    schema->n_children   = (int64_t)cChildren;
+    schema->children     = cChildren ? &data->pointers[0] : 0;
+    schema->dictionary   = 0;
+    schema->release      = ReleaseSchema;
+    schema->private_data = data;
+
+    return data;
+}
+
+static void ExportSchema(const std::vector<Field>& fields, ArrowSchema* out)
+{
+    // The schema of a result is a struct with a nullable field for each column.
+
+    SchemaData* data = InitSchema(out, "+s", "", fields.size());
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        InitSchema(&data->children[i], fields[i].format, fields[i].name, 0);
+        data->children[i].flags = ARROW_FLAG_NULLABLE;
+    }
+}
+
+// -----------------------------------------------------------------------------------------------
+// Arrays
+
+struct ArrayData
+{
+    void* buffers[3];
+    const void* pointers[3];
+    std::vector<ArrowArray> children;
+    std::vector<ArrowArray*> children_pointers;
+};
+
+static void ReleaseArray(ArrowArray* array)
+{
+    ArrayData* data = (ArrayData*)array->private_data;
+
+    for (size_t i = 0; i < data->children_pointers.size(); i++)
+        if (data->children_pointers[i]->release)
+            data->children_pointers[i]->release(data->children_pointers[i]);
+
+    for (int i = 0; i < 3; i++)
+        free(data->buffers[i]);
+
+    delete data;
+    array->release = 0;
+}
+
+static ArrayData* InitArray(ArrowArray* array, int64_t length, int cBuffers, size_t cChildren)
+{
+    // Initializes `array` with no buffers allocated yet.  Once this returns, releasing the array
+    // frees whatever has been added to it, so a partly built array can be released on errors.
+
+    ArrayData* data = new ArrayData();
+    for (int i = 0; i < 3; i++)
+    {
+        data->buffers[i]  = 0;
+        data->pointers[i] = 0;
+    }
+
+    data->children.resize(cChildren);
+    for (size_t i = 0; i < cChildren; i++)
+    {
+        memset(&data->children[i], 0, sizeof(ArrowArray));
+        data->children_pointers.push_back(&data->children[i]);
+    }
+
+    array->length       = length;
+    array->null_count   = 0;
+    array->offset       = 0;
+    array->n_buffers    = cBuffers;
+    array->n_children   = (int64_t)cChildren;
+    array->buffers      = data->pointers;
+    array->children     = cChildren ? &data->children_pointers[0] : 0;
+    array->dictionary   = 0;
+    array->release      = ReleaseArray;
+    array->private_data = data;
+
+    return data;
+}
+
+static void* AddBuffer(ArrayData* data, int i, size_t cb)
+{
+    // Allocates zeroed buffer `i`.  Arrow requires buffers be 8-byte aligned, which malloc
+    // already guarantees.  If this returns zero, return false without setting the error
+    // message, which means we ran out of memory.
+
+    data->buffers[i] = calloc(MAX(cb, 1), 1);
+    data->pointers[i] = data->buffers[i];
+    return data->buffers[i];
+}
+
+static std::string Format(const char* szFormat, int iCol, int oid = 0)
+{
+    char sz[200];
+    snprintf(sz, sizeof(sz), szFormat, iCol, oid);
+    return sz;
+}
+
+// -----------------------------------------------------------------------------------------------
+// Columns
+
+static bool IsText(Oid oid)
+{
+    // Text types, whose binary format is the same as their text format.
+
+    switch (oid)
+    {
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case NAMEOID:
+    case JSONOID:
+        return true;
+    }
+    return false;
+}
+
+static Py_ssize_t SetValidity(PGresult* result, int iCol, uint8_t* validity)
+{
+    // Sets the validity bits of the non-NULL values and returns the number of NULLs.
+
+    Py_ssize_t nulls = 0;
+    for (int iRow = 0, cRows = PQntuples(result); iRow < cRows; iRow++)
+    {
+        if (PQgetisnull(result, iRow, iCol))
+            nulls++;
+        else
+            validity[iRow / 8] |= (uint8_t)(1 << (iRow % 8));
+    }
+    return nulls;
+}
+
+static bool BuildBool(PGresult* result, int iCol, ArrayData* data)
+{
+    // Arrow booleans are a bitmap like the validity buffer.
+
+    int cRows = PQntuples(result);
+
+    uint8_t* bits = (uint8_t*)AddBuffer(data, 1, (cRows + 7) / 8);
+    if (bits == 0)
+        return false;
+
+    for (int iRow = 0; iRow < cRows; iRow++)
+        if (!PQgetisnull(result, iRow, iCol) && *PQgetvalue(result, iRow, iCol))
+            bits[iRow / 8] |= (uint8_t)(1 << (iRow % 8));
+
+    return true;
+}
+
+static bool BuildVarLength(PGresult* result, int iCol, ArrayData* data, std::string& error)
+{
+    // Builds the offsets and data buffers of a utf8 or binary array.
+
+    int cRows = PQntuples(result);
+
+    int64_t total = 0;
+    for (int iRow = 0; iRow < cRows; iRow++)
+        total += PQgetlength(result, iRow, iCol);
+
+    if (total > INT32_MAX)
+    {
+        error = Format("Column %d has more than 2GB of data, which cannot be exported to Arrow", iCol);
+        return false;
+    }
+
+    int32_t* offsets = (int32_t*)AddBuffer(data, 1, sizeof(int32_t) * (cRows + 1));
+    char* values = (char*)AddBuffer(data, 2, (size_t)total);
+    if (offsets == 0 || values == 0)
+        return false;
+
+    int32_t offset = 0;
+    for (int iRow = 0; iRow < cRows; iRow++)
+    {
+        offsets[iRow] = offset;
+        int len = PQgetlength(result, iRow, iCol);
+        memcpy(values + offset, PQgetvalue(result, iRow, iCol), len);
+        offset += len;
+    }
+    offsets[cRows] = offset;
+
+    return true;
+}
+
+static bool BuildUuid(PGresult* result, int iCol, ArrayData* data)
+{
+    int cRows = PQntuples(result);
+
+    char* values = (char*)AddBuffer(data, 1, (size_t)cRows * 16);
+    if (values == 0)
+        return false;
+
+    for (int iRow = 0; iRow < cRows; iRow++)
+        if (!PQgetisnull(result, iRow, iCol))
+            memcpy(values + iRow * 16, PQgetvalue(result, iRow, iCol), 16);
+
+    return true;
+}
+
+// Numerics are converted to decimal128, a 128-bit integer scaled by a power of 10.  The integer
+// is built in four 32-bit limbs, least significant first, since not all compilers have a
+// 128-bit type.
+
+const int DECIMAL128_MAX_PRECISION = 38;
+
+enum
+{
+    NUMERIC_POS = 0x0000,
+    NUMERIC_NEG = 0x4000
+    // Everything else is NaN or an infinity.
+};
+
+static void MulAdd(uint32_t* limbs, uint32_t mul, uint32_t add)
+{
+    uint64_t carry = add;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t value = (uint64_t)limbs[i] * mul + carry;
+        limbs[i] = (uint32_t)value;
+        carry = value >> 32;
+    }
+}
+
+static int DigitCount(int digit)
+{
+    return digit >= 1000 ? 4 : digit >= 100 ? 3 : digit >= 10 ? 2 : 1;
+}
+
+static bool NumericToDecimal(const char* p, int scale, uint8_t* out)
+{
+    // Writes the numeric at `p` to `out` as a decimal128 with `scale` digits after the decimal
+    // point.  Returns false if it is NaN, an infinity, has more than 38 digits, or has more
+    // digits after the decimal point than `scale`.
+
+    const int16_t* pi = (const int16_t*)p;
+
+    int ndigits = swaps2(pi[0]);
+    int weight  = swaps2(pi[1]);
+    int sign    = (uint16_t)swaps2(pi[2]);
+    int dscale  = swaps2(pi[3]);
+
+    if (sign != NUMERIC_POS && sign != NUMERIC_NEG)
+        return false;
+
+    if (dscale > scale)
+        return false;
+
+    uint32_t limbs[4] = { 0, 0, 0, 0 };
+
+    if (ndigits != 0)
+    {
+        int before = weight >= 0 ? 4 * weight + DigitCount(swaps2(pi[4])) : 0;
+        if (before + scale > DECIMAL128_MAX_PRECISION)
+            return false;
+    }
+
+    // Each base 10000 digit is worth 10^exponent in the scaled integer, so the integer is
+    // built by multiplying by 10000 for each digit and then by 10^exponent of the last digit.
+    // A digit that is partly past the scale is divided down instead, which is exact since the
+    // value has no more than `scale` digits after the decimal point, so the dropped ones are
+    // zero padding.
+
+    int exponent = 4 * weight + scale;
+    int multiplier = 0;
+
+    for (int i = 0; i < ndigits; i++, exponent -= 4)
+    {
+        int digit = swaps2(pi[4 + i]);
+
+        if (exponent >= 0)
+        {
+            MulAdd(limbs, 10000, digit);
+            multiplier = exponent;
+            continue;
+        }
+
+        int drop = -exponent;
+        if (drop < 4)
+        {
+            static const uint32_t powers[] = { 1, 10, 100, 1000 };
+            MulAdd(limbs, powers[4 - drop], digit / powers[drop]);
+        }
+        multiplier = 0;
+        break;
+    }
+
+    for (int i = 0; i < multiplier; i++)
+        MulAdd(limbs, 10, 0);
+
+    if (sign == NUMERIC_NEG)
+    {
+        for (int i = 0; i < 4; i++)
+            limbs[i] = ~limbs[i];
+        MulAdd(limbs, 1, 1);
+    }
+
+#ifdef __BIG_ENDIAN__
+    for (int i = 0; i < 4; i++)
+        memcpy(out + 4 * i, &limbs[3 - i], 4);
+#else
+    memcpy(out, limbs, 16);
+#endif
+
+    return true;
+}
+
+static bool BuildNumeric(PGresult* result, int iCol, Field& field, ArrayData* data, std::string& error)
+{
+    int cRows = PQntuples(result);
+
+    // A numeric column declared with a precision and scale has a typmod of
+    // ((precision << 16) | scale) + 4.  Otherwise we use the largest scale of any value.
+
+    int precision = DECIMAL128_MAX_PRECISION;
+    int scale = 0;
+
+    int typmod = PQfmod(result, iCol);
+    if (typmod >= 4)
+    {
+        precision = MIN(((typmod - 4) >> 16) & 0xFFFF, DECIMAL128_MAX_PRECISION);
+        scale     = MAX((int16_t)((typmod - 4) & 0xFFFF), 0);
+    }
+    else
+    {
+        for (int iRow = 0; iRow < cRows; iRow++)
+        {
+            if (PQgetisnull(result, iRow, iCol))
+                continue;
+            const int16_t* pi = (const int16_t*)PQgetvalue(result, iRow, iCol);
+            scale = MAX(scale, (int)swaps2(pi[3]));
+        }
+        scale = MIN(scale, DECIMAL128_MAX_PRECISION);
+    }
+
+    char sz[30];
+    snprintf(sz, sizeof(sz), "d:%d,%d", precision, scale);
+    field.format = sz;
+
+    uint8_t* values = (uint8_t*)AddBuffer(data, 1, (size_t)cRows * 16);
+    if (values == 0)
+        return false;
+
+    for (int iRow = 0; iRow < cRows; iRow++)
+    {
+        if (PQgetisnull(result, iRow, iCol))
+            continue;
+
+        if (!NumericToDecimal(PQgetvalue(result, iRow, iCol), scale, values + iRow * 16))
+        {
+            error = Format("Column %d row %d is NaN, infinite, or has more than 38 digits and cannot be exported to Arrow", iCol, iRow);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool BuildColumn(PGresult* result, int iCol, bool integer_datetimes, Field& field, ArrowArray* out, std::string& error)
+{
+    Oid oid = PQftype(result, iCol);
+    int cRows = PQntuples(result);
+
+    field.name = PQfname(result, iCol);
+
+    bool text = IsText(oid);
+
+    if (PQfformat(result, iCol) != FORMAT_BINARY && !text)
+    {
+        error = Format("Column %d was not returned in binary format", iCol);
+        return false;
+    }
+
+    const ColumnLayout* layout = GetColumnLayout(oid);
+
+    if (layout == 0 && !text && oid != BYTEAOID && oid != UUIDOID && oid != NUMERICOID)
+    {
+        error = Format("Column %d has type %d, which cannot be exported to Arrow", iCol, (int)oid);
+        return false;
+    }
+
+    if ((oid == TIMESTAMPOID || oid == TIMESTAMPTZOID) && !integer_datetimes)
+    {
+        error = Format("Column %d is a floating point timestamp, which is not supported", iCol);
+        return false;
+    }
+
+    int cBuffers = (text || oid == BYTEAOID) ? 3 : 2;
+    ArrayData* data = InitArray(out, cRows, cBuffers, 0);
+
+    uint8_t* validity = (uint8_t*)AddBuffer(data, 0, (cRows + 7) / 8);
+    if (validity == 0)
+        return false;
+
+    bool ok = true;
+
+    if (oid == BOOLOID)
+    {
+        field.format = layout->arrow;
+        out->null_count = SetValidity(result, iCol, validity);
+        ok = BuildBool(result, iCol, data);
+    }
+    else if (layout)
+    {
+        field.format = layout->arrow;
+        char* values = (char*)AddBuffer(data, 1, (size_t)cRows * layout->itemsize);
+        if (values == 0)
+            return false;
+        out->null_count = FillColumn(result, iCol, values, validity);
+    }
+    else
+    {
+        out->null_count = SetValidity(result, iCol, validity);
+
+        if (oid == UUIDOID)
+        {
+            field.format = "w:16";
+            ok = BuildUuid(result, iCol, data);
+        }
+        else if (oid == NUMERICOID)
+        {
+            ok = BuildNumeric(result, iCol, field, data, error);
+        }
+        else
+        {
+            field.format = (oid == BYTEAOID) ? "z" : "u";
+            ok = BuildVarLength(result, iCol, data, error);
+        }
+    }
+
+    if (ok && out->null_count == 0)
+    {
+        // The validity buffer is optional when there are no NULLs.
+        free(data->buffers[0]);
+        data->buffers[0]  = 0;
+        data->pointers[0] = 0;
+    }
+
+    return ok;
+}
+
+static bool BuildBatch(PGresult* result, bool integer_datetimes, std::vector<Field>& fields, ArrowArray* out, std::string& error)
+{
+    // Builds the result as a struct array with a child array for each column.  Does not use
+    // the Python API.  If false is returned, `out` has been released and `error` is set, or is
+    // empty if we ran out of memory.
+
+    int cCols = PQnfields(result);
+
+    fields.resize(cCols);
+    ArrayData* data = InitArray(out, PQntuples(result), 1, cCols);
+
+    for (int iCol = 0; iCol < cCols; iCol++)
+    {
+        if (!BuildColumn(result, iCol, integer_datetimes, fields[iCol], &data->children[iCol], error))
+        {
+            out->release(out);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------------
+// ColumnBuffers
+
+struct BufferData
+{
+    PyObject* buffer;
+    // A reference to the ColumnBuffer that owns the memory.
+
+    const void* pointers[2];
+
+    void* bits;
+    // The values of a bool column packed into a bitmap, or zero.
+};
+
+static void ReleaseBufferArray(ArrowArray* array)
+{
+    // This is the only release callback that touches Python, so it must take the GIL since it
+    // can be called from any thread.
+
+    BufferData* data = (BufferData*)array->private_data;
+
+    PyGILState_STATE state = PyGILState_Ensure();
+    Py_DECREF(data->buffer);
+    PyGILState_Release(state);
+
+    free(data->bits);
+    delete data;
+    array->release = 0;
+}
+
+static bool ExportColumnBuffer(ColumnBuffer* buffer, ArrowArray* out)
+{
+    BufferData* data = new BufferData();
+
+    data->buffer      = (PyObject*)buffer;
+    data->pointers[0] = buffer->null_count ? buffer->validity : 0;
+    data->pointers[1] = buffer->data;
+    data->bits        = 0;
+
+    if (buffer->layout->oid == BOOLOID)
+    {
+        // Arrow booleans are a bitmap rather than a byte per value.
+
+        uint8_t* bits = (uint8_t*)calloc(buffer->count / 8 + 1, 1);
+        if (bits == 0)
+        {
+            delete data;
+            return false;
+        }
+
+        for (Py_ssize_t i = 0; i < buffer->count; i++)
+            if (buffer->data[i])
+                bits[i / 8] |= (uint8_t)(1 << (i % 8));
+
+        data->bits        = bits;
+        data->pointers[1] = bits;
+    }
+
+    Py_INCREF(data->buffer);
+
+    out->length       = buffer->count;
+    out->null_count   = buffer->null_count;
+    out->offset       = 0;
+    out->n_buffers    = 2;
+    out->n_children   = 0;
+    out->buffers      = data->pointers;
+    out->children     = 0;
+    out->dictionary   = 0;
+    out->release      = ReleaseBufferArray;
+    out->private_data = data;
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------------
+// Streams
+
+struct StreamData
+{
+    std::vector<Field> fields;
+    ArrowArray batch;
+    // The result, or released once it has been returned.
+};
+
+static int Stream_get_schema(ArrowArrayStream* stream, ArrowSchema* out)
+{
+    StreamData* data = (StreamData*)stream->private_data;
+    ExportSchema(data->fields, out);
+    return 0;
+}
+
+static int Stream_get_next(ArrowArrayStream* stream, ArrowArray* out)
+{
+    // Moves the batch to `out` the first time.  After that, `out` is marked released, which
+    // tells the consumer the stream has ended.
+
+    StreamData* data = (StreamData*)stream->private_data;
+    *out = data->batch;
+    data->batch.release = 0;
+    return 0;
+}
+
+static const char* Stream_get_last_error(ArrowArrayStream* stream)
+{
+    UNUSED(stream);
+    return 0;
+}
+
+static void Stream_release(ArrowArrayStream* stream)
+{
+    StreamData* data = (StreamData*)stream->private_data;
+    if (data->batch.release)
+        data->batch.release(&data->batch);
+    delete data;
+    stream->release = 0;
+}
+
+// -----------------------------------------------------------------------------------------------
+// Capsules
+
+static void FreeSchemaCapsule(PyObject* capsule)
+{
+    ArrowSchema* schema = (ArrowSchema*)PyCapsule_GetPointer(capsule, "arrow_schema");
+    if (schema->release)
+        schema->release(schema);
+    free(schema);
+}
+
+static void FreeArrayCapsule(PyObject* capsule)
+{
+    ArrowArray* array = (ArrowArray*)PyCapsule_GetPointer(capsule, "arrow_array");
+    if (array->release)
+        array->release(array);
+    free(array);
+}
+
+static void FreeStreamCapsule(PyObject* capsule)
+{
+    ArrowArrayStream* stream = (ArrowArrayStream*)PyCapsule_GetPointer(capsule, "arrow_array_stream");
+    if (stream->release)
+        stream->release(stream);
+    free(stream);
+}
+
+static bool Build(PGresult* result, bool integer_datetimes, std::vector<Field>& fields, ArrowArray* out)
+{
+    // Builds the batch with the GIL released.  Returns false with an exception set if it
+    // could not be built.
+
+    std::string error;
+    bool ok;
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = BuildBatch(result, integer_datetimes, fields, out, error);
+    Py_END_ALLOW_THREADS
+
+    if (!ok)
+    {
+        if (error.empty())
+            PyErr_NoMemory();
+        else
+            PyErr_SetString(Error, error.c_str());
+    }
+
+    return ok;
+}
+
+static bool AllocateCapsules(Object& schemacap, Object& arraycap, ArrowSchema*& schema, ArrowArray*& array)
+{
+    // Each capsule owns its struct from the moment it is created, so the structs are zeroed
+    // (which marks them released) and only filled in once everything has succeeded.
+
+    schema = (ArrowSchema*)calloc(1, sizeof(ArrowSchema));
+    if (schema == 0)
+    {
+        PyErr_NoMemory();
+        return false;
+    }
+
+    schemacap.Attach(PyCapsule_New(schema, "arrow_schema", FreeSchemaCapsule));
+    if (!schemacap)
+    {
+        free(schema);
+        return false;
+    }
+
+    array = (ArrowArray*)calloc(1, sizeof(ArrowArray));
+    if (array == 0)
+    {
+        PyErr_NoMemory();
+        return false;
+    }
+
+    arraycap.Attach(PyCapsule_New(array, "arrow_array", FreeArrayCapsule));
+    if (!arraycap)
+    {
+        free(array);
+        return false;
+    }
+
+    return true;
+}
+
+PyObject* Arrow_ExportColumnBuffer(ColumnBuffer* buffer)
+{
+    Object schemacap, arraycap;
+    ArrowSchema* schema;
+    ArrowArray* array;
+    if (!AllocateCapsules(schemacap, arraycap, schema, array))
+        return 0;
+
+    if (!ExportColumnBuffer(buffer, array))
+        return PyErr_NoMemory();
+
+    InitSchema(schema, buffer->layout->arrow, "", 0);
+    schema->flags = ARROW_FLAG_NULLABLE;
+
+    return PyTuple_Pack(2, schemacap.Get(), arraycap.Get());
+}
+
+PyObject* Arrow_ExportArray(PGresult* result, bool integer_datetimes)
+{
+    Object schemacap, arraycap;
+    ArrowSchema* schema;
+    ArrowArray* array;
+    if (!AllocateCapsules(schemacap, arraycap, schema, array))
+        return 0;
+
+    std::vector<Field> fields;
+    if (!Build(result, integer_datetimes, fields, array))
+        return 0;
+
+    ExportSchema(fields, schema);
+
+    return PyTuple_Pack(2, schemacap.Get(), arraycap.Get());
+}
+
+PyObject* Arrow_ExportStream(PGresult* result, bool integer_datetimes)
+{
+    ArrowArrayStream* stream = (ArrowArrayStream*)calloc(1, sizeof(ArrowArrayStream));
+    if (stream == 0)
+        return PyErr_NoMemory();
+
+    Object capsule(PyCapsule_New(stream, "arrow_array_stream", FreeStreamCapsule));
+    if (!capsule)
+    {
+        free(stream);
+        return 0;
+    }
+
+    StreamData* data = new StreamData();
+    if (!Build(result, integer_datetimes, data->fields, &data->batch))
+    {
+        delete data;
+        return 0;
+    }
+
+    stream->get_schema     = Stream_get_schema;
+    stream->get_next       = Stream_get_next;
+    stream->get_last_error = Stream_get_last_error;
+    stream->release        = Stream_release;
+    stream->private_data   = data;
+
+    return capsule.Detach();
+}
@@ -0,0 +1,77 @@
+
+#ifndef ARROW_H
+#define ARROW_H
+
+// The Arrow C data and stream interfaces.  These definitions are ABI-stable and are copied
+// from the Arrow specification, so we do not need Arrow or pyarrow to build.  The guards are
+// the ones the specification requires so they can coexist with Arrow's own headers.
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema
+{
+    const char* format;
+    const char* name;
+    const char* metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+
+    void (*release)(struct ArrowSchema*);
+    void* private_data;
+};
+
+struct ArrowArray
+{
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+
+    void (*release)(struct ArrowArray*);
+    void* private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream
+{
+    int (*get_schema)(struct ArrowArrayStream*, struct ArrowSchema* out);
+    int (*get_next)(struct ArrowArrayStream*, struct ArrowArray* out);
+    const char* (*get_last_error)(struct ArrowArrayStream*);
+
+    void (*release)(struct ArrowArrayStream*);
+    void* private_data;
+};
+
+#endif // ARROW_C_STREAM_INTERFACE
+
+struct ColumnBuffer;
+
+PyObject* Arrow_ExportColumnBuffer(ColumnBuffer* buffer);
+// Implements ColumnBuffer.__arrow_c_array__.  Returns a tuple of "arrow_schema" and
+// "arrow_array" capsules holding the buffer as a primitive array.  The array shares the
+// buffer's memory and keeps a reference to it.
+
+PyObject* Arrow_ExportArray(PGresult* result, bool integer_datetimes);
+// Implements __arrow_c_array__.  Returns a tuple of "arrow_schema" and "arrow_array" capsules
+// holding the result as a struct array with a child for each column.
+
+PyObject* Arrow_ExportStream(PGresult* result, bool integer_datetimes);
+// Implements __arrow_c_stream__.  Returns an "arrow_array_stream" capsule that yields the
+// result as a single batch.
+
+#endif // ARROW_H
@@ -78,4 +78,30 @@ inline double swapdouble(double value)
 
 #endif
 
+// FromNetwork is overloaded so templates can pick the right byte swap for their type.
+
+inline int8_t  FromNetwork(int8_t n)  { return n; }
+inline int16_t FromNetwork(int16_t n) { return swaps2(n); }
+inline int32_t FromNetwork(int32_t n) { return swaps4(n); }
+inline int64_t FromNetwork(int64_t n) { return swaps8(n); }
+inline float   FromNetwork(float n)   { return swapfloat(n); }
+inline double  FromNetwork(double n)  { return swapdouble(n); }
+
+// Read network order integers at any offset in a buffer.  The memcpy avoids unaligned,
+// type-punned reads, which are undefined and fault on some processors.
+
+inline int16_t ReadInt16(const char* p)
+{
+    int16_t n;
+    memcpy(&n, p, 2);
+    return swaps2(n);
+}
+
+inline int32_t ReadInt32(const char* p)
+{
+    int32_t n;
+    memcpy(&n, p, 4);
+    return swaps4(n);
+}
+
 #endif //  BYTESWAP_H
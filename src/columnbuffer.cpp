@@ -0,0 +1,418 @@
+
+#include "pglib.h"
+#include <limits>
+#include "columnbuffer.h"
+#include "byteswap.h"
+#include "arrow.h"
+
+// PostgreSQL dates and timestamps count from 2000-01-01, but numpy and Arrow count from
+// 1970-01-01.
+
+const int32_t DAYS_1970_TO_2000   = 10957;
+const int64_t MICROS_1970_TO_2000 = 946684800000000LL;
+
+static const ColumnLayout layouts[] =
+{
+    { BOOLOID,        "bool",        "?", 1, "b" },
+    { INT2OID,        "int2",        "h", 2, "s" },
+    { INT4OID,        "int4",        "i", 4, "i" },
+    { INT8OID,        "int8",        "q", 8, "l" },
+    { FLOAT4OID,      "float4",      "f", 4, "f" },
+    { FLOAT8OID,      "float8",      "d", 8, "g" },
+    { DATEOID,        "date",        "i", 4, "tdD" },
+    { TIMESTAMPOID,   "timestamp",   "q", 8, "tsu:" },
+    { TIMESTAMPTZOID, "timestamptz", "q", 8, "tsu:UTC" },
+};
+
+const ColumnLayout* GetColumnLayout(Oid oid)
+{
+    for (size_t i = 0; i < _countof(layouts); i++)
+        if (layouts[i].oid == oid)
+            return &layouts[i];
+    return 0;
+}
+
+const ColumnLayout* GetColumnLayoutByName(const char* szName)
+{
+    for (size_t i = 0; i < _countof(layouts); i++)
+        if (strcmp(layouts[i].name, szName) == 0)
+            return &layouts[i];
+    return 0;
+}
+
+ColumnBuffer* ColumnBuffer_New(const ColumnLayout* layout, Py_ssize_t capacity)
+{
+    ColumnBuffer* self = PyObject_NEW(ColumnBuffer, &ColumnBufferType);
+    if (self == 0)
+        return 0;
+
+    capacity = MAX(capacity, 8);
+
+    self->layout     = layout;
+    self->count      = 0;
+    self->capacity   = capacity;
+    self->null_count = 0;
+    self->data       = (char*)malloc(capacity * layout->itemsize);
+    self->validity   = (uint8_t*)calloc(capacity / 8 + 1, 1);
+
+    if (self->data == 0 || self->validity == 0)
+    {
+        Py_DECREF(self);
+        PyErr_NoMemory();
+        return 0;
+    }
+
+    return self;
+}
+
+static void ColumnBuffer_dealloc(PyObject* o)
+{
+    ColumnBuffer* self = (ColumnBuffer*)o;
+    free(self->data);
+    free(self->validity);
+    PyObject_Del(o);
+}
+
+// PostgreSQL's infinity and -infinity are the largest and smallest values, so they are left
+// alone when moving the epoch of dates and timestamps so they stay at the extremes.
+
+template<typename T>
+inline T Convert(const char* p, T offset)
+{
+    T value;
+    memcpy(&value, p, sizeof(T));
+    value = FromNetwork(value);
+    if (offset != 0 && value != std::numeric_limits<T>::min() && value != std::numeric_limits<T>::max())
+        value += offset;
+    return value;
+}
+
+template<typename T>
+static Py_ssize_t Fill(PGresult* result, int iCol, T* data, uint8_t* validity, T offset = 0)
+{
+    // Copies the column's values into `data`, swapping them to the native byte order, and sets
+    // the validity bits of the non-NULL values.  Returns the number of NULLs.  `offset` is
+    // added to dates and timestamps to move their epoch to 1970.
+
+    Py_ssize_t nulls = 0;
+
+    for (int iRow = 0, cRows = PQntuples(result); iRow < cRows; iRow++)
+    {
+        if (PQgetisnull(result, iRow, iCol))
+        {
+            data[iRow] = 0;
+            nulls++;
+            continue;
+        }
+
+        data[iRow] = Convert(PQgetvalue(result, iRow, iCol), offset);
+        validity[iRow / 8] |= (uint8_t)(1 << (iRow % 8));
+    }
+
+    return nulls;
+}
+
+Py_ssize_t FillColumn(PGresult* result, int iCol, char* data, uint8_t* validity)
+{
+    switch (PQftype(result, iCol))
+    {
+    case BOOLOID:
+        return Fill(result, iCol, (int8_t*)data, validity);
+
+    case INT2OID:
+        return Fill(result, iCol, (int16_t*)data, validity);
+
+    case INT4OID:
+        return Fill(result, iCol, (int32_t*)data, validity);
+
+    case INT8OID:
+        return Fill(result, iCol, (int64_t*)data, validity);
+
+    case FLOAT4OID:
+        return Fill(result, iCol, (float*)data, validity);
+
+    case FLOAT8OID:
+        return Fill(result, iCol, (double*)data, validity);
+
+    case DATEOID:
+        return Fill(result, iCol, (int32_t*)data, validity, DAYS_1970_TO_2000);
+
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+        return Fill(result, iCol, (int64_t*)data, validity, MICROS_1970_TO_2000);
+    }
+
+    return 0;
+}
+
+static void Store(Oid oid, char* dest, const char* p)
+{
+    switch (oid)
+    {
+    case BOOLOID:
+        *(int8_t*)dest = (*p != 0);
+        break;
+
+    case INT2OID:
+        *(int16_t*)dest = Convert<int16_t>(p, 0);
+        break;
+
+    case INT4OID:
+        *(int32_t*)dest = Convert<int32_t>(p, 0);
+        break;
+
+    case INT8OID:
+        *(int64_t*)dest = Convert<int64_t>(p, 0);
+        break;
+
+    case FLOAT4OID:
+        *(float*)dest = Convert<float>(p, 0);
+        break;
+
+    case FLOAT8OID:
+        *(double*)dest = Convert<double>(p, 0);
+        break;
+
+    case DATEOID:
+        *(int32_t*)dest = Convert<int32_t>(p, DAYS_1970_TO_2000);
+        break;
+
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+        *(int64_t*)dest = Convert<int64_t>(p, MICROS_1970_TO_2000);
+        break;
+    }
+}
+
+bool ColumnBuffer_Append(ColumnBuffer* self, const char* p)
+{
+    Py_ssize_t itemsize = self->layout->itemsize;
+
+    if (self->count == self->capacity)
+    {
+        Py_ssize_t capacity = self->capacity * 2;
+
+        char* data = (char*)realloc(self->data, capacity * itemsize);
+        if (data == 0)
+            return false;
+        self->data = data;
+
+        uint8_t* validity = (uint8_t*)realloc(self->validity, capacity / 8 + 1);
+        if (validity == 0)
+            return false;
+        memset(validity + self->capacity / 8 + 1, 0, capacity / 8 - self->capacity / 8);
+        self->validity = validity;
+
+        self->capacity = capacity;
+    }
+
+    Py_ssize_t i = self->count++;
+    char* dest = self->data + i * itemsize;
+
+    if (p == 0)
+    {
+        memset(dest, 0, itemsize);
+        self->null_count++;
+        return true;
+    }
+
+    Store(self->layout->oid, dest, p);
+    self->validity[i / 8] |= (uint8_t)(1 << (i % 8));
+    return true;
+}
+
+PyObject* ColumnBuffer_FromResult(PGresult* result, int iCol, bool integer_datetimes)
+{
+    Oid oid = PQftype(result, iCol);
+
+    const ColumnLayout* layout = GetColumnLayout(oid);
+    if (layout == 0)
+        return PyErr_Format(Error, "Column %d has type %d, which cannot be stored in a column buffer", iCol, (int)oid);
+
+    if (PQfformat(result, iCol) != FORMAT_BINARY)
+        return PyErr_Format(Error, "Column %d was not returned in binary format", iCol);
+
+    if ((oid == TIMESTAMPOID || oid == TIMESTAMPTZOID) && !integer_datetimes)
+        return PyErr_Format(Error, "Column %d is a floating point timestamp, which is not supported", iCol);
+
+    Py_ssize_t count = PQntuples(result);
+
+    ColumnBuffer* self = ColumnBuffer_New(layout, count);
+    if (self == 0)
+        return 0;
+
+    self->null_count = FillColumn(result, iCol, self->data, self->validity);
+    self->count      = count;
+
+    return (PyObject*)self;
+}
+
+static int ColumnBuffer_getbuffer(PyObject* o, Py_buffer* view, int flags)
+{
+    ColumnBuffer* self = (ColumnBuffer*)o;
+
+    if (flags & PyBUF_WRITABLE)
+    {
+        PyErr_SetString(PyExc_BufferError, "Column buffers are read-only");
+        return -1;
+    }
+
+    view->obj        = o;
+    view->buf        = self->data;
+    view->len        = self->count * self->layout->itemsize;
+    view->readonly   = 1;
+    view->itemsize   = self->layout->itemsize;
+    view->format     = (flags & PyBUF_FORMAT) ? (char*)self->layout->format : 0;
+    view->ndim       = 1;
+    view->shape      = (flags & PyBUF_ND) ? &self->count : 0;
+    view->strides    = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &view->itemsize : 0;
+    view->suboffsets = 0;
+    view->internal   = 0;
+
+    Py_INCREF(o);
+    return 0;
+}
+
+static PyBufferProcs ColumnBuffer_as_buffer =
+{
+    ColumnBuffer_getbuffer,     // bf_getbuffer
+    0,                          // bf_releasebuffer
+};
+
+static Py_ssize_t ColumnBuffer_length(PyObject* o)
+{
+    return ((ColumnBuffer*)o)->count;
+}
+
+static PySequenceMethods ColumnBuffer_as_sequence =
+{
+    ColumnBuffer_length,        // sq_length
+    0,                          // sq_concat
+    0,                          // sq_repeat
+    0,                          // sq_item
+    0,                          // was_sq_slice
+    0,                          // sq_ass_item
+    0,                          // sq_ass_slice
+    0,                          // sq_contains
+};
+
+static PyObject* ColumnBuffer_repr(PyObject* o)
+{
+    ColumnBuffer* self = (ColumnBuffer*)o;
+    return PyUnicode_FromFormat("<ColumnBuffer %s count=%zd nulls=%zd>", self->layout->name, self->count, self->null_count);
+}
+
+static PyObject* ColumnBuffer_gettype(PyObject* o, void* closure)
+{
+    UNUSED(closure);
+    return PyUnicode_FromString(((ColumnBuffer*)o)->layout->name);
+}
+
+static PyObject* ColumnBuffer_getformat(PyObject* o, void* closure)
+{
+    UNUSED(closure);
+    return PyUnicode_FromString(((ColumnBuffer*)o)->layout->format);
+}
+
+static PyObject* ColumnBuffer_getvalidity(PyObject* o, void* closure)
+{
+    UNUSED(closure);
+    ColumnBuffer* self = (ColumnBuffer*)o;
+    return PyBytes_FromStringAndSize((const char*)self->validity, (self->count + 7) / 8);
+}
+
+static PyObject* ColumnBuffer_getitemsize(PyObject* o, void* closure)
+{
+    UNUSED(closure);
+    return PyLong_FromSsize_t(((ColumnBuffer*)o)->layout->itemsize);
+}
+
+static PyGetSetDef ColumnBuffer_getsetters[] =
+{
+    { (char*)"type",     ColumnBuffer_gettype,     0, (char*)"the PostgreSQL type name of the values", 0 },
+    { (char*)"format",   ColumnBuffer_getformat,   0, (char*)"the struct module format of each value", 0 },
+    { (char*)"itemsize", ColumnBuffer_getitemsize, 0, (char*)"the size of each value in bytes", 0 },
+    { (char*)"validity", ColumnBuffer_getvalidity, 0, (char*)"bitmap of the values that are not NULL", 0 },
+    { 0 }
+};
+
+static PyMemberDef ColumnBuffer_members[] =
+{
+    { (char*)"null_count", T_PYSSIZET,  offsetof(ColumnBuffer, null_count), READONLY, (char*)"the number of NULL values" },
+    { 0 }
+};
+
+static PyObject* ColumnBuffer_arrow_c_array(PyObject* o, PyObject* args, PyObject* kwargs)
+{
+    // The requested schema is optional and we can only produce one, so it is ignored.
+
+    static const char* kwlist[] = { "requested_schema", 0 };
+    PyObject* requested_schema = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", (char**)kwlist, &requested_schema))
+        return 0;
+
+    return Arrow_ExportColumnBuffer((ColumnBuffer*)o);
+}
+
+static const char doc_arrow_c_array[] =
+    "ColumnBuffer.__arrow_c_array__(requested_schema=None) --> (schema capsule, array capsule)\n"
+    "\n"
+    "Exports the values as an Arrow array, sharing the buffer's memory.";
+
+static PyMethodDef ColumnBuffer_methods[] =
+{
+    { "__arrow_c_array__", (PyCFunction)ColumnBuffer_arrow_c_array, METH_VARARGS | METH_KEYWORDS, doc_arrow_c_array },
+    { 0, 0, 0, 0 }
+};
+
+static const char doc_columnbuffer[] =
+    "The values of one column as a native array supporting the buffer protocol.";
+
+PyTypeObject ColumnBufferType =
+{
+    PyVarObject_HEAD_INIT(0, 0)
+    "pglib.ColumnBuffer",       // tp_name
+    sizeof(ColumnBuffer),       // tp_basicsize
+    0,                          // tp_itemsize
+    ColumnBuffer_dealloc,       // destructor tp_dealloc
+    0,                          // tp_print
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_compare
+    ColumnBuffer_repr,          // tp_repr
+    0,                          // tp_as_number
+    &ColumnBuffer_as_sequence,  // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    &ColumnBuffer_as_buffer,    // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,         // tp_flags
+    doc_columnbuffer,           // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    0,                          // tp_iter
+    0,                          // tp_iternext
+    ColumnBuffer_methods,       // tp_methods
+    ColumnBuffer_members,       // tp_members
+    ColumnBuffer_getsetters,    // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    0,                          // tp_new
+    0,                          // tp_free
+    0,                          // tp_is_gc
+    0,                          // tp_bases
+    0,                          // tp_mro
+    0,                          // tp_cache
+    0,                          // tp_subclasses
+    0,                          // tp_weaklist
+};
@@ -0,0 +1,73 @@
+
+#ifndef COLUMNBUFFER_H
+#define COLUMNBUFFER_H
+
+extern PyTypeObject ColumnBufferType;
+
+struct ColumnLayout
+{
+    // How the values of a fixed-width type are stored in a ColumnBuffer.
+
+    Oid oid;
+    const char* name;
+
+    const char* format;
+    // The struct module format of one item, as reported by the buffer protocol.
+
+    Py_ssize_t itemsize;
+
+    const char* arrow;
+    // The Arrow C data interface format of the values.
+};
+
+const ColumnLayout* GetColumnLayout(Oid oid);
+// Returns the layout for a type that can be stored in a ColumnBuffer or zero if it can't be.
+
+Py_ssize_t FillColumn(PGresult* result, int iCol, char* data, uint8_t* validity);
+// Stores the values of binary column `iCol`, which must have a ColumnLayout, in `data` and
+// sets the bits in `validity`, which must be zeroed, of the values that are not NULL.
+// Returns the number of NULLs.  This does not use the Python API, so the GIL can be
+// released.
+
+const ColumnLayout* GetColumnLayoutByName(const char* szName);
+// Returns the layout for the type named `szName`, such as "int4", or zero if there isn't one.
+
+struct ColumnBuffer
+{
+    // The values of one column stored as a native array.  Values are stored in the machine's
+    // byte order.  Dates are stored as days and timestamps as microseconds since 1970-01-01,
+    // the same as numpy's datetime64[D] and datetime64[us].
+
+    PyObject_HEAD
+
+    const ColumnLayout* layout;
+
+    char* data;
+    // `count` items of layout->itemsize bytes.  NULL values are stored as zero.
+
+    uint8_t* validity;
+    // A bit for each value, set if the value is not NULL.  The bits are in the same order as
+    // Arrow's: bit `i % 8` of byte `i / 8`.
+
+    Py_ssize_t count;
+
+    Py_ssize_t capacity;
+    // The number of items `data` and `validity` have room for.
+
+    Py_ssize_t null_count;
+};
+
+ColumnBuffer* ColumnBuffer_New(const ColumnLayout* layout, Py_ssize_t capacity);
+// Returns an empty ColumnBuffer with room for `capacity` values.
+
+bool ColumnBuffer_Append(ColumnBuffer* self, const char* p);
+// Appends the value at `p`, which is in PostgreSQL's binary format and must be
+// layout->itemsize bytes, or a NULL if `p` is zero.  Returns false if out of memory.  This does
+// not use the Python API, so the GIL can be released, but it must not be called once the
+// buffer has been returned to Python.
+
+PyObject* ColumnBuffer_FromResult(PGresult* result, int iCol, bool integer_datetimes);
+// Returns a ColumnBuffer with the values of column `iCol`.  The column must be in binary
+// format and have a type with a ColumnLayout.
+
+#endif // COLUMNBUFFER_H
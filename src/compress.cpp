@@ -0,0 +1,461 @@
+
+#include "pglib.h"
+#include "compress.h"
+#include "errors.h"
+
+#ifdef PGLIB_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef PGLIB_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static const size_t CODEC_OUTPUT_SIZE = 64 * 1024;
+
+bool Compression_FromObject(PyObject* obj, bool allow_auto, Compression& compression)
+{
+    compression = COMPRESSION_NONE;
+
+    if (obj == 0 || obj == Py_None)
+        return true;
+
+    const char* sz = PyUnicode_Check(obj) ? PyUnicode_AsUTF8(obj) : 0;
+    if (sz == 0)
+    {
+        PyErr_Clear();
+        SetStringError(PyExc_TypeError, "compression must be None, 'gzip', 'zstd', or 'auto'");
+        return false;
+    }
+
+    if (strcmp(sz, "gzip") == 0)
+    {
+#ifdef PGLIB_HAVE_ZLIB
+        compression = COMPRESSION_GZIP;
+        return true;
+#else
+        SetStringError(Error, "pglib was built without gzip support");
+        return false;
+#endif
+    }
+
+    if (strcmp(sz, "zstd") == 0)
+    {
+#ifdef PGLIB_HAVE_ZSTD
+        compression = COMPRESSION_ZSTD;
+        return true;
+#else
+        SetStringError(Error, "pglib was built without zstd support");
+        return false;
+#endif
+    }
+
+    if (allow_auto && strcmp(sz, "auto") == 0)
+    {
+        compression = COMPRESSION_AUTO;
+        return true;
+    }
+
+    SetStringError(PyExc_ValueError, allow_auto ? "compression must be None, 'gzip', 'zstd', or 'auto'"
+                                                : "compression must be None, 'gzip', or 'zstd'");
+    return false;
+}
+
+struct CodecState
+{
+    char* out;
+    // The output buffer, CODEC_OUTPUT_SIZE bytes.
+
+    bool started;
+    // True once the codec for `type` has been initialized.
+
+    bool open;
+    // When decompressing, true if we are in the middle of a gzip member or zstd frame.
+
+    unsigned char magic[4];
+    size_t cMagic;
+    // The first bytes, held until we have enough to detect the format for COMPRESSION_AUTO.
+
+#ifdef PGLIB_HAVE_ZLIB
+    z_stream zs;
+#endif
+#ifdef PGLIB_HAVE_ZSTD
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+#endif
+};
+
+Codec::Codec(Compression _type, bool _compress)
+{
+    type     = _type;
+    compress = _compress;
+    szError  = 0;
+
+    state = (CodecState*)calloc(1, sizeof(CodecState));
+    if (state)
+    {
+        state->out = (char*)malloc(CODEC_OUTPUT_SIZE);
+        if (state->out == 0)
+        {
+            free(state);
+            state = 0;
+        }
+    }
+}
+
+Codec::~Codec()
+{
+    if (state == 0)
+        return;
+
+    if (state->started)
+    {
+#ifdef PGLIB_HAVE_ZLIB
+        if (type == COMPRESSION_GZIP)
+        {
+            if (compress)
+                deflateEnd(&state->zs);
+            else
+                inflateEnd(&state->zs);
+        }
+#endif
+#ifdef PGLIB_HAVE_ZSTD
+        if (type == COMPRESSION_ZSTD)
+        {
+            if (compress)
+                ZSTD_freeCCtx(state->cctx);
+            else
+                ZSTD_freeDCtx(state->dctx);
+        }
+#endif
+    }
+
+    free(state->out);
+    free(state);
+}
+
+static bool Start(Codec* codec)
+{
+    // Initializes the library for codec->type.
+
+    CodecState* state = codec->state;
+
+    switch (codec->type)
+    {
+#ifdef PGLIB_HAVE_ZLIB
+    case COMPRESSION_GZIP:
+    {
+        // Adding 16 to the window bits selects the gzip format instead of zlib's.
+        int rc;
+        if (codec->compress)
+            rc = deflateInit2(&state->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        else
+            rc = inflateInit2(&state->zs, 16 + MAX_WBITS);
+        if (rc != Z_OK)
+        {
+            codec->szError = "Unable to initialize zlib";
+            return false;
+        }
+        break;
+    }
+#endif
+
+#ifdef PGLIB_HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        if (codec->compress)
+            state->cctx = ZSTD_createCCtx();
+        else
+            state->dctx = ZSTD_createDCtx();
+        if ((codec->compress ? (void*)state->cctx : (void*)state->dctx) == 0)
+        {
+            codec->szError = "Unable to initialize zstd";
+            return false;
+        }
+        break;
+#endif
+
+    default:
+        break;
+    }
+
+    state->started = true;
+    return true;
+}
+
+static bool Detect(Codec* codec)
+{
+    // Chooses the format for COMPRESSION_AUTO from the first bytes.  Data that is not gzip or
+    // zstd is passed through unchanged.
+
+    CodecState* state = codec->state;
+    const unsigned char* m = state->magic;
+
+    if (state->cMagic >= 2 && m[0] == 0x1F && m[1] == 0x8B)
+    {
+#ifdef PGLIB_HAVE_ZLIB
+        codec->type = COMPRESSION_GZIP;
+#else
+        codec->szError = "The data is gzip compressed but pglib was built without gzip support";
+        return false;
+#endif
+    }
+    else if (state->cMagic >= 4 && m[0] == 0x28 && m[1] == 0xB5 && m[2] == 0x2F && m[3] == 0xFD)
+    {
+#ifdef PGLIB_HAVE_ZSTD
+        codec->type = COMPRESSION_ZSTD;
+#else
+        codec->szError = "The data is zstd compressed but pglib was built without zstd support";
+        return false;
+#endif
+    }
+    else
+    {
+        codec->type = COMPRESSION_NONE;
+    }
+
+    return Start(codec);
+}
+
+#ifdef PGLIB_HAVE_ZLIB
+
+static int GzipCompress(Codec* codec, const char* p, size_t cb, int flush, CodecSink sink, void* context)
+{
+    CodecState* state = codec->state;
+    z_stream& zs = state->zs;
+
+    zs.next_in  = (Bytef*)p;
+    zs.avail_in = (uInt)cb;
+
+    for (;;)
+    {
+        zs.next_out  = (Bytef*)state->out;
+        zs.avail_out = (uInt)CODEC_OUTPUT_SIZE;
+
+        int rc = deflate(&zs, flush);
+        if (rc == Z_STREAM_ERROR)
+        {
+            codec->szError = "gzip compression failed";
+            return CODEC_ERROR;
+        }
+
+        size_t produced = CODEC_OUTPUT_SIZE - zs.avail_out;
+        if (produced && !sink(context, state->out, produced))
+            return CODEC_STOPPED;
+
+        if (flush == Z_FINISH ? (rc == Z_STREAM_END) : (zs.avail_out != 0))
+            return CODEC_OK;
+    }
+}
+
+static int GzipDecompress(Codec* codec, const char* p, size_t cb, CodecSink sink, void* context)
+{
+    CodecState* state = codec->state;
+    z_stream& zs = state->zs;
+
+    zs.next_in  = (Bytef*)p;
+    zs.avail_in = (uInt)cb;
+
+    for (;;)
+    {
+        if (!state->open)
+        {
+            // The data may be several gzip members concatenated together, as produced by
+            // pigz or by appending .gz files, so start a new one if there is more input.
+            if (zs.avail_in == 0)
+                return CODEC_OK;
+            inflateReset(&zs);
+            state->open = true;
+        }
+
+        zs.next_out  = (Bytef*)state->out;
+        zs.avail_out = (uInt)CODEC_OUTPUT_SIZE;
+
+        int rc = inflate(&zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+        {
+            codec->szError = (rc == Z_MEM_ERROR) ? "Out of memory" : "Invalid gzip data";
+            return CODEC_ERROR;
+        }
+
+        size_t produced = CODEC_OUTPUT_SIZE - zs.avail_out;
+        if (produced && !sink(context, state->out, produced))
+            return CODEC_STOPPED;
+
+        if (rc == Z_STREAM_END)
+        {
+            state->open = false;
+            continue;
+        }
+
+        // inflate only stops early when the output buffer is full.
+        if (zs.avail_out != 0)
+            return CODEC_OK;
+    }
+}
+
+#endif // PGLIB_HAVE_ZLIB
+
+#ifdef PGLIB_HAVE_ZSTD
+
+static int ZstdCompress(Codec* codec, const char* p, size_t cb, ZSTD_EndDirective mode, CodecSink sink, void* context)
+{
+    CodecState* state = codec->state;
+
+    ZSTD_inBuffer in = { p, cb, 0 };
+
+    for (;;)
+    {
+        ZSTD_outBuffer out = { state->out, CODEC_OUTPUT_SIZE, 0 };
+
+        size_t remaining = ZSTD_compressStream2(state->cctx, &out, &in, mode);
+        if (ZSTD_isError(remaining))
+        {
+            codec->szError = ZSTD_getErrorName(remaining);
+            return CODEC_ERROR;
+        }
+
+        if (out.pos && !sink(context, state->out, out.pos))
+            return CODEC_STOPPED;
+
+        if (mode == ZSTD_e_end ? (remaining == 0) : (in.pos == in.size))
+            return CODEC_OK;
+    }
+}
+
+static int ZstdDecompress(Codec* codec, const char* p, size_t cb, CodecSink sink, void* context)
+{
+    CodecState* state = codec->state;
+
+    ZSTD_inBuffer in = { p, cb, 0 };
+
+    for (;;)
+    {
+        ZSTD_outBuffer out = { state->out, CODEC_OUTPUT_SIZE, 0 };
+
+        size_t rc = ZSTD_decompressStream(state->dctx, &out, &in);
+        if (ZSTD_isError(rc))
+        {
+            codec->szError = ZSTD_getErrorName(rc);
+            return CODEC_ERROR;
+        }
+
+        // Zero means a frame was completely decoded and flushed.
+        state->open = (rc != 0);
+
+        if (out.pos && !sink(context, state->out, out.pos))
+            return CODEC_STOPPED;
+
+        if (in.pos == in.size && out.pos < out.size)
+            return CODEC_OK;
+    }
+}
+
+#endif // PGLIB_HAVE_ZSTD
+
+static int Process(Codec* codec, const char* p, size_t cb, CodecSink sink, void* context)
+{
+    switch (codec->type)
+    {
+#ifdef PGLIB_HAVE_ZLIB
+    case COMPRESSION_GZIP:
+        return codec->compress ? GzipCompress(codec, p, cb, Z_NO_FLUSH, sink, context)
+                               : GzipDecompress(codec, p, cb, sink, context);
+#endif
+#ifdef PGLIB_HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        return codec->compress ? ZstdCompress(codec, p, cb, ZSTD_e_continue, sink, context)
+                               : ZstdDecompress(codec, p, cb, sink, context);
+#endif
+    default:
+        if (cb && !sink(context, p, cb))
+            return CODEC_STOPPED;
+        return CODEC_OK;
+    }
+}
+
+int Codec::Write(const char* p, size_t cb, CodecSink sink, void* context)
+{
+    if (state == 0)
+    {
+        szError = "Out of memory";
+        return CODEC_ERROR;
+    }
+
+    if (type == COMPRESSION_AUTO)
+    {
+        size_t take = sizeof(state->magic) - state->cMagic;
+        if (take > cb)
+            take = cb;
+        memcpy(&state->magic[state->cMagic], p, take);
+        state->cMagic += take;
+        p  += take;
+        cb -= take;
+
+        if (state->cMagic < sizeof(state->magic))
+            return CODEC_OK;
+
+        if (!Detect(this))
+            return CODEC_ERROR;
+
+        int rc = Process(this, (const char*)state->magic, state->cMagic, sink, context);
+        if (rc != CODEC_OK)
+            return rc;
+    }
+    else if (!state->started && !Start(this))
+    {
+        return CODEC_ERROR;
+    }
+
+    return Process(this, p, cb, sink, context);
+}
+
+int Codec::Finish(CodecSink sink, void* context)
+{
+    if (state == 0)
+    {
+        szError = "Out of memory";
+        return CODEC_ERROR;
+    }
+
+    if (type == COMPRESSION_AUTO)
+    {
+        // There were fewer than 4 bytes.
+        if (!Detect(this))
+            return CODEC_ERROR;
+        int rc = Process(this, (const char*)state->magic, state->cMagic, sink, context);
+        if (rc != CODEC_OK)
+            return rc;
+    }
+    else if (!state->started && !Start(this))
+    {
+        return CODEC_ERROR;
+    }
+
+    switch (type)
+    {
+#ifdef PGLIB_HAVE_ZLIB
+    case COMPRESSION_GZIP:
+        if (compress)
+            return GzipCompress(this, 0, 0, Z_FINISH, sink, context);
+        if (state->open)
+        {
+            szError = "The gzip data is truncated";
+            return CODEC_ERROR;
+        }
+        return CODEC_OK;
+#endif
+#ifdef PGLIB_HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        if (compress)
+            return ZstdCompress(this, 0, 0, ZSTD_e_end, sink, context);
+        if (state->open)
+        {
+            szError = "The zstd data is truncated";
+            return CODEC_ERROR;
+        }
+        return CODEC_OK;
+#endif
+    default:
+        return CODEC_OK;
+    }
+}
@@ -0,0 +1,60 @@
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// Streaming gzip and zstd compression for COPY data.
+//
+// zlib and libzstd are optional.  setup.py defines PGLIB_HAVE_ZLIB and PGLIB_HAVE_ZSTD when
+// it finds them.  None of the functions here use the GIL, so they can be called with it
+// released.
+
+enum Compression
+{
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,
+    COMPRESSION_AUTO,
+    // Detect gzip or zstd from the first bytes, otherwise uncompressed.  Decompression only.
+};
+
+bool Compression_FromObject(PyObject* obj, bool allow_auto, Compression& compression);
+// Converts the `compression` keyword, which can be None, 'gzip', 'zstd', or 'auto' if
+// allow_auto is true.  Raises an error and returns false if the value is invalid or pglib was
+// built without the library.
+
+typedef bool (*CodecSink)(void* context, const char* p, size_t cb);
+// Receives output from a codec.  Returns false to stop, in which case the codec returns
+// CODEC_STOPPED and the sink is responsible for remembering why.
+
+enum
+{
+    CODEC_OK,
+    CODEC_STOPPED,
+    CODEC_ERROR,
+    // The data is invalid or memory could not be allocated.  See Codec::szError.
+};
+
+struct CodecState;
+
+struct Codec
+{
+    Compression type;
+    bool compress;
+
+    CodecState* state;
+
+    const char* szError;
+    // A static description of the last CODEC_ERROR.
+
+    Codec(Compression type, bool compress);
+    ~Codec();
+
+    int Write(const char* p, size_t cb, CodecSink sink, void* context);
+    // Compresses or decompresses `p`, passing any output to `sink`.
+
+    int Finish(CodecSink sink, void* context);
+    // Writes any remaining output.  When decompressing, this reports an error if the data was
+    // truncated.
+};
+
+#endif // COMPRESS_H
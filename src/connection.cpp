@@ -6,7 +6,21 @@
 #include "params.h"
 #include "getdata.h"
 #include "row.h"
+#include "stream.h"
+#include "cursor.h"
+#include "pool.h"
+#include "copy.h"
+#include "columnbuffer.h"
+#include "datatypes.h"
 #include <math.h> // modf
+#include <vector>
+
+#ifdef MS_WINDOWS
+#include <Winsock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
 
 struct ConstantDef
 {
@@ -28,6 +42,7 @@ enum {
     REQUIRE_SYNC            = 0x02,
     REQUIRE_ASYNC           = 0x04,
     REQUIRE_ASYNC_CONNECTED = 0x08 | REQUIRE_OPEN | REQUIRE_ASYNC,
+    REQUIRE_IDLE            = 0x10,
 };
 
 inline Connection* CastConnection(PyObject* self, int flags=0)
@@ -44,6 +59,12 @@ inline Connection* CastConnection(PyObject* self, int flags=0)
         return 0;
     }
 
+    if ((flags & REQUIRE_IDLE) && cnxn->busy)
+    {
+        SetStringError(Error, "The connection is busy reading the results of a stream or cursor");
+        return 0;
+    }
+
     if ((flags & REQUIRE_SYNC) && (cnxn->async_status != ASYNC_STATUS_SYNC))
     {
         SetStringError(Error, "The connection is not synchronous");
@@ -84,7 +105,7 @@ static void OnCompleteConnection(Connection* cnxn)
     // paths.
 
     const char* szID = PQparameterStatus(cnxn->pgconn, "integer_datetimes");
-    cnxn->integer_datetimes = (szID == 0) || (strcmp(szID, "on") == 0);
+    cnxn->decode.integer_datetimes = (szID == 0) || (strcmp(szID, "on") == 0);
 }
 
 PyObject* Connection_New(PGconn* pgconn, bool async)
@@ -103,6 +124,18 @@ PyObject* Connection_New(PGconn* pgconn, bool async)
     cnxn->pgconn = pgconn;
     cnxn->tracefile = 0;
 
+    StatementCache_Init(&cnxn->stmtcache);
+
+    cnxn->pool = 0;
+    cnxn->busy = false;
+    cnxn->lazy_rows = false;
+
+    cnxn->decode.integer_datetimes = true;
+    cnxn->decode.numeric_as = NUMERIC_AS_DECIMAL;
+    cnxn->decode.json_as = JSON_AS_OBJECT;
+    cnxn->decode.uuid_as = UUID_AS_UUID;
+    cnxn->decode.strip_char = false;
+
     cnxn->async_status = async ? ASYNC_STATUS_CONNECTING : ASYNC_STATUS_SYNC;
 
     if (!async)
@@ -113,11 +146,42 @@ PyObject* Connection_New(PGconn* pgconn, bool async)
     return reinterpret_cast<PyObject*>(cnxn);
 }
 
-static PGresult* internal_execute(PyObject* self, PyObject* args)
+PyObject* Connection_Connect(const char* conninfo)
 {
-    Connection* cnxn = (Connection*)self;
+    PGconn* pgconn;
+    Py_BEGIN_ALLOW_THREADS
+    pgconn = PQconnectdb(conninfo);
+    Py_END_ALLOW_THREADS
+    if (pgconn == 0)
+        return PyErr_NoMemory();
+
+    if (PQstatus(pgconn) != CONNECTION_OK)
+    {
+        const char* szError = PQerrorMessage(pgconn);
+        PyErr_SetString(Error, szError);
+        Py_BEGIN_ALLOW_THREADS
+        PQfinish(pgconn);
+        Py_END_ALLOW_THREADS
+        return 0;
+    }
+
+    return Connection_New(pgconn, false);
+}
+
+static PGresult* internal_execute(PyObject* self, PyObject* args, Statement** pstmt = 0)
+{
+    // Executes the SQL in args[0] using the remaining arguments as parameters.
+    //
+    // If the statement cache is enabled, the statement is prepared on the server and the
+    // cached Statement is returned in *pstmt (if it was passed), allowing the caller to reuse
+    // the statement's column information.
 
-    // TODO: Check connection state.
+    if (pstmt)
+        *pstmt = 0;
+
+    Connection* cnxn = CastConnection(self, REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
 
     Py_ssize_t cParams = PyTuple_Size(args) - 1;
     if (cParams < 0)
@@ -138,15 +202,28 @@ static PGresult* internal_execute(PyObject* self, PyObject* args)
         return 0;
 
     PGresult* result;
-    Py_BEGIN_ALLOW_THREADS
-    result = PQexecParams(cnxn->pgconn, PyUnicode_AsUTF8(pSql),
-                          cParams,
-                          params.types,
-                          params.values,
-                          params.lengths,
-                          params.formats,
-                          1); // binary format
-    Py_END_ALLOW_THREADS
+
+    if (cnxn->stmtcache.capacity > 0)
+    {
+        Statement* stmt = 0;
+        result = StatementCache_Execute(cnxn, pSql, params, &stmt);
+        if (result == 0 && PyErr_Occurred())
+            return 0;
+        if (pstmt)
+            *pstmt = stmt;
+    }
+    else
+    {
+        Py_BEGIN_ALLOW_THREADS
+        result = PQexecParams(cnxn->pgconn, PyUnicode_AsUTF8(pSql),
+                              cParams,
+                              params.types,
+                              params.values,
+                              params.lengths,
+                              params.formats,
+                              1); // binary format
+        Py_END_ALLOW_THREADS
+    }
 
     if (result == 0)
     {
@@ -167,7 +244,9 @@ static PyObject* Connection_script(PyObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, "U", &pScript))
         return 0;
 
-    Connection* cnxn = (Connection*)self;
+    Connection* cnxn = CastConnection(self, REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
     ResultHolder result = PQexec(cnxn->pgconn, PyUnicode_AsUTF8(pScript));
     if (result == 0)
         return 0;
@@ -184,135 +263,528 @@ static PyObject* Connection_script(PyObject* self, PyObject* args)
 }
 
 const char* doc_copy_from_csv =
-    "Connection.copy_from_csv(table, source, header=0) --> None\n"
+    "Connection.copy_from_csv(table, source, header=0, chunk_size=1048576, compression=None) --> int\n"
     "\n"
-    "Executes a COPY FROM command.\n"
+    "Executes a COPY FROM command and returns the number of rows copied.\n"
     "\n"
     "table\n"
     "  The table to copy to.  This can also contain the columns to populate.\n"
     "\n"
     "source\n"
-    "  The data to copy from.  This can be a string formatted as CSV or a file-like\n"
-    "  object (anything with a read method that returns a string or bytes object).\n"
+    "  The data to copy from.  This can be a string or bytes object formatted as CSV, a\n"
+    "  file-like object (anything with a readinto or read method), an integer file\n"
+    "  descriptor, or an os.PathLike object such as a pathlib.Path.  File descriptors and\n"
+    "  paths are read without holding the GIL.\n"
+    "\n"
+    "chunk_size\n"
+    "  The number of bytes to read and send at a time.\n"
+    "\n"
+    "compression\n"
+    "  None, 'gzip', 'zstd', or 'auto' to detect gzip or zstd data.  The data is\n"
+    "  decompressed in C without holding the GIL.\n"
     "\n"
     "Examples:\n"
     "  cnxn.copy_from_csv('t1', open('test.csv'), header=1)\n"
     "  cnxn.copy_from_csv('t1(a,b,c)', open('test.csv'), header=1)\n"
-    "  cnxn.copy_from_csv('t1', gzip.open('test.csv'), header=1)\n"
+    "  cnxn.copy_from_csv('t1', pathlib.Path('test.csv.gz'), header=1, compression='gzip')\n"
+    "  cnxn.copy_from_csv('t1', pathlib.Path('test.csv'), header=1)\n"
     "  cnxn.copy_from_csv('t1', \"1,'one'\\n2,'two'\")\n";
 
 static PyObject* Connection_copy_from_csv(PyObject* self, PyObject* args, PyObject* kwargs)
 {
-    static const char *kwlist[] = { "table", "source", "header", 0 };
+    static const char *kwlist[] = { "table", "source", "header", "chunk_size", "compression", 0 };
 
     PyObject* table;
     PyObject* source;
     int header = 0;
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "UO|p", (char**)kwlist, &table, &source, &header))
+    Py_ssize_t chunk_size = 1024 * 1024;
+    PyObject* pCompression = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "UO|pnO", (char**)kwlist, &table, &source, &header, &chunk_size, &pCompression))
+        return 0;
+
+    Compression compression;
+    if (!Compression_FromObject(pCompression, true, compression))
+        return 0;
+
+    if (chunk_size < 1 || chunk_size > INT_MAX)
+        return SetStringError(PyExc_ValueError, "chunk_size must be a positive integer");
+
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
+
+    CopySource copysource;
+    if (!CopySource_Init(copysource, source))
         return 0;
 
     char header_token[] = "header";
     if (header == 0)
         header_token[0] = 0;
-    PyObject* sql = PyUnicode_FromFormat("copy %U from stdin with csv %s", table, header_token);
+    Object sql(PyUnicode_FromFormat("copy %U from stdin with csv %s", table, header_token));
+    const char* szSQL = sql ? PyUnicode_AsUTF8(sql) : 0;
+
+    ResultHolder result;
+    if (szSQL)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        result = PQexec(cnxn->pgconn, szSQL);
+        Py_END_ALLOW_THREADS
+    }
 
-    // If source is a string (Unicode), store the UTF-encoded value in buffer. If a byte
-    // object, store directly in buffer.  Otherwise, buffer will be zero and `source` must be
-    // an object with a read method (e.g. file).
-    const char* buffer = 0;
-    Py_ssize_t buffer_size = 0;
-    PyObject* read_method = 0;
+    PyObject* count = 0;
 
-    if (PyUnicode_Check(source))
+    if (szSQL == 0)
     {
-        buffer = PyUnicode_AsUTF8AndSize(source, &buffer_size);
-        if (buffer == 0)
-            return 0;
+        // The error is already set.
+    }
+    else if (result == 0)
+    {
+        SetConnectionError(cnxn);
+    }
+    else if (PQresultStatus(result) != PGRES_COPY_IN)
+    {
+        switch (PQresultStatus(result)) {
+        case PGRES_BAD_RESPONSE:
+        case PGRES_NONFATAL_ERROR:
+        case PGRES_FATAL_ERROR:
+            SetResultError(result.Detach());
+            break;
+
+        default:
+            PyErr_Format(Error, "Result was not PGRES_COPY_IN: %d", (int)PQresultStatus(result));
+        }
     }
     else
     {
-        if (!PyObject_HasAttrString(source, "read"))
-            return PyErr_Format(Error, "CSV source must be a string or file-like object.");
-        read_method = PyObject_GetAttrString(source, "read");
+        count = CopyIn_Source(cnxn, copysource, chunk_size, compression);
     }
 
-    Connection* cnxn = (Connection*)self;
+    return count;
+}
+
+static const char doc_copy_to[] =
+    "Connection.copy_to(source, dest=None, format='csv', header=False, compression=None) --> int | CopyOut\n"
+    "\n"
+    "Executes a COPY TO STDOUT command.\n"
+    "\n"
+    "source\n"
+    "  The table to copy from, optionally with a column list, or a query starting with\n"
+    "  SELECT, WITH, VALUES, or TABLE.\n"
+    "\n"
+    "dest\n"
+    "  A file-like object with a write method, or an integer file descriptor which is written\n"
+    "  without holding the GIL.  Both return the number of rows copied.  If None, an iterator\n"
+    "  is returned that yields the data as bytes objects.\n"
+    "\n"
+    "format\n"
+    "  'csv', 'text', or 'binary'.\n"
+    "\n"
+    "compression\n"
+    "  None, 'gzip', or 'zstd'.  The data is compressed in C without holding the GIL.\n"
+    "\n"
+    "Examples:\n"
+    "  cnxn.copy_to('t1', open('t1.csv', 'wb'), header=True)\n"
+    "  cnxn.copy_to('select a, b from t1 where a > 10', sys.stdout.fileno())\n"
+    "  for chunk in cnxn.copy_to('t1', format='binary'):\n"
+    "      sock.sendall(chunk)\n";
+
+static bool IsQuery(const char* sz)
+{
+    // Returns true if `sz` is a query rather than a table name.
+
+    static const char* keywords[] = { "select", "with", "values", "table" };
+
+    while (isspace((unsigned char)*sz))
+        sz++;
+
+    for (size_t i = 0; i < _countof(keywords); i++)
+    {
+        const char* kw = keywords[i];
+        const char* p  = sz;
+        while (*kw && tolower((unsigned char)*p) == *kw)
+        {
+            kw++;
+            p++;
+        }
+
+        if (*kw == 0 && !isalnum((unsigned char)*p) && *p != '_')
+            return true;
+    }
+
+    return false;
+}
+
+static bool StartCopyOut(Connection* cnxn, PyObject* source, const char* format, bool header)
+{
+    // Executes COPY ... TO STDOUT.  Returns true if the server is now sending the data.
+
+    const char* szSource = PyUnicode_AsUTF8(source);
+    if (szSource == 0)
+        return false;
+
+    Object sql(PyUnicode_FromFormat(IsQuery(szSource) ? "COPY (%U) TO STDOUT WITH (FORMAT %s%s)" : "COPY %U TO STDOUT WITH (FORMAT %s%s)",
+                                    source, format, header ? ", HEADER" : ""));
+    if (!sql)
+        return false;
+
     const char* szSQL = PyUnicode_AsUTF8(sql);
+    if (szSQL == 0)
+        return false;
+
     ResultHolder result;
     Py_BEGIN_ALLOW_THREADS
     result = PQexec(cnxn->pgconn, szSQL);
     Py_END_ALLOW_THREADS
 
     if (result == 0)
-        return 0;
+    {
+        SetConnectionError(cnxn);
+        return false;
+    }
 
     switch (PQresultStatus(result)) {
-    case PGRES_COPY_IN:
+    case PGRES_COPY_OUT:
         // This is what we are expecting.
         break;
 
     case PGRES_BAD_RESPONSE:
     case PGRES_NONFATAL_ERROR:
     case PGRES_FATAL_ERROR:
-        return SetResultError(result.Detach());
+        SetResultError(result.Detach());
+        return false;
 
     default:
-        return PyErr_Format(Error, "Result was not PGRES_COPY_IN: %d", (int)PQresultStatus(result));
+        PyErr_Format(Error, "Result was not PGRES_COPY_OUT: %d", (int)PQresultStatus(result));
+        return false;
     }
 
-    if (buffer != 0)
+    return true;
+}
+
+static PyObject* Connection_copy_to(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = { "source", "dest", "format", "header", "compression", 0 };
+
+    PyObject* source;
+    PyObject* dest = Py_None;
+    const char* format = "csv";
+    int header = 0;
+    PyObject* pCompression = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|OspO", (char**)kwlist, &source, &dest, &format, &header, &pCompression))
+        return 0;
+
+    Compression compression;
+    if (!Compression_FromObject(pCompression, false, compression))
+        return 0;
+
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
+
+    if (strcmp(format, "csv") != 0 && strcmp(format, "text") != 0 && strcmp(format, "binary") != 0)
+        return SetStringError(PyExc_ValueError, "format must be 'csv', 'text', or 'binary'");
+
+    if (header && strcmp(format, "csv") != 0)
+        return SetStringError(PyExc_ValueError, "header is only supported with the csv format");
+
+    int fd = -1;
+    if (PyBool_Check(dest))
     {
-        int copyStatus = 0;
-        Py_BEGIN_ALLOW_THREADS
-        copyStatus = PQputCopyData(cnxn->pgconn, buffer, (int)buffer_size);
-        Py_END_ALLOW_THREADS
-        if (copyStatus != 1)
-            return SetConnectionError(cnxn);
+        // bool is a subclass of int, but True is almost certainly not meant to be stdout.
+        return SetStringError(PyExc_TypeError, "dest cannot be a bool");
     }
-    else
+    else if (PyLong_Check(dest))
+    {
+        long l = PyLong_AsLong(dest);
+        if (l == -1 && PyErr_Occurred())
+            return 0;
+        if (l < 0 || l > INT_MAX)
+            return SetStringError(PyExc_ValueError, "dest is not a valid file descriptor");
+        fd = (int)l;
+    }
+    else if (dest != Py_None && !PyObject_HasAttrString(dest, "write"))
+    {
+        return SetStringError(PyExc_TypeError, "dest must be None, a file descriptor, or an object with a write method");
+    }
+
+    if (!StartCopyOut(cnxn, source, format, header))
+        return 0;
+
+    if (dest == Py_None)
+        return CopyOut_New(cnxn, compression);
+
+    if (fd != -1)
+        return CopyOut_ToFd(cnxn, fd, compression);
+
+    return CopyOut_ToFile(cnxn, dest, compression);
+}
+
+static const char doc_copy_to_columns[] =
+    "Connection.copy_to_columns(source, types) --> list of ColumnBuffer\n"
+    "\n"
+    "Executes a binary COPY TO STDOUT command and returns the values of each column in a\n"
+    "ColumnBuffer.  The data is parsed without holding the GIL and without creating a Python\n"
+    "object for each value.\n"
+    "\n"
+    "source\n"
+    "  The table to copy from, optionally with a column list, or a query starting with\n"
+    "  SELECT, WITH, VALUES, or TABLE.\n"
+    "\n"
+    "types\n"
+    "  The type name of each column: 'bool', 'int2', 'int4', 'int8', 'float4', 'float8',\n"
+    "  'date', 'timestamp', or 'timestamptz'.  Binary COPY data does not describe its\n"
+    "  columns, so these must match the source exactly.\n"
+    "\n"
+    "Example:\n"
+    "  ids, prices = cnxn.copy_to_columns('select id, price from items', ['int4', 'float8'])\n";
+
+static PyObject* Connection_copy_to_columns(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = { "source", "types", 0 };
+
+    PyObject* source;
+    PyObject* types;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "UO", (char**)kwlist, &source, &types))
+        return 0;
+
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
+
+    Object seq(PySequence_Fast(types, "types must be a sequence of type names"));
+    if (!seq)
+        return 0;
+
+    Py_ssize_t cColumns = PySequence_Fast_GET_SIZE(seq.Get());
+    if (cColumns == 0 || cColumns > SHRT_MAX)
+        return SetStringError(PyExc_ValueError, "types must have between 1 and 32767 type names");
+
+    std::vector<const ColumnLayout*> layouts((size_t)cColumns);
+
+    for (Py_ssize_t i = 0; i < cColumns; i++)
+    {
+        PyObject* name = PySequence_Fast_GET_ITEM(seq.Get(), i);
+        const char* szName = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : 0;
+        if (szName == 0)
+        {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError, "types must be a sequence of type names");
+            return 0;
+        }
+
+        layouts[i] = GetColumnLayoutByName(szName);
+        if (layouts[i] == 0)
+            return PyErr_Format(PyExc_ValueError, "Type '%s' cannot be stored in a column buffer", szName);
+    }
+
+    if (!StartCopyOut(cnxn, source, "binary", false))
+        return 0;
+
+    return CopyOut_ToColumns(cnxn, &layouts[0], (int)cColumns);
+}
+
+static const char doc_copy_from_rows[] =
+    "Connection.copy_from_rows(table, rows, columns=None) --> int\n"
+    "\n"
+    "Copies rows into a table using the binary COPY format and returns the number of rows\n"
+    "copied.\n"
+    "\n"
+    "table\n"
+    "  The table to copy to.\n"
+    "\n"
+    "rows\n"
+    "  An iterable of sequences, such as a list of tuples, each with one value per column.\n"
+    "\n"
+    "columns\n"
+    "  An optional sequence of the column names to populate.  Defaults to all columns.\n"
+    "\n"
+    "Example:\n"
+    "  cnxn.copy_from_rows('t1', [(1, 'one'), (2, 'two')], columns=['a', 'b'])\n";
+
+static PyObject* Connection_copy_from_rows(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = { "table", "rows", "columns", 0 };
+
+    PyObject* table;
+    PyObject* rows;
+    PyObject* columns = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "UO|O", (char**)kwlist, &table, &rows, &columns))
+        return 0;
+
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
+
+    // Build the column list, quoting each name.
+
+    Object collist;
+
+    if (columns != Py_None)
     {
-        Object read_args(Py_BuildValue("(l)", 20));
-        if (read_args == 0)
+        Object seq(PySequence_Fast(columns, "columns must be a sequence of column names"));
+        if (!seq)
             return 0;
 
-        for (;;)
+        Py_ssize_t count = PySequence_Fast_GET_SIZE(seq.Get());
+        if (count == 0)
+            return SetStringError(PyExc_ValueError, "columns cannot be empty");
+
+        Object names(PyList_New(count));
+        if (!names)
+            return 0;
+
+        for (Py_ssize_t i = 0; i < count; i++)
         {
-            Object s(PyObject_CallObject(read_method, read_args));
-            if (s == 0)
-                return 0;
-            if (PyBytes_Check(s))
-            {
-                buffer = PyBytes_AS_STRING(s.Get());
-                buffer_size = PyBytes_GET_SIZE(s.Get());
-            }
-            else if (PyUnicode_Check(s.Get()))
-            {
-                buffer = PyUnicode_AsUTF8AndSize(s.Get(), &buffer_size);
-            }
-            else
-            {
-                return PyErr_Format(Error, "Result of reading is not a bytes object: %R", s.Get());
-            }
-            if (buffer == 0)
+            PyObject* name = PySequence_Fast_GET_ITEM(seq.Get(), i);
+            if (!PyUnicode_Check(name))
+                return SetStringError(PyExc_TypeError, "columns must be a sequence of column names");
+
+            Py_ssize_t cb;
+            const char* sz = PyUnicode_AsUTF8AndSize(name, &cb);
+            if (sz == 0)
                 return 0;
-            if (buffer_size == 0)
-                break;
-            int copyStatus = 0;
-            Py_BEGIN_ALLOW_THREADS
-            copyStatus = PQputCopyData(cnxn->pgconn, buffer, (int)buffer_size);
-            Py_END_ALLOW_THREADS
-            if (copyStatus != 1)
+
+            char* quoted = PQescapeIdentifier(cnxn->pgconn, sz, (size_t)cb);
+            if (quoted == 0)
                 return SetConnectionError(cnxn);
+            PyObject* item = PyUnicode_FromString(quoted);
+            PQfreemem(quoted);
+            if (item == 0)
+                return 0;
+            PyList_SET_ITEM(names.Get(), i, item);
         }
+
+        Object sep(PyUnicode_FromString(", "));
+        if (!sep)
+            return 0;
+        collist.Attach(PyUnicode_Join(sep, names));
+        if (!collist)
+            return 0;
+    }
+    else
+    {
+        // COPY without a column list leaves out generated columns but SELECT * includes them,
+        // so read the columns COPY expects from the catalog and pass them explicitly.
+
+        const char* szTable = PyUnicode_AsUTF8(table);
+        if (szTable == 0)
+            return 0;
+
+        const char* szSQL = (PQserverVersion(cnxn->pgconn) >= 120000)
+            ? "SELECT string_agg(quote_ident(attname), ', ' ORDER BY attnum) FROM pg_catalog.pg_attribute "
+              "WHERE attrelid = $1::regclass AND attnum > 0 AND NOT attisdropped AND attgenerated = ''"
+            : "SELECT string_agg(quote_ident(attname), ', ' ORDER BY attnum) FROM pg_catalog.pg_attribute "
+              "WHERE attrelid = $1::regclass AND attnum > 0 AND NOT attisdropped";
+        const char* values[1] = { szTable };
+
+        ResultHolder result;
+        Py_BEGIN_ALLOW_THREADS
+        result = PQexecParams(cnxn->pgconn, szSQL, 1, 0, values, 0, 0, 0);
+        Py_END_ALLOW_THREADS
+
+        if (result == 0)
+            return SetConnectionError(cnxn);
+
+        if (PQresultStatus(result) != PGRES_TUPLES_OK)
+            return SetResultError(result.Detach());
+
+        if (PQgetisnull(result, 0, 0))
+            return SetStringError(Error, "The table has no columns");
+
+        collist.Attach(PyUnicode_DecodeUTF8(PQgetvalue(result, 0, 0), PQgetlength(result, 0, 0), 0));
+        if (!collist)
+            return 0;
     }
 
-    if (PQputCopyEnd(cnxn->pgconn, 0) != 1)
+    // Binary COPY requires each value to be in exactly its column's format, so we need the
+    // column types.
+
+    Object describe(PyUnicode_FromFormat("SELECT %U FROM %U LIMIT 0", collist.Get(), table));
+    if (!describe)
+        return 0;
+
+    const char* szSQL = PyUnicode_AsUTF8(describe);
+    if (szSQL == 0)
+        return 0;
+
+    ResultHolder result;
+    Py_BEGIN_ALLOW_THREADS
+    result = PQexec(cnxn->pgconn, szSQL);
+    Py_END_ALLOW_THREADS
+
+    if (result == 0)
         return SetConnectionError(cnxn);
 
-    Py_RETURN_NONE;
+    if (PQresultStatus(result) != PGRES_TUPLES_OK)
+        return SetResultError(result.Detach());
+
+    int cColumns = PQnfields(result);
+    if (cColumns == 0)
+        return SetStringError(Error, "The table has no columns");
+
+    Oid* types = (Oid*)malloc(sizeof(Oid) * cColumns);
+    if (types == 0)
+        return PyErr_NoMemory();
+    for (int i = 0; i < cColumns; i++)
+        types[i] = PQftype(result, i);
+
+    Object sql(PyUnicode_FromFormat("COPY %U (%U) FROM STDIN WITH (FORMAT binary)", table, collist.Get()));
+    szSQL = sql ? PyUnicode_AsUTF8(sql) : 0;
+    if (szSQL == 0)
+    {
+        free(types);
+        return 0;
+    }
+
+    ResultHolder copyresult;
+    Py_BEGIN_ALLOW_THREADS
+    copyresult = PQexec(cnxn->pgconn, szSQL);
+    Py_END_ALLOW_THREADS
+
+    PyObject* count = 0;
+
+    if (copyresult == 0)
+        SetConnectionError(cnxn);
+    else if (PQresultStatus(copyresult) != PGRES_COPY_IN)
+        SetResultError(copyresult.Detach());
+    else
+        count = CopyIn_Rows(cnxn, cColumns, types, rows);
+
+    free(types);
+    return count;
 }
 
-static PyObject* ReturnResult(Connection* cnxn, ResultHolder& result)
+static PyObject* NewResultSet(Connection* cnxn, PGresult* result, Statement* stmt)
+{
+    // Wraps `result` in a ResultSet, reusing the column information cached in `stmt`, if any.
+    // If the statement doesn't have any cached yet, it is populated from the new ResultSet.
+
+    if (stmt == 0)
+        return ResultSet_New(cnxn, result);
+
+    PyObject* rset = ResultSet_New(cnxn, result, stmt->columns, stmt->plan);
+
+    // The ResultSet builds its own plan if there wasn't one or if the cached one was built
+    // with different decode options, in which case the new one replaces it.
+
+    if (rset)
+    {
+        ResultSet* p = (ResultSet*)rset;
+        if (p->columns && p->planobj && p->planobj != stmt->plan)
+        {
+            Py_XDECREF(stmt->columns);
+            stmt->columns = p->columns;
+            Py_INCREF(stmt->columns);
+            Py_XDECREF(stmt->plan);
+            stmt->plan = p->planobj;
+            Py_INCREF(stmt->plan);
+        }
+    }
+
+    return rset;
+}
+
+static PyObject* ReturnResult(Connection* cnxn, ResultHolder& result, Statement* stmt = 0)
 {
     // An internal function for handling a result set so we can share the sync
     // and async implementations.
@@ -322,7 +794,7 @@ static PyObject* ReturnResult(Connection* cnxn, ResultHolder& result)
     switch (status)
     {
     case PGRES_TUPLES_OK:
-        return ResultSet_New(cnxn, result.Detach());
+        return NewResultSet(cnxn, result.Detach(), stmt);
 
     case PGRES_COMMAND_OK:
     {
@@ -353,21 +825,145 @@ static PyObject* ReturnResult(Connection* cnxn, ResultHolder& result)
     return SetResultError(result.Detach());
 }
 
-static PyObject* Connection_execute(PyObject* self, PyObject* args)
+static const char doc_execute[] =
+    "Connection.execute(sql, *params, lazy=None) --> ResultSet | int | None\n"
+    "\n"
+    "Executes a SQL statement and returns a ResultSet for queries, the number of rows affected\n"
+    "for commands that report it, or None.\n"
+    "\n"
+    "lazy\n"
+    "  If True, each value in the rows is converted to a Python object the first time it is\n"
+    "  accessed.  If None, the connection's lazy_rows setting is used.";
+
+static PyObject* Connection_execute(PyObject* self, PyObject* args, PyObject* kwargs)
 {
     Connection* cnxn = (Connection*)self;
 
-    ResultHolder result = internal_execute(self, args);
+    // The parameters are passed positionally, so `lazy` is the only keyword.
+
+    int lazy = -1;
+    if (kwargs && PyDict_Size(kwargs) != 0)
+    {
+        PyObject* key;
+        PyObject* value;
+        Py_ssize_t pos = 0;
+        while (PyDict_Next(kwargs, &pos, &key, &value))
+        {
+            if (!PyUnicode_Check(key) || PyUnicode_CompareWithASCIIString(key, "lazy") != 0)
+                return PyErr_Format(PyExc_TypeError, "execute() got an unexpected keyword argument '%S'", key);
+            if (value != Py_None)
+            {
+                lazy = PyObject_IsTrue(value);
+                if (lazy == -1)
+                    return 0;
+            }
+        }
+    }
+
+    Statement* stmt;
+    ResultHolder result = internal_execute(self, args, &stmt);
     if (result == 0)
         return 0;
 
-    return ReturnResult(cnxn, result);
+    PyObject* rset = ReturnResult(cnxn, result, stmt);
+    if (rset && lazy != -1 && PyObject_TypeCheck(rset, &ResultSetType))
+        ((ResultSet*)rset)->lazy = (lazy != 0);
+
+    return rset;
 }
 
 static PyObject* Connection_row(PyObject* self, PyObject* args)
 {
     Connection* cnxn = (Connection*)self;
 
+    Statement* stmt;
+    ResultHolder result = internal_execute(self, args, &stmt);
+    if (result == 0)
+        return 0;
+
+    ExecStatusType status = PQresultStatus(result);
+
+    if (status != PGRES_TUPLES_OK)
+    {
+        switch (status)
+        {
+            case PGRES_COMMAND_OK:
+            case PGRES_EMPTY_QUERY:
+            case PGRES_COPY_OUT:
+            case PGRES_COPY_IN:
+            // case PGRES_COPY_BOTH:
+                PyErr_SetString(Error, "SQL wasn't a query");
+                return 0;
+
+            case PGRES_BAD_RESPONSE:
+            case PGRES_NONFATAL_ERROR:
+            case PGRES_FATAL_ERROR:
+            default:
+                // SetResultError will take ownership of `result`.
+                return SetResultError(result.Detach());
+        }
+    }
+
+    int cRows = PQntuples(result);
+    if (cRows == 0)
+    {
+        Py_RETURN_NONE;
+    }
+
+    if (cRows != 1)
+        return PyErr_Format(Error, "row query returned %d rows, not 1", cRows);
+
+    Object rset = NewResultSet(cnxn, result.Detach(), stmt);
+    if (rset == 0)
+        return 0;
+
+    return Row_New((ResultSet*)rset.Get(), 0);
+}
+
+static PyObject* Connection_reset(PyObject* self, PyObject* args)
+{
+    Connection* cnxn = CastConnection(self, REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
+
+    // The server forgets prepared statements when the connection is reset.
+    StatementCache_Clear(cnxn, false);
+
+    PQreset(cnxn->pgconn);
+    Py_RETURN_NONE;
+}
+
+static PyObject* Connection_trace(PyObject* self, PyObject* args)
+{
+    const char* filename;
+    const char* mode = 0;
+    if (!PyArg_ParseTuple(args, "z|z", &filename, &mode))
+        return 0;
+
+    Connection* cnxn = (Connection*)self;
+
+    if (cnxn->tracefile)
+    {
+        PQuntrace(cnxn->pgconn);
+        fclose(cnxn->tracefile);
+        cnxn->tracefile = 0;
+    }
+
+    if (filename)
+    {
+        cnxn->tracefile = fopen(filename, mode ? mode : "w");
+        if (cnxn->tracefile == 0)
+            return PyErr_SetFromErrnoWithFilename(Error, filename);
+        PQtrace(cnxn->pgconn, cnxn->tracefile);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* Connection_scalar(PyObject* self, PyObject* args)
+{
+    Connection* cnxn = (Connection*)self;
+
     ResultHolder result = internal_execute(self, args);
     if (result == 0)
         return 0;
@@ -395,100 +991,584 @@ static PyObject* Connection_row(PyObject* self, PyObject* args)
         }
     }
 
-    int cRows = PQntuples(result);
-    if (cRows == 0)
+    int cRows = PQntuples(result);
+
+    if (cRows == 0)
+    {
+        Py_RETURN_NONE;
+    }
+
+    if (cRows != 1)
+        return PyErr_Format(Error, "scalar query returned %d rows, not 1", cRows);
+
+    return ConvertValue(result, 0, 0, cnxn->decode, PQfformat(result, 0));
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+static bool FlushPipeline(PGconn* pgconn)
+{
+    // Flushes the output buffer of a non-blocking connection, waiting on the socket if
+    // necessary.  While we wait we also read anything the server has sent.  Otherwise the
+    // server could block writing results to us while we are blocked writing queries to it.
+    //
+    // This does not use any Python APIs so it can be called with the GIL released.
+
+    for (;;)
+    {
+        int rc = PQflush(pgconn);
+        if (rc != 1)
+            return rc == 0;
+
+        // poll instead of select since the socket number can be larger than FD_SETSIZE in
+        // processes with many open files.
+
+        struct pollfd pfd;
+        pfd.fd      = PQsocket(pgconn);
+        pfd.events  = POLLIN | POLLOUT;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) && PQconsumeInput(pgconn) == 0)
+            return false;
+    }
+}
+
+static bool SendPipelineQuery(PGconn* pgconn, const char* szSQL, Params* params)
+{
+    if (params == 0)
+        return PQsendQueryParams(pgconn, szSQL, 0, 0, 0, 0, 0, 1) == 1;
+
+    return PQsendQueryParams(pgconn, szSQL,
+                             params->count,
+                             params->types,
+                             params->values,
+                             params->lengths,
+                             params->formats,
+                             1) == 1; // binary format
+}
+
+inline bool IsErrorStatus(ExecStatusType status)
+{
+    return status == PGRES_BAD_RESPONSE || status == PGRES_NONFATAL_ERROR || status == PGRES_FATAL_ERROR;
+}
+
+static bool ExitPipeline(PGconn* pgconn)
+{
+    // Reads and discards any results that have not been read and leaves pipeline mode.  A sync
+    // must have been sent.  Returns false if the connection was lost.
+    //
+    // This does not use any Python APIs so it can be called with the GIL released.
+
+    int cNulls = 0;
+
+    while (PQexitPipelineMode(pgconn) != 1)
+    {
+        if (PQstatus(pgconn) != CONNECTION_OK)
+            return false;
+
+        PGresult* result = PQgetResult(pgconn);
+        if (result == 0)
+        {
+            // A NULL ends each statement's results.  Two in a row means nothing is left, so
+            // if we still can't leave pipeline mode we never will.
+            if (++cNulls == 2)
+                return false;
+            continue;
+        }
+
+        cNulls = 0;
+        PQclear(result);
+    }
+
+    return true;
+}
+
+// How many statements we queue before making sure the output buffer is flushed.
+static const Py_ssize_t PIPELINE_FLUSH_INTERVAL = 64;
+
+static PyObject* RunPipeline(Connection* cnxn, PyObject* sql, PyObject* items)
+{
+    // Sends all of the statements in `items` using pipeline mode and waits for the results
+    // after a single sync.
+    //
+    // If `sql` is not zero, this implements executemany: each item is a sequence of
+    // parameters for `sql` and the total number of rows affected is returned.  Otherwise each
+    // item is either a SQL string or a tuple of (sql, param, ...) and a list of results (the
+    // same objects `execute` would return) is returned.
+    //
+    // If the connection is idle we wrap the statements in BEGIN / COMMIT.  The server stops
+    // executing after the first error, so either everything is committed or nothing is.  If a
+    // parameter can't be bound we send ROLLBACK instead of COMMIT.
+
+    Object seq(PySequence_Fast(items, "The statements must be a sequence"));
+    if (!seq)
+        return 0;
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq.Get());
+    if (count == 0)
+    {
+        if (sql)
+            return PyLong_FromLong(0);
+        return PyList_New(0);
+    }
+
+    const char* szSQL = 0;
+    if (sql)
+    {
+        szSQL = PyUnicode_AsUTF8(sql);
+        if (szSQL == 0)
+            return 0;
+    }
+
+    PGconn* pgconn = cnxn->pgconn;
+
+    if (PQpipelineStatus(pgconn) != PQ_PIPELINE_OFF)
+        return SetStringError(Error, "The connection is already in pipeline mode");
+
+    bool own_txn = (PQtransactionStatus(pgconn) == PQTRANS_IDLE);
+
+    if (PQenterPipelineMode(pgconn) != 1)
+        return SetConnectionError(cnxn);
+
+    PQsetnonblocking(pgconn, 1);
+
+    bool sent_ok  = true;       // false if libpq reported an error
+    bool bound_ok = true;       // false if a Python exception is pending
+    Py_ssize_t cSent = 0;
+
+    if (own_txn)
+        sent_ok = SendPipelineQuery(pgconn, "BEGIN", 0);
+
+    for (Py_ssize_t i = 0; i < count && sent_ok; i++)
+    {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq.Get(), i);
+
+        if (sql)
+        {
+            Object values(PySequence_Fast(item, "executemany parameters must be sequences"));
+            if (!values)
+            {
+                bound_ok = false;
+                break;
+            }
+
+            Py_ssize_t cParams = PySequence_Fast_GET_SIZE(values.Get());
+            Params params(cParams);
+            if (cParams && !params.valid())
+            {
+                PyErr_NoMemory();
+                bound_ok = false;
+                break;
+            }
+
+            for (Py_ssize_t iParam = 0; iParam < cParams && bound_ok; iParam++)
+                bound_ok = BindParam(cnxn, params, PySequence_Fast_GET_ITEM(values.Get(), iParam));
+            if (!bound_ok)
+                break;
+
+            sent_ok = SendPipelineQuery(pgconn, szSQL, &params);
+        }
+        else if (PyUnicode_Check(item))
+        {
+            const char* szItem = PyUnicode_AsUTF8(item);
+            if (szItem == 0)
+            {
+                bound_ok = false;
+                break;
+            }
+            sent_ok = SendPipelineQuery(pgconn, szItem, 0);
+        }
+        else
+        {
+            Object args(PySequence_Tuple(item));
+            if (!args || PyTuple_GET_SIZE(args.Get()) == 0 || !PyUnicode_Check(PyTuple_GET_ITEM(args.Get(), 0)))
+            {
+                if (!PyErr_Occurred())
+                    PyErr_SetString(PyExc_TypeError, "Each statement must be a string or a tuple of (sql, param, ...)");
+                bound_ok = false;
+                break;
+            }
+
+            const char* szItem = PyUnicode_AsUTF8(PyTuple_GET_ITEM(args.Get(), 0));
+            Params params(PyTuple_GET_SIZE(args.Get()) - 1);
+            if (szItem == 0 || !BindParams(cnxn, params, args))
+            {
+                bound_ok = false;
+                break;
+            }
+
+            sent_ok = SendPipelineQuery(pgconn, szItem, &params);
+        }
+
+        if (sent_ok)
+            cSent += 1;
+
+        if (sent_ok && (cSent % PIPELINE_FLUSH_INTERVAL) == 0)
+        {
+            Py_BEGIN_ALLOW_THREADS
+            sent_ok = FlushPipeline(pgconn);
+            Py_END_ALLOW_THREADS
+        }
+    }
+
+    // Save any binding error while we clean up the connection.
+    PyObject *etype = 0, *evalue = 0, *etrace = 0;
+    if (!bound_ok)
+        PyErr_Fetch(&etype, &evalue, &etrace);
+
+    if (own_txn && sent_ok)
+        sent_ok = SendPipelineQuery(pgconn, bound_ok ? "COMMIT" : "ROLLBACK", 0);
+
+    // The sync is sent even if sending a statement failed.  The server doesn't send results
+    // until it gets one, so we couldn't read the rest of the results to leave pipeline mode.
+    bool synced = (PQpipelineSync(pgconn) == 1);
+
+    Py_BEGIN_ALLOW_THREADS
+    if (synced)
+        synced = FlushPipeline(pgconn);
+    PQsetnonblocking(pgconn, 0);
+    Py_END_ALLOW_THREADS
+
+    if (!synced)
+        sent_ok = false;
+
+    // Keep libpq's error message before draining the pipeline below replaces it.
+    if (!sent_ok && bound_ok)
+    {
+        SetConnectionError(cnxn);
+        PyErr_Fetch(&etype, &evalue, &etrace);
+    }
+
+    // Now read the results.  Each statement has one result followed by a NULL.  Statements
+    // after an error return PGRES_PIPELINE_ABORTED.  Successful results are kept so we can
+    // convert them after the connection is back to normal.
+
+    Py_ssize_t cExpected = cSent + (own_txn ? 2 : 0);
+    if (!sent_ok)
+        cExpected = 0;
+
+    PGresult** results = (PGresult**)calloc(cSent ? cSent : 1, sizeof(PGresult*));
+    ResultHolder error;
+    bool read_ok = true;
+
+    for (Py_ssize_t i = 0; i < cExpected; i++)
+    {
+        PGresult* result;
+        Py_BEGIN_ALLOW_THREADS
+        result = PQgetResult(pgconn);
+        if (result != 0)
+        {
+            // Consume the NULL that ends each statement's results.
+            PGresult* tmp = PQgetResult(pgconn);
+            if (tmp)
+                PQclear(tmp);
+        }
+        Py_END_ALLOW_THREADS
+
+        if (result == 0)
+        {
+            read_ok = false;
+            break;
+        }
+
+        Py_ssize_t iStmt = own_txn ? (i - 1) : i;
+
+        if (IsErrorStatus(PQresultStatus(result)) && error.p == 0)
+            error = result;
+        else if (results && iStmt >= 0 && iStmt < cSent && PQresultStatus(result) != PGRES_PIPELINE_ABORTED)
+            results[iStmt] = result;
+        else
+            PQclear(result);
+    }
+
+    if (read_ok && bound_ok && sent_ok)
+        read_ok = (PQstatus(pgconn) == CONNECTION_OK);
+
+    if (!read_ok && bound_ok && sent_ok)
+    {
+        SetConnectionError(cnxn);
+        PyErr_Fetch(&etype, &evalue, &etrace);
+    }
+
+    // Whatever happened above, read anything that is left, including the sync's result, and
+    // leave pipeline mode.  If that isn't possible the connection is lost, so it is closed
+    // rather than left in pipeline mode where every later call would fail.
+
+    bool exited;
+    Py_BEGIN_ALLOW_THREADS
+    exited = synced && ExitPipeline(pgconn);
+    Py_END_ALLOW_THREADS
+
+    if (!exited)
+    {
+        if (etype == 0)
+        {
+            SetConnectionError(cnxn);
+            PyErr_Fetch(&etype, &evalue, &etrace);
+        }
+        PQfinish(pgconn);
+        cnxn->pgconn = 0;
+        pgconn = 0;
+    }
+
+    if (pgconn && own_txn && PQtransactionStatus(pgconn) == PQTRANS_INERROR)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        PGresult* result = PQexec(pgconn, "ROLLBACK");
+        if (result)
+            PQclear(result);
+        Py_END_ALLOW_THREADS
+    }
+
+    // Convert the results.  From here on, we must free the remaining results no matter what.
+
+    PyObject* retval = 0;
+
+    if (etype != 0)
+    {
+        PyErr_Restore(etype, evalue, etrace);
+    }
+    else if (results == 0)
+    {
+        PyErr_NoMemory();
+    }
+    else if (error.p != 0)
+    {
+        SetResultError(error.Detach());
+    }
+    else if (sql)
+    {
+        long total = 0;
+        for (Py_ssize_t i = 0; i < cSent; i++)
+        {
+            const char* sz = PQcmdTuples(results[i]);
+            if (sz && *sz)
+                total += atol(sz);
+        }
+        retval = PyLong_FromLong(total);
+    }
+    else
+    {
+        List list(cSent);
+        bool ok = (list.Get() != 0);
+        for (Py_ssize_t i = 0; ok && i < cSent; i++)
+        {
+            ResultHolder result(results[i]);
+            results[i] = 0;
+            PyObject* value = ReturnResult(cnxn, result);
+            if (value == 0)
+                ok = false;
+            else
+                PyList_SET_ITEM(list.Get(), i, value);
+        }
+        if (ok)
+            retval = list.Detach();
+    }
+
+    if (results)
     {
-        Py_RETURN_NONE;
+        for (Py_ssize_t i = 0; i < cSent; i++)
+            if (results[i])
+                PQclear(results[i]);
+        free(results);
     }
 
-    if (cRows != 1)
-        return PyErr_Format(Error, "row query returned %d rows, not 1", cRows);
+    return retval;
+}
 
-    Object rset = ResultSet_New(cnxn, result);
-    if (rset == 0)
+#endif // LIBPQ_HAS_PIPELINING
+
+static const char doc_execute_batch[] =
+    "Connection.execute_batch(statements) --> list\n"
+    "\n"
+    "Executes a sequence of statements using a single network round trip and returns a list\n"
+    "of the results, one for each statement.  Each statement can be a SQL string or a tuple\n"
+    "of (sql, param, ...).\n"
+    "\n"
+    "If not already in a transaction, the statements are executed in a new one.  If any\n"
+    "statement fails, the error is raised and none of the statements are committed.  If\n"
+    "already in a transaction and parameters can't be bound, the statements before them are\n"
+    "still executed in that transaction.\n"
+    "\n"
+    "  cnxn.execute_batch([\n"
+    "      (\"insert into t1 values ($1, $2)\", 1, 'one'),\n"
+    "      (\"update t2 set n = n + 1 where id = $1\", 7),\n"
+    "  ])";
+
+static PyObject* Connection_execute_batch(PyObject* self, PyObject* args)
+{
+    PyObject* statements;
+    if (!PyArg_ParseTuple(args, "O", &statements))
         return 0;
 
-    result.Detach();
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
 
-    return Row_New((ResultSet*)rset.Get(), 0);
+#ifdef LIBPQ_HAS_PIPELINING
+    return RunPipeline(cnxn, 0, statements);
+#else
+    return SetStringError(Error, "execute_batch requires libpq 14 or later");
+#endif
 }
 
-static PyObject* Connection_reset(PyObject* self, PyObject* args)
+static const char doc_executemany[] =
+    "Connection.executemany(sql, params) --> int\n"
+    "\n"
+    "Executes `sql` once for each sequence of parameters in `params` using a single network\n"
+    "round trip and returns the total number of rows affected.\n"
+    "\n"
+    "If not already in a transaction, the statements are executed in a new one.  If any\n"
+    "statement fails, the error is raised and none of the statements are committed.  If\n"
+    "already in a transaction and parameters can't be bound, the statements before them are\n"
+    "still executed in that transaction.\n"
+    "\n"
+    "  cnxn.executemany(\"insert into t1 values ($1, $2)\", [(1, 'one'), (2, 'two')])";
+
+static PyObject* Connection_executemany(PyObject* self, PyObject* args)
 {
-    Connection* cnxn = (Connection*)self;
-    PQreset(cnxn->pgconn);
-    Py_RETURN_NONE;
+    PyObject* sql;
+    PyObject* params;
+    if (!PyArg_ParseTuple(args, "UO", &sql, &params))
+        return 0;
+
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
+
+#ifdef LIBPQ_HAS_PIPELINING
+    return RunPipeline(cnxn, sql, params);
+#else
+    return SetStringError(Error, "executemany requires libpq 14 or later");
+#endif
 }
 
-static PyObject* Connection_trace(PyObject* self, PyObject* args)
+static const char doc_stream[] =
+    "Connection.stream(sql [, param, ...], chunk_rows=1) --> Stream\n"
+    "\n"
+    "Executes a query and returns an iterator that reads the rows from the server as they\n"
+    "are needed instead of reading the entire result into memory first.\n"
+    "\n"
+    "  for row in cnxn.stream(\"select * from big_table\"):\n"
+    "      process(row)\n"
+    "\n"
+    "If libpq is version 17 or later, rows are read in chunks of up to `chunk_rows` rows.\n"
+    "Otherwise they are read one at a time.\n"
+    "\n"
+    "The connection cannot be used for anything else until the iterator is exhausted or\n"
+    "closed - other commands raise an Error.  Closing it early cancels the query.";
+
+static PyObject* Connection_stream(PyObject* self, PyObject* args, PyObject* kwargs)
 {
-    const char* filename;
-    const char* mode = 0;
-    if (!PyArg_ParseTuple(args, "z|z", &filename, &mode))
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
         return 0;
 
-    Connection* cnxn = (Connection*)self;
+    int chunk_rows = 1;
 
-    if (cnxn->tracefile)
+    if (kwargs && PyDict_Size(kwargs) > 0)
     {
-        PQuntrace(cnxn->pgconn);
-        fclose(cnxn->tracefile);
-        cnxn->tracefile = 0;
-    }
+        PyObject* value = PyDict_GetItemString(kwargs, "chunk_rows");
+        if (value == 0 || PyDict_Size(kwargs) != 1)
+            return SetStringError(PyExc_TypeError, "stream() only accepts the keyword argument 'chunk_rows'");
 
-    if (filename)
-    {
-        cnxn->tracefile = fopen(filename, mode ? mode : "w");
-        if (cnxn->tracefile == 0)
-            return PyErr_SetFromErrnoWithFilename(Error, filename);
-        PQtrace(cnxn->pgconn, cnxn->tracefile);
+        long l = PyLong_AsLong(value);
+        if (l == -1 && PyErr_Occurred())
+            return 0;
+        if (l < 1 || l > INT_MAX)
+            return SetStringError(PyExc_ValueError, "chunk_rows must be a positive integer");
+        chunk_rows = (int)l;
     }
 
-    Py_RETURN_NONE;
+    Py_ssize_t cParams = PyTuple_Size(args) - 1;
+    if (cParams < 0)
+        return SetStringError(PyExc_TypeError, "Expected at least 1 argument (0 given)");
+
+    PyObject* pSql = PyTuple_GET_ITEM(args, 0);
+    if (!PyUnicode_Check(pSql))
+        return SetStringError(PyExc_TypeError, "The first argument must be a string.");
+
+    const char* szSQL = PyUnicode_AsUTF8(pSql);
+    if (szSQL == 0)
+        return 0;
+
+    Params params(cParams);
+    if (!BindParams(cnxn, params, args))
+        return 0;
+
+    int sent;
+    Py_BEGIN_ALLOW_THREADS
+    sent = PQsendQueryParams(cnxn->pgconn, szSQL,
+                             cParams,
+                             params.types,
+                             params.values,
+                             params.lengths,
+                             params.formats,
+                             1); // binary format
+    Py_END_ALLOW_THREADS
+
+    if (!sent)
+        return SetConnectionError(cnxn);
+
+    return Stream_New(cnxn, chunk_rows);
 }
 
-static PyObject* Connection_scalar(PyObject* self, PyObject* args)
-{
-    Connection* cnxn = (Connection*)self;
+static const char doc_cursor[] =
+    "Connection.cursor(sql [, param, ...], itersize=1000, prefetch=True) --> Cursor\n"
+    "\n"
+    "Declares a server-side cursor for a query and returns a Cursor that iterates over the\n"
+    "rows, fetching `itersize` rows at a time.  Must be called inside a transaction.\n"
+    "\n"
+    "If `prefetch` is True, the next block of rows is requested as soon as the current one\n"
+    "arrives so the server can produce it while the current block is processed.  Other\n"
+    "commands raise an Error while a block is outstanding, so pass prefetch=False if you\n"
+    "need to execute other commands while iterating.";
 
-    ResultHolder result = internal_execute(self, args);
-    if (result == 0)
+static PyObject* Connection_cursor(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
+    if (!cnxn)
         return 0;
 
-    ExecStatusType status = PQresultStatus(result);
+    long itersize = 1000;
+    int prefetch = 1;
 
-    if (status != PGRES_TUPLES_OK)
+    if (kwargs && PyDict_Size(kwargs) > 0)
     {
-        switch (status)
+        Py_ssize_t cFound = 0;
+
+        PyObject* value = PyDict_GetItemString(kwargs, "itersize");
+        if (value)
         {
-            case PGRES_COMMAND_OK:
-            case PGRES_EMPTY_QUERY:
-            case PGRES_COPY_OUT:
-            case PGRES_COPY_IN:
-            // case PGRES_COPY_BOTH:
-                PyErr_SetString(Error, "SQL wasn't a query");
+            cFound += 1;
+            itersize = PyLong_AsLong(value);
+            if (itersize == -1 && PyErr_Occurred())
                 return 0;
-
-            case PGRES_BAD_RESPONSE:
-            case PGRES_NONFATAL_ERROR:
-            case PGRES_FATAL_ERROR:
-            default:
-                // SetResultError will take ownership of `result`.
-                return SetResultError(result.Detach());
+            if (itersize < 1 || itersize > INT_MAX)
+                return SetStringError(PyExc_ValueError, "itersize must be a positive integer");
         }
-    }
 
-    int cRows = PQntuples(result);
+        value = PyDict_GetItemString(kwargs, "prefetch");
+        if (value)
+        {
+            cFound += 1;
+            prefetch = PyObject_IsTrue(value);
+            if (prefetch == -1)
+                return 0;
+        }
 
-    if (cRows == 0)
-    {
-        Py_RETURN_NONE;
+        if (cFound != PyDict_Size(kwargs))
+            return SetStringError(PyExc_TypeError, "cursor() only accepts the keyword arguments 'itersize' and 'prefetch'");
     }
 
-    if (cRows != 1)
-        return PyErr_Format(Error, "scalar query returned %d rows, not 1", cRows);
-
-    return ConvertValue(result, 0, 0, cnxn->integer_datetimes, PQfformat(result, 0));
+    return Cursor_New(cnxn, args, (int)itersize, prefetch != 0);
 }
 
 static const char doc_begin[] = "Connection.begin() --> None\n\n"
@@ -497,7 +1577,9 @@ static const char doc_begin[] = "Connection.begin() --> None\n\n"
 static PyObject* Connection_begin(PyObject* self, PyObject* args)
 {
     UNUSED(args);
-    Connection* cnxn = (Connection*)self;
+    Connection* cnxn = CastConnection(self, REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
 
     PGTransactionStatusType txnstatus;
     ExecStatusType status = PGRES_COMMAND_OK;
@@ -527,7 +1609,9 @@ static const char doc_commit[] = "Connection.commit() --> None\n\n"
 static PyObject* Connection_commit(PyObject* self, PyObject* args)
 {
     UNUSED(args);
-    Connection* cnxn = (Connection*)self;
+    Connection* cnxn = CastConnection(self, REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
 
     PGTransactionStatusType txnstatus;
     ExecStatusType status = PGRES_COMMAND_OK;
@@ -557,7 +1641,9 @@ static const char doc_rollback[] = "Connection.rollback() --> None\n\n"
 static PyObject* Connection_rollback(PyObject* self, PyObject* args)
 {
     UNUSED(args);
-    Connection* cnxn = (Connection*)self;
+    Connection* cnxn = CastConnection(self, REQUIRE_IDLE);
+    if (!cnxn)
+        return 0;
 
     PGTransactionStatusType txnstatus;
     ExecStatusType status = PGRES_COMMAND_OK;
@@ -585,6 +1671,16 @@ static void Connection_dealloc(PyObject* self)
 {
     Connection* cnxn = (Connection*)self;
 
+    // No need to deallocate the statements since we're closing the connection.
+    StatementCache_Clear(cnxn, false);
+
+    if (cnxn->pool)
+    {
+        // The connection was checked out of a pool but never returned.
+        Pool_ConnectionLost(cnxn->pool);
+        Py_CLEAR(cnxn->pool);
+    }
+
     Py_BEGIN_ALLOW_THREADS
     if (cnxn->pgconn)
         PQfinish(cnxn->pgconn);
@@ -659,6 +1755,54 @@ static PyObject* Connection_transaction_status(PyObject* self, void* closure)
     return PyLong_FromLong(PQtransactionStatus(cnxn->pgconn));
 }
 
+static PyObject* Connection_statement_cache_hits(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+    return PyLong_FromLong(cnxn->stmtcache.hits);
+}
+
+static PyObject* Connection_statement_cache_misses(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+    return PyLong_FromLong(cnxn->stmtcache.misses);
+}
+
+static PyObject* Connection_get_statement_cache_size(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+    return PyLong_FromLong(cnxn->stmtcache.capacity);
+}
+
+static int Connection_set_statement_cache_size(PyObject* self, PyObject* value, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = CastConnection(self, REQUIRE_IDLE);
+    if (!cnxn)
+        return -1;
+
+    if (value == 0)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the statement_cache_size attribute");
+        return -1;
+    }
+
+    long capacity = PyLong_AsLong(value);
+    if (capacity == -1 && PyErr_Occurred())
+        return -1;
+
+    if (capacity < 0 || capacity > INT_MAX)
+    {
+        PyErr_SetString(PyExc_ValueError, "statement_cache_size must be zero or a positive integer");
+        return -1;
+    }
+
+    StatementCache_SetCapacity(cnxn, (int)capacity);
+    return 0;
+}
+
 static PyObject* Connection_sendQuery(PyObject* self, PyObject* args)
 {
     PyObject* pScript;
@@ -806,7 +1950,7 @@ static PyObject* Connection_notifies(PyObject* self, PyObject* args, PyObject* k
     if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|d", (char**)kwlist, &timeout))
         return 0;
 
-    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN);
+    Connection* cnxn = CastConnection(self, REQUIRE_SYNC | REQUIRE_OPEN | REQUIRE_IDLE);
     if (!cnxn)
         return 0;
 
@@ -923,7 +2067,7 @@ static PyObject* Connection_notify(PyObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, "U|U", &channel, &payload))
         return 0;
 
-    Connection* cnxn = CastConnection(self, REQUIRE_OPEN);
+    Connection* cnxn = CastConnection(self, REQUIRE_OPEN | REQUIRE_IDLE);
     if (!cnxn)
         return 0;
 
@@ -989,6 +2133,174 @@ static PyObject* Connection_connectPoll(PyObject* self, PyObject* args)
     return 0;
 }
 
+static PyObject* Connection_get_lazy_rows(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+    return PyBool_FromLong(cnxn->lazy_rows);
+}
+
+static int Connection_set_lazy_rows(PyObject* self, PyObject* value, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    if (value == 0)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the lazy_rows attribute");
+        return -1;
+    }
+
+    int lazy = PyObject_IsTrue(value);
+    if (lazy == -1)
+        return -1;
+
+    cnxn->lazy_rows = (lazy != 0);
+    return 0;
+}
+
+static PyObject* Connection_get_numeric_as(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    PyObject* type = decimal_type;
+    if (cnxn->decode.numeric_as == NUMERIC_AS_INT)
+        type = (PyObject*)&PyLong_Type;
+    else if (cnxn->decode.numeric_as == NUMERIC_AS_FLOAT)
+        type = (PyObject*)&PyFloat_Type;
+
+    Py_INCREF(type);
+    return type;
+}
+
+static int Connection_set_numeric_as(PyObject* self, PyObject* value, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    if (value == 0)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the numeric_as attribute");
+        return -1;
+    }
+
+    if (value == decimal_type)
+        cnxn->decode.numeric_as = NUMERIC_AS_DECIMAL;
+    else if (value == (PyObject*)&PyLong_Type)
+        cnxn->decode.numeric_as = NUMERIC_AS_INT;
+    else if (value == (PyObject*)&PyFloat_Type)
+        cnxn->decode.numeric_as = NUMERIC_AS_FLOAT;
+    else
+    {
+        PyErr_SetString(PyExc_ValueError, "numeric_as must be decimal.Decimal, int, or float");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* Connection_get_json_as(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    PyObject* type = (cnxn->decode.json_as == JSON_AS_STR) ? (PyObject*)&PyUnicode_Type : (PyObject*)&PyBaseObject_Type;
+    Py_INCREF(type);
+    return type;
+}
+
+static int Connection_set_json_as(PyObject* self, PyObject* value, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    if (value == 0)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the json_as attribute");
+        return -1;
+    }
+
+    if (value == (PyObject*)&PyBaseObject_Type)
+        cnxn->decode.json_as = JSON_AS_OBJECT;
+    else if (value == (PyObject*)&PyUnicode_Type)
+        cnxn->decode.json_as = JSON_AS_STR;
+    else
+    {
+        PyErr_SetString(PyExc_ValueError, "json_as must be object or str");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* Connection_get_uuid_as(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    PyObject* type = uuid_type;
+    if (cnxn->decode.uuid_as == UUID_AS_BYTES)
+        type = (PyObject*)&PyBytes_Type;
+    else if (cnxn->decode.uuid_as == UUID_AS_STR)
+        type = (PyObject*)&PyUnicode_Type;
+
+    Py_INCREF(type);
+    return type;
+}
+
+static int Connection_set_uuid_as(PyObject* self, PyObject* value, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    if (value == 0)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the uuid_as attribute");
+        return -1;
+    }
+
+    if (value == uuid_type)
+        cnxn->decode.uuid_as = UUID_AS_UUID;
+    else if (value == (PyObject*)&PyBytes_Type)
+        cnxn->decode.uuid_as = UUID_AS_BYTES;
+    else if (value == (PyObject*)&PyUnicode_Type)
+        cnxn->decode.uuid_as = UUID_AS_STR;
+    else
+    {
+        PyErr_SetString(PyExc_ValueError, "uuid_as must be uuid.UUID, bytes, or str");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* Connection_get_strip_char(PyObject* self, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+    return PyBool_FromLong(cnxn->decode.strip_char);
+}
+
+static int Connection_set_strip_char(PyObject* self, PyObject* value, void* closure)
+{
+    UNUSED(closure);
+    Connection* cnxn = (Connection*)self;
+
+    if (value == 0)
+    {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the strip_char attribute");
+        return -1;
+    }
+
+    int strip = PyObject_IsTrue(value);
+    if (strip == -1)
+        return -1;
+
+    cnxn->decode.strip_char = (strip != 0);
+    return 0;
+}
+
 static PyGetSetDef Connection_getset[] = {
     { (char*)"server_version",     (getter)Connection_server_version,     0, (char*)"The server version", 0 },
     { (char*)"protocol_version",   (getter)Connection_protocol_version,   0, (char*)"The protocol version", 0 },
@@ -997,18 +2309,39 @@ static PyGetSetDef Connection_getset[] = {
     { (char*)"status",             (getter)Connection_status,             0, (char*)"True if status is CONNECTION_OK, False otherwise", 0 },
     { (char*)"transaction_status", (getter)Connection_transaction_status, 0, (char*)"Returns PQtransactionStatus constants", 0 },
     { (char*)"socket",             (getter)Connection_socket,             0, (char*)"Returns the socket fileno", 0 },
+    { (char*)"statement_cache_size", (getter)Connection_get_statement_cache_size, (setter)Connection_set_statement_cache_size,
+      (char*)"The maximum number of prepared statements to cache.  Zero disables the cache.", 0 },
+    { (char*)"lazy_rows", (getter)Connection_get_lazy_rows, (setter)Connection_set_lazy_rows,
+      (char*)"If True, row values are converted when first accessed instead of when fetched.", 0 },
+    { (char*)"numeric_as", (getter)Connection_get_numeric_as, (setter)Connection_set_numeric_as,
+      (char*)"The type numeric values are returned as: decimal.Decimal, int, or float.", 0 },
+    { (char*)"json_as", (getter)Connection_get_json_as, (setter)Connection_set_json_as,
+      (char*)"How json and jsonb values are returned: object to parse them or str for the text.", 0 },
+    { (char*)"uuid_as", (getter)Connection_get_uuid_as, (setter)Connection_set_uuid_as,
+      (char*)"The type uuid values are returned as: uuid.UUID, bytes, or str.", 0 },
+    { (char*)"strip_char", (getter)Connection_get_strip_char, (setter)Connection_set_strip_char,
+      (char*)"If True, trailing spaces are removed from char(n) values.", 0 },
+    { (char*)"statement_cache_hits",   (getter)Connection_statement_cache_hits,   0, (char*)"The number of executions that reused a cached prepared statement", 0 },
+    { (char*)"statement_cache_misses", (getter)Connection_statement_cache_misses, 0, (char*)"The number of executions that had to prepare a statement", 0 },
     { 0 }
 };
 
 static struct PyMethodDef Connection_methods[] =
 {
-    { "execute", Connection_execute, METH_VARARGS, 0 },
+    { "execute", (PyCFunction)Connection_execute, METH_VARARGS | METH_KEYWORDS, doc_execute },
     { "row",     Connection_row,     METH_VARARGS, 0 },
     { "scalar",  Connection_scalar,  METH_VARARGS, 0 },
+    { "execute_batch", Connection_execute_batch, METH_VARARGS, doc_execute_batch },
+    { "executemany",   Connection_executemany,   METH_VARARGS, doc_executemany },
+    { "stream",  (PyCFunction)Connection_stream, METH_VARARGS | METH_KEYWORDS, doc_stream },
+    { "cursor",  (PyCFunction)Connection_cursor, METH_VARARGS | METH_KEYWORDS, doc_cursor },
     { "trace",   Connection_trace,   METH_VARARGS, 0 },
     { "reset",   Connection_reset,   METH_NOARGS,  0 },
     { "script",  Connection_script,  METH_VARARGS, doc_script },
     { "copy_from_csv", (PyCFunction) Connection_copy_from_csv, METH_VARARGS | METH_KEYWORDS, doc_copy_from_csv },
+    { "copy_from_rows", (PyCFunction) Connection_copy_from_rows, METH_VARARGS | METH_KEYWORDS, doc_copy_from_rows },
+    { "copy_to", (PyCFunction) Connection_copy_to, METH_VARARGS | METH_KEYWORDS, doc_copy_to },
+    { "copy_to_columns", (PyCFunction) Connection_copy_to_columns, METH_VARARGS | METH_KEYWORDS, doc_copy_to_columns },
     { "begin",    Connection_begin,   METH_NOARGS, doc_begin },
     { "commit",   Connection_commit,   METH_NOARGS, doc_commit },
     { "rollback", Connection_rollback,   METH_NOARGS, doc_rollback },
@@ -2,6 +2,9 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include "stmtcache.h"
+#include "getdata.h"
+
 enum AsyncStatus {
     ASYNC_STATUS_SYNC       = 0, // not an async connection
     ASYNC_STATUS_CONNECTING = 1,
@@ -27,14 +30,35 @@ struct Connection
     PGconn* pgconn;
     // This will be set to zero when closed.  Always check!
 
-    bool integer_datetimes;
+    DecodeOptions decode;
+    // How values are converted to Python objects.  `integer_datetimes` comes from the server and
+    // the rest from attributes like numeric_as.
 
     FILE* tracefile;
 
     AsyncStatus async_status;
     AsyncFunc async_func;
+
+    StatementCache stmtcache;
+    // Prepared statements used by execute, row, and scalar.  Disabled (capacity 0) by default.
+
+    bool busy;
+    // True while a Stream or a Cursor's FETCH has results pending on the connection.  Other
+    // commands raise an error until they have been read, since libpq would silently discard
+    // them.
+
+    bool lazy_rows;
+    // If true, rows convert each value the first time it is accessed instead of when the row
+    // is created.
+
+    PyObject* pool;
+    // The Pool this connection is checked out from, or zero.  A reference is held so the pool
+    // can be told if the connection is freed instead of being returned.
 };
 
 PyObject* Connection_New(PGconn* pgconn, bool async);
 
+PyObject* Connection_Connect(const char* conninfo);
+// Opens a synchronous connection, releasing the GIL while connecting.
+
 #endif // CONNECTION_H
@@ -0,0 +1,1667 @@
+
+// COPY support.
+//
+// PQgetCopyData returns one row at a time, which is far too small a unit to hand to Python or
+// to write(), so rows are collected into chunks of about COPY_CHUNK_SIZE bytes first.  Reading
+// a chunk does not touch any Python objects, so it is always done with the GIL released.
+//
+// Going the other way, copy_from_rows encodes rows in the binary COPY format into a chunk and
+// sends it with PQputCopyData each time it fills up.
+
+#include "pglib.h"
+#include "copy.h"
+#include "connection.h"
+#include "errors.h"
+#include "params.h"
+#include "byteswap.h"
+#include "compress.h"
+#include "columnbuffer.h"
+
+#include <errno.h>
+
+#include <fcntl.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#define open  _open
+#define read  _read
+#define write _write
+#define close _close
+#else
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static const size_t COPY_CHUNK_SIZE = 64 * 1024;
+
+struct Chunk
+{
+    char* data;
+    size_t len;
+    size_t cap;
+
+    Chunk()
+    {
+        data = 0;
+        len  = 0;
+        cap  = 0;
+    }
+
+    ~Chunk()
+    {
+        free(data);
+    }
+
+    bool Append(const char* p, size_t cb)
+    {
+        if (len + cb > cap)
+        {
+            size_t newcap = MAX(cap * 2, MAX(len + cb, COPY_CHUNK_SIZE));
+            char* newdata = (char*)realloc(data, newcap);
+            if (newdata == 0)
+                return false;
+            data = newdata;
+            cap  = newcap;
+        }
+        memcpy(&data[len], p, cb);
+        len += cb;
+        return true;
+    }
+
+    bool AppendInt16(int16_t value)
+    {
+        value = swaps2(value);
+        return Append((const char*)&value, 2);
+    }
+
+    bool AppendInt32(int32_t value)
+    {
+        value = swaps4(value);
+        return Append((const char*)&value, 4);
+    }
+};
+
+enum
+{
+    FILL_ERROR   = -1,
+    FILL_END     = 0,
+    FILL_MORE    = 1,
+    FILL_NOMEM   = 2,
+};
+
+static int FillChunk(PGconn* pgconn, Chunk& chunk)
+{
+    // Reads rows into `chunk` until it holds at least COPY_CHUNK_SIZE bytes or the data ends.
+    // Does not use the GIL.
+
+    while (chunk.len < COPY_CHUNK_SIZE)
+    {
+        char* buffer = 0;
+        int cb = PQgetCopyData(pgconn, &buffer, 0);
+
+        if (cb == -1)
+            return FILL_END;
+
+        if (cb < 0)
+            return FILL_ERROR;
+
+        bool ok = chunk.Append(buffer, (size_t)cb);
+        PQfreemem(buffer);
+        if (!ok)
+            return FILL_NOMEM;
+    }
+
+    return FILL_MORE;
+}
+
+static void Discard(PGconn* pgconn)
+{
+    // Asks the server to stop and then reads whatever it already sent, leaving the connection
+    // ready for the next command.  Does not use the GIL.
+
+    PGcancel* pgcancel = PQgetCancel(pgconn);
+    if (pgcancel)
+    {
+        char szErr[256];
+        PQcancel(pgcancel, szErr, sizeof(szErr));
+        PQfreeCancel(pgcancel);
+    }
+
+    char* buffer;
+    int cb;
+    while ((cb = PQgetCopyData(pgconn, &buffer, 0)) >= 0)
+        PQfreemem(buffer);
+
+    PGresult* result;
+    while ((result = PQgetResult(pgconn)) != 0)
+        PQclear(result);
+}
+
+static PyObject* Finish(Connection* cnxn)
+{
+    // Reads the result that follows the data (or follows PQputCopyEnd for COPY FROM) and returns
+    // the number of rows copied.
+
+    PGresult* result;
+    Py_BEGIN_ALLOW_THREADS
+    result = PQgetResult(cnxn->pgconn);
+    PGresult* tmp;
+    while ((tmp = PQgetResult(cnxn->pgconn)) != 0)
+        PQclear(tmp);
+    Py_END_ALLOW_THREADS
+
+    if (result == 0)
+        return SetConnectionError(cnxn);
+
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+        return SetResultError(result);
+
+    PyObject* count = PyLong_FromString(PQcmdTuples(result), 0, 10);
+    PQclear(result);
+    return count;
+}
+
+static void FinishQuietly(Connection* cnxn)
+{
+    // Reads the final result without disturbing the current exception, if any.
+
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    Py_XDECREF(Finish(cnxn));
+    PyErr_Restore(type, value, tb);
+}
+
+static PyObject* FillError(Connection* cnxn, int status)
+{
+    // Reports an error from FillChunk.  For a connection error, the error result that follows
+    // is more useful than the connection's error message.
+
+    if (status == FILL_NOMEM)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        Discard(cnxn->pgconn);
+        Py_END_ALLOW_THREADS
+        return PyErr_NoMemory();
+    }
+
+    PyObject* count = Finish(cnxn);
+    if (count)
+    {
+        Py_DECREF(count);
+        return SetConnectionError(cnxn);
+    }
+    return 0;
+}
+
+static bool ChunkSink(void* context, const char* p, size_t cb)
+{
+    // A CodecSink that collects the output in a Chunk.  Only fails if out of memory.
+    return ((Chunk*)context)->Append(p, cb);
+}
+
+bool WriteFd(void* context, const char* p, size_t cb)
+{
+    FdSink* sink = (FdSink*)context;
+
+    while (cb > 0)
+    {
+        int written = (int)write(sink->fd, p, (unsigned int)(cb < (size_t)INT_MAX ? cb : (size_t)INT_MAX));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            sink->error = errno;
+            return false;
+        }
+        p  += written;
+        cb -= (size_t)written;
+    }
+
+    return true;
+}
+
+static PyObject* CodecError(Connection* cnxn, Codec& codec, bool discard)
+{
+    // Reports a CODEC_ERROR.  If `discard` is true the rest of the data is still coming and is
+    // thrown away.  Otherwise it has all been read and only the final result is left.
+
+    if (discard)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        Discard(cnxn->pgconn);
+        Py_END_ALLOW_THREADS
+    }
+    else
+    {
+        FinishQuietly(cnxn);
+    }
+
+    return SetStringError(Error, codec.szError);
+}
+
+PyObject* CopyOut_ToFd(Connection* cnxn, int fd, Compression compression)
+{
+    PGconn* pgconn = cnxn->pgconn;
+    Codec codec(compression, true);
+    FdSink sink = { fd, 0 };
+    int status;
+    int rc = CODEC_OK;
+
+    Py_BEGIN_ALLOW_THREADS
+    Chunk chunk;
+    do
+    {
+        status = FillChunk(pgconn, chunk);
+
+        rc = codec.Write(chunk.data, chunk.len, WriteFd, &sink);
+        if (rc == CODEC_OK && status == FILL_END)
+            rc = codec.Finish(WriteFd, &sink);
+        chunk.len = 0;
+
+        if (rc != CODEC_OK)
+        {
+            if (status == FILL_MORE)
+                Discard(pgconn);
+            break;
+        }
+    }
+    while (status == FILL_MORE);
+    Py_END_ALLOW_THREADS
+
+    if (sink.error)
+    {
+        if (status != FILL_MORE)
+            FinishQuietly(cnxn);
+        errno = sink.error;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    if (rc == CODEC_ERROR)
+        return CodecError(cnxn, codec, false);
+
+    if (status != FILL_END)
+        return FillError(cnxn, status);
+
+    return Finish(cnxn);
+}
+
+PyObject* CopyOut_ToFile(Connection* cnxn, PyObject* file, Compression compression)
+{
+    Object write_method(PyObject_GetAttrString(file, "write"));
+    if (!write_method)
+    {
+        PyErr_Clear();
+        Py_BEGIN_ALLOW_THREADS
+        Discard(cnxn->pgconn);
+        Py_END_ALLOW_THREADS
+        return SetStringError(PyExc_TypeError, "dest must be None, a file descriptor, or an object with a write method");
+    }
+
+    // If compressing, the raw data is read into `chunk` and compressed into `out`.
+
+    Codec* codec = (compression != COMPRESSION_NONE) ? new Codec(compression, true) : 0;
+    Chunk chunk;
+    Chunk out;
+    Chunk& data = codec ? out : chunk;
+    int status;
+
+    do
+    {
+        int rc = CODEC_OK;
+
+        Py_BEGIN_ALLOW_THREADS
+        status = FillChunk(cnxn->pgconn, chunk);
+        if (codec)
+        {
+            rc = codec->Write(chunk.data, chunk.len, ChunkSink, &out);
+            if (rc == CODEC_OK && status == FILL_END)
+                rc = codec->Finish(ChunkSink, &out);
+            chunk.len = 0;
+        }
+        Py_END_ALLOW_THREADS
+
+        if (rc != CODEC_OK)
+        {
+            if (rc == CODEC_ERROR)
+            {
+                CodecError(cnxn, *codec, status == FILL_MORE);
+            }
+            else
+            {
+                PyErr_NoMemory();
+                if (status == FILL_MORE)
+                {
+                    Py_BEGIN_ALLOW_THREADS
+                    Discard(cnxn->pgconn);
+                    Py_END_ALLOW_THREADS
+                }
+                else
+                {
+                    FinishQuietly(cnxn);
+                }
+            }
+            delete codec;
+            return 0;
+        }
+
+        if (data.len)
+        {
+            Object result(PyObject_CallFunction(write_method, "y#", data.data, (Py_ssize_t)data.len));
+            if (!result)
+            {
+                if (status == FILL_MORE)
+                {
+                    Py_BEGIN_ALLOW_THREADS
+                    Discard(cnxn->pgconn);
+                    Py_END_ALLOW_THREADS
+                }
+                else
+                {
+                    FinishQuietly(cnxn);
+                }
+                delete codec;
+                return 0;
+            }
+            data.len = 0;
+        }
+    }
+    while (status == FILL_MORE);
+
+    delete codec;
+
+    if (status != FILL_END)
+        return FillError(cnxn, status);
+
+    return Finish(cnxn);
+}
+
+// copy_to_columns parses binary COPY data straight into a ColumnBuffer per column.  Rows can be
+// split across chunks, so only complete rows are parsed and the rest is kept for the next
+// chunk.
+
+enum
+{
+    PARSE_OK,
+    PARSE_ERROR,
+    PARSE_NOMEM
+};
+
+struct ColumnParser
+{
+    ColumnBuffer** columns;
+    int cColumns;
+
+    bool header;
+    // True once the header has been read.
+
+    bool ended;
+    // True once the trailer has been read.
+
+    char szError[200];
+};
+
+static int ParseColumns(ColumnParser& parser, const char* data, size_t len, size_t& consumed)
+{
+    // Parses the complete rows in `data`, setting `consumed` to the number of bytes used.  Does
+    // not use the GIL.
+
+    size_t pos = 0;
+    consumed = 0;
+
+    if (!parser.header)
+    {
+        if (len < BINARY_HEADER_SIZE)
+            return PARSE_OK;
+
+        if (memcmp(data, BINARY_HEADER, 11) != 0)
+        {
+            snprintf(parser.szError, sizeof(parser.szError), "COPY data does not have a binary header");
+            return PARSE_ERROR;
+        }
+
+        uint32_t extension = (uint32_t)ReadInt32(&data[15]);
+        if (len - BINARY_HEADER_SIZE < extension)
+            return PARSE_OK;
+
+        pos = BINARY_HEADER_SIZE + extension;
+        parser.header = true;
+    }
+
+    while (pos < len)
+    {
+        if (parser.ended)
+        {
+            snprintf(parser.szError, sizeof(parser.szError), "COPY data continues after the trailer");
+            return PARSE_ERROR;
+        }
+
+        if (len - pos < 2)
+            break;
+
+        int16_t count = ReadInt16(&data[pos]);
+        if (count == -1)
+        {
+            parser.ended = true;
+            pos += 2;
+            continue;
+        }
+
+        if (count != parser.cColumns)
+        {
+            snprintf(parser.szError, sizeof(parser.szError), "COPY data has %d columns but %d types were given", (int)count, parser.cColumns);
+            return PARSE_ERROR;
+        }
+
+        // Make sure the whole row is here and the types match before appending anything.
+
+        size_t end = pos + 2;
+        bool complete = true;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (len - end < 4)
+            {
+                complete = false;
+                break;
+            }
+
+            int32_t cb = ReadInt32(&data[end]);
+            end += 4;
+
+            if (cb == -1)
+                continue;
+
+            if (cb != parser.columns[i]->layout->itemsize)
+            {
+                snprintf(parser.szError, sizeof(parser.szError), "COPY column %d has %d byte values, but type %s has %d", i, (int)cb,
+                         parser.columns[i]->layout->name, (int)parser.columns[i]->layout->itemsize);
+                return PARSE_ERROR;
+            }
+
+            if (len - end < (size_t)cb)
+            {
+                complete = false;
+                break;
+            }
+            end += cb;
+        }
+
+        if (!complete)
+            break;
+
+        pos += 2;
+        for (int i = 0; i < count; i++)
+        {
+            int32_t cb = ReadInt32(&data[pos]);
+            pos += 4;
+
+            if (!ColumnBuffer_Append(parser.columns[i], cb == -1 ? 0 : &data[pos]))
+                return PARSE_NOMEM;
+
+            if (cb != -1)
+                pos += cb;
+        }
+    }
+
+    consumed = pos;
+    return PARSE_OK;
+}
+
+PyObject* CopyOut_ToColumns(Connection* cnxn, const ColumnLayout** layouts, int cColumns)
+{
+    List columns(cColumns);
+    if (!columns)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        Discard(cnxn->pgconn);
+        Py_END_ALLOW_THREADS
+        return 0;
+    }
+
+    for (int i = 0; i < cColumns; i++)
+    {
+        ColumnBuffer* column = ColumnBuffer_New(layouts[i], 1024);
+        if (column == 0)
+        {
+            Py_BEGIN_ALLOW_THREADS
+            Discard(cnxn->pgconn);
+            Py_END_ALLOW_THREADS
+            return 0;
+        }
+        PyList_SET_ITEM(columns.Get(), i, (PyObject*)column);
+    }
+
+    ColumnParser parser;
+    parser.columns   = (ColumnBuffer**)&PyList_GET_ITEM(columns.Get(), 0);
+    parser.cColumns  = cColumns;
+    parser.header    = false;
+    parser.ended     = false;
+    parser.szError[0] = 0;
+
+    int status;
+    int rc = PARSE_OK;
+    size_t remaining;
+
+    Py_BEGIN_ALLOW_THREADS
+    Chunk chunk;
+    do
+    {
+        status = FillChunk(cnxn->pgconn, chunk);
+        if (status != FILL_MORE && status != FILL_END)
+            break;
+
+        size_t consumed;
+        rc = ParseColumns(parser, chunk.data, chunk.len, consumed);
+        if (rc != PARSE_OK)
+        {
+            if (status == FILL_MORE)
+                Discard(cnxn->pgconn);
+            break;
+        }
+
+        memmove(chunk.data, chunk.data + consumed, chunk.len - consumed);
+        chunk.len -= consumed;
+    }
+    while (status == FILL_MORE);
+    remaining = chunk.len;
+    Py_END_ALLOW_THREADS
+
+    if (rc == PARSE_NOMEM)
+    {
+        if (status != FILL_MORE)
+            FinishQuietly(cnxn);
+        return PyErr_NoMemory();
+    }
+
+    if (rc == PARSE_ERROR)
+    {
+        if (status != FILL_MORE)
+            FinishQuietly(cnxn);
+        return SetStringError(Error, parser.szError);
+    }
+
+    if (status != FILL_END)
+        return FillError(cnxn, status);
+
+    if (!parser.ended || remaining != 0)
+    {
+        FinishQuietly(cnxn);
+        return SetStringError(Error, "COPY data ended in the middle of a row");
+    }
+
+    Object count(Finish(cnxn));
+    if (!count)
+        return 0;
+
+    return columns.Detach();
+}
+
+struct CopyOut
+{
+    PyObject_HEAD
+
+    Connection* cnxn;
+    // A reference is held.  This is set to zero once all of the data has been read.
+
+    Chunk* chunk;
+
+    int status;
+    // The last status from FillChunk.  Once it is not FILL_MORE, no more data is read.
+
+    Codec* codec;
+    Chunk* out;
+    // If compressing, the data read into `chunk` is compressed into `out`.  Otherwise both are
+    // zero.
+};
+
+PyObject* CopyOut_New(Connection* cnxn, Compression compression)
+{
+    CopyOut* copy = PyObject_NEW(CopyOut, &CopyOutType);
+    if (copy == 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        Discard(cnxn->pgconn);
+        Py_END_ALLOW_THREADS
+        return 0;
+    }
+
+    copy->cnxn = cnxn;
+    Py_INCREF(cnxn);
+    copy->chunk = new Chunk();
+    copy->status = FILL_MORE;
+    copy->codec = 0;
+    copy->out   = 0;
+
+    if (compression != COMPRESSION_NONE)
+    {
+        copy->codec = new Codec(compression, true);
+        copy->out   = new Chunk();
+    }
+
+    return reinterpret_cast<PyObject*>(copy);
+}
+
+static void Close(CopyOut* copy)
+{
+    if (copy->cnxn == 0)
+        return;
+
+    if (copy->cnxn->pgconn)
+    {
+        if (copy->status == FILL_MORE)
+        {
+            Py_BEGIN_ALLOW_THREADS
+            Discard(copy->cnxn->pgconn);
+            Py_END_ALLOW_THREADS
+        }
+        else
+        {
+            // All of the data has been read, so only the final result is left.
+            FinishQuietly(copy->cnxn);
+        }
+    }
+
+    Py_CLEAR(copy->cnxn);
+}
+
+static void CopyOut_dealloc(PyObject* self)
+{
+    CopyOut* copy = (CopyOut*)self;
+    Close(copy);
+    delete copy->chunk;
+    delete copy->codec;
+    delete copy->out;
+    PyObject_Del(self);
+}
+
+static PyObject* CopyOut_iter(PyObject* self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject* CopyOut_iternext(PyObject* self)
+{
+    CopyOut* copy = (CopyOut*)self;
+
+    if (copy->cnxn == 0)
+        return 0;
+
+    Chunk& chunk = *copy->chunk;
+    Chunk& data  = copy->codec ? *copy->out : chunk;
+
+    for (;;)
+    {
+        if (copy->status == FILL_MORE)
+        {
+            int status;
+            int rc = CODEC_OK;
+            Py_BEGIN_ALLOW_THREADS
+            status = FillChunk(copy->cnxn->pgconn, chunk);
+            if (copy->codec)
+            {
+                rc = copy->codec->Write(chunk.data, chunk.len, ChunkSink, copy->out);
+                if (rc == CODEC_OK && status == FILL_END)
+                    rc = copy->codec->Finish(ChunkSink, copy->out);
+                chunk.len = 0;
+            }
+            Py_END_ALLOW_THREADS
+            copy->status = status;
+
+            if (rc != CODEC_OK)
+            {
+                if (rc == CODEC_ERROR)
+                    SetStringError(Error, copy->codec->szError);
+                else
+                    PyErr_NoMemory();
+                Close(copy);
+                return 0;
+            }
+        }
+
+        if (data.len)
+        {
+            PyObject* bytes = PyBytes_FromStringAndSize(data.data, (Py_ssize_t)data.len);
+            data.len = 0;
+            if (bytes == 0)
+                Close(copy);
+            return bytes;
+        }
+
+        // When compressing, a chunk may not have produced any output yet.
+        if (copy->status != FILL_MORE)
+            break;
+    }
+
+    // We are at the end of the data, either normally or because of an error.  If the command
+    // itself failed, Finish raises the error.
+
+    Connection* cnxn = copy->cnxn;
+    PyObject* count = (copy->status == FILL_END) ? Finish(cnxn) : FillError(cnxn, copy->status);
+    Py_XDECREF(count);
+    Py_CLEAR(copy->cnxn);
+    return 0;
+}
+
+static PyObject* CopyOut_close(PyObject* self, PyObject* args)
+{
+    UNUSED(args);
+    Close((CopyOut*)self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* CopyOut_enter(PyObject* self, PyObject* args)
+{
+    UNUSED(args);
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject* CopyOut_exit(PyObject* self, PyObject* args)
+{
+    return CopyOut_close(self, 0);
+}
+
+static struct PyMethodDef CopyOut_methods[] =
+{
+    { "close",     CopyOut_close, METH_NOARGS,  "Stops the copy, discarding the remaining data." },
+    { "__enter__", CopyOut_enter, METH_NOARGS,  0 },
+    { "__exit__",  CopyOut_exit,  METH_VARARGS, 0 },
+    { 0, 0, 0, 0 }
+};
+
+PyTypeObject CopyOutType =
+{
+    PyVarObject_HEAD_INIT(0, 0)
+    "pglib.CopyOut",            // tp_name
+    sizeof(CopyOut),            // tp_basicsize
+    0,                          // tp_itemsize
+    CopyOut_dealloc,            // destructor tp_dealloc
+    0,                          // tp_print
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_compare
+    0,                          // tp_repr
+    0,                          // tp_as_number
+    0,                          // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    0,                          // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,         // tp_flags
+    0,                          // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    CopyOut_iter,               // tp_iter
+    CopyOut_iternext,           // tp_iternext
+    CopyOut_methods,            // tp_methods
+    0,                          // tp_members
+    0,                          // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    0,                          // tp_new
+    0,                          // tp_free
+    0,                          // tp_is_gc
+    0,                          // tp_bases
+    0,                          // tp_mro
+    0,                          // tp_cache
+    0,                          // tp_subclasses
+    0,                          // tp_weaklist
+};
+
+PyObject* CopyIn_End(Connection* cnxn)
+{
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = PQputCopyEnd(cnxn->pgconn, 0);
+    Py_END_ALLOW_THREADS
+
+    if (status != 1)
+        return SetConnectionError(cnxn);
+
+    return Finish(cnxn);
+}
+
+void CopyIn_Abort(Connection* cnxn, const char* szReason)
+{
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+
+    Py_BEGIN_ALLOW_THREADS
+    if (PQputCopyEnd(cnxn->pgconn, szReason) == 1)
+    {
+        PGresult* result;
+        while ((result = PQgetResult(cnxn->pgconn)) != 0)
+            PQclear(result);
+    }
+    Py_END_ALLOW_THREADS
+
+    PyErr_Restore(type, value, tb);
+}
+
+static bool PutData(Connection* cnxn, const char* p, Py_ssize_t cb)
+{
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = PQputCopyData(cnxn->pgconn, p, (int)cb);
+    Py_END_ALLOW_THREADS
+
+    if (status != 1)
+    {
+        SetConnectionError(cnxn);
+        return false;
+    }
+
+    return true;
+}
+
+static bool PutChunk(Connection* cnxn, Chunk& chunk)
+{
+    bool ok = PutData(cnxn, chunk.data, (Py_ssize_t)chunk.len);
+    chunk.len = 0;
+    return ok;
+}
+
+int OpenForReading(const char* szPath)
+{
+    int fd;
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(szPath, O_RDONLY | O_BINARY);
+    Py_END_ALLOW_THREADS
+    return fd;
+}
+
+void CloseFile(int fd)
+{
+    Py_BEGIN_ALLOW_THREADS
+    close(fd);
+    Py_END_ALLOW_THREADS
+}
+
+static bool PutSink(void* context, const char* p, size_t cb)
+{
+    // A CodecSink that sends the data to the server.  Does not use the GIL.
+    return PQputCopyData((PGconn*)context, p, (int)cb) == 1;
+}
+
+static PyObject* SendError(Connection* cnxn, Codec& codec, int rc)
+{
+    // Reports a failure from a Codec writing to PutSink and aborts the copy.
+
+    if (rc == CODEC_STOPPED)
+        SetConnectionError(cnxn);
+    else
+        SetStringError(Error, codec.szError);
+
+    CopyIn_Abort(cnxn, "Unable to send data");
+    return 0;
+}
+
+CopySource::CopySource()
+{
+    buffer   = 0;
+    cb       = 0;
+    fd       = -1;
+    close_fd = false;
+    file     = 0;
+}
+
+CopySource::~CopySource()
+{
+    if (close_fd)
+        CloseFile(fd);
+}
+
+bool CopySource_Init(CopySource& source, PyObject* obj)
+{
+    // If obj is a string (Unicode), point to its UTF-8 encoded value.  If a bytes object, point
+    // to its data directly.  If it is a file descriptor or path, we'll read it ourselves.
+    // Otherwise it must be an object with a readinto or read method (e.g. file).
+
+    if (PyUnicode_Check(obj))
+    {
+        source.buffer = PyUnicode_AsUTF8AndSize(obj, &source.cb);
+        return source.buffer != 0;
+    }
+
+    if (PyBytes_Check(obj))
+    {
+        source.buffer = PyBytes_AS_STRING(obj);
+        source.cb     = PyBytes_GET_SIZE(obj);
+        return true;
+    }
+
+    // bool is a subclass of int, but True is almost certainly not meant to be stdout.
+    if (PyBool_Check(obj))
+    {
+        PyErr_SetString(PyExc_TypeError, "source cannot be a bool");
+        return false;
+    }
+
+    if (PyLong_Check(obj))
+    {
+        long l = PyLong_AsLong(obj);
+        if (l == -1 && PyErr_Occurred())
+            return false;
+        if (l < 0 || l > INT_MAX)
+        {
+            PyErr_SetString(PyExc_ValueError, "source is not a valid file descriptor");
+            return false;
+        }
+        source.fd = (int)l;
+        return true;
+    }
+
+    if (PyObject_HasAttrString(obj, "__fspath__"))
+    {
+        PyObject* pathobj = 0;
+        if (!PyUnicode_FSConverter(obj, &pathobj))
+            return false;
+        Object path(pathobj);
+
+        source.fd = OpenForReading(PyBytes_AS_STRING(path.Get()));
+        if (source.fd == -1)
+        {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, obj);
+            return false;
+        }
+        source.close_fd = true;
+        return true;
+    }
+
+    if (!PyObject_HasAttrString(obj, "readinto") && !PyObject_HasAttrString(obj, "read"))
+    {
+        PyErr_Format(Error, "COPY source must be a string, file-like object, file descriptor, or path.");
+        return false;
+    }
+
+    source.file = obj;
+    return true;
+}
+
+static int ReadBuffer(CopySource& source, Py_ssize_t chunk_size, Codec& codec, CodecSink sink, void* context)
+{
+    // The codec is fed at most chunk_size bytes at a time since an uncompressed codec passes
+    // each write straight through and PQputCopyData takes an int length.
+
+    const char* p = source.buffer;
+    size_t remaining = (size_t)source.cb;
+    int rc = CODEC_OK;
+
+    Py_BEGIN_ALLOW_THREADS
+    while (remaining != 0 && rc == CODEC_OK)
+    {
+        size_t cb = remaining < (size_t)chunk_size ? remaining : (size_t)chunk_size;
+        rc = codec.Write(p, cb, sink, context);
+        p += cb;
+        remaining -= cb;
+    }
+    if (rc == CODEC_OK)
+        rc = codec.Finish(sink, context);
+    Py_END_ALLOW_THREADS
+
+    return rc;
+}
+
+static int ReadFd(CopySource& source, Py_ssize_t chunk_size, Codec& codec, CodecSink sink, void* context)
+{
+    char* buffer = (char*)malloc((size_t)chunk_size);
+    if (buffer == 0)
+    {
+        PyErr_NoMemory();
+        return READ_ERROR;
+    }
+
+    int fd = source.fd;
+    int read_errno = 0;
+    int rc = CODEC_OK;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (;;)
+    {
+        int cb = (int)read(fd, buffer, (unsigned int)chunk_size);
+        if (cb < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            read_errno = errno;
+            break;
+        }
+
+        if (cb == 0)
+        {
+            rc = codec.Finish(sink, context);
+            break;
+        }
+
+        rc = codec.Write(buffer, (size_t)cb, sink, context);
+        if (rc != CODEC_OK)
+            break;
+    }
+    Py_END_ALLOW_THREADS
+
+    free(buffer);
+
+    if (read_errno)
+    {
+        errno = read_errno;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return READ_ERROR;
+    }
+
+    return rc;
+}
+
+static int ReadFile(CopySource& source, Py_ssize_t chunk_size, Codec& codec, CodecSink sink, void* context)
+{
+    // If the object has a readinto method, we read into a bytearray we allocate once.
+    // Otherwise we have to call read, which allocates a new object each time.
+
+    Object buffer;
+    Object method(PyObject_GetAttrString(source.file, "readinto"));
+    if (method)
+    {
+        buffer.Attach(PyByteArray_FromStringAndSize(0, chunk_size));
+        if (!buffer)
+            return READ_ERROR;
+    }
+    else
+    {
+        PyErr_Clear();
+        method.Attach(PyObject_GetAttrString(source.file, "read"));
+        if (!method)
+            return READ_ERROR;
+    }
+
+    for (;;)
+    {
+        const char* p;
+        Py_ssize_t cb;
+
+        Object result(buffer ? PyObject_CallFunctionObjArgs(method, buffer.Get(), 0)
+                             : PyObject_CallFunction(method, "n", chunk_size));
+        if (!result)
+            return READ_ERROR;
+
+        if (buffer)
+        {
+            if (result == Py_None)
+            {
+                PyErr_SetString(Error, "readinto returned None.  Non-blocking files are not supported.");
+                return READ_ERROR;
+            }
+
+            cb = PyLong_AsSsize_t(result);
+            if (cb == -1 && PyErr_Occurred())
+                return READ_ERROR;
+            if (cb < 0 || cb > PyByteArray_GET_SIZE(buffer.Get()))
+            {
+                PyErr_Format(Error, "readinto returned an invalid size: %zd", cb);
+                return READ_ERROR;
+            }
+            p = PyByteArray_AS_STRING(buffer.Get());
+        }
+        else if (PyBytes_Check(result))
+        {
+            p  = PyBytes_AS_STRING(result.Get());
+            cb = PyBytes_GET_SIZE(result.Get());
+        }
+        else if (PyUnicode_Check(result.Get()))
+        {
+            p = PyUnicode_AsUTF8AndSize(result.Get(), &cb);
+            if (p == 0)
+                return READ_ERROR;
+        }
+        else
+        {
+            PyErr_Format(Error, "Result of reading is not a bytes object: %R", result.Get());
+            return READ_ERROR;
+        }
+
+        int rc;
+        Py_BEGIN_ALLOW_THREADS
+        rc = (cb == 0) ? codec.Finish(sink, context) : codec.Write(p, (size_t)cb, sink, context);
+        Py_END_ALLOW_THREADS
+
+        if (rc != CODEC_OK || cb == 0)
+            return rc;
+    }
+}
+
+int ReadSource(CopySource& source, Py_ssize_t chunk_size, Codec& codec, CodecSink sink, void* context)
+{
+    if (source.buffer)
+        return ReadBuffer(source, chunk_size, codec, sink, context);
+    if (source.fd != -1)
+        return ReadFd(source, chunk_size, codec, sink, context);
+    return ReadFile(source, chunk_size, codec, sink, context);
+}
+
+PyObject* CopyIn_Source(Connection* cnxn, CopySource& source, Py_ssize_t chunk_size, Compression compression)
+{
+    Codec codec(compression, false);
+
+    int rc = ReadSource(source, chunk_size, codec, PutSink, cnxn->pgconn);
+
+    if (rc == READ_ERROR)
+    {
+        CopyIn_Abort(cnxn, "Unable to read the data");
+        return 0;
+    }
+
+    if (rc != CODEC_OK)
+        return SendError(cnxn, codec, rc);
+
+    return CopyIn_End(cnxn);
+}
+
+static inline int FloorDiv4(int n)
+{
+    return (n >= 0) ? (n / 4) : -((-n + 3) / 4);
+}
+
+static bool MatchWord(const char* p, const char* word)
+{
+    // Returns true if `p` is `word`, ignoring case.
+    while (*word && tolower((unsigned char)*p) == *word)
+    {
+        p++;
+        word++;
+    }
+    return *word == 0 && *p == 0;
+}
+
+static bool AppendNumeric(Chunk& chunk, const char* sz)
+{
+    // Encodes a decimal string such as "-12.340" or "1.5E+7" as a binary numeric field:
+    //
+    //   int16 ndigits, int16 weight, uint16 sign, uint16 dscale, int16 digits[ndigits]
+    //
+    // The digits are base 10000 and weight is the power of 10000 of the first one.
+
+    const uint16_t NUMERIC_POS  = 0x0000;
+    const uint16_t NUMERIC_NEG  = 0x4000;
+    const uint16_t NUMERIC_NAN  = 0xC000;
+    const uint16_t NUMERIC_PINF = 0xD000;
+    const uint16_t NUMERIC_NINF = 0xF000;
+
+    static const int16_t pow10[] = { 1, 10, 100, 1000 };
+
+    const char* p = sz;
+    bool negative = false;
+    if (*p == '-' || *p == '+')
+        negative = (*p++ == '-');
+
+    uint16_t special = 0;
+    if (MatchWord(p, "nan"))
+        special = NUMERIC_NAN;
+    else if (MatchWord(p, "inf") || MatchWord(p, "infinity"))
+        special = negative ? NUMERIC_NINF : NUMERIC_PINF;
+
+    if (special)
+    {
+        return chunk.AppendInt32(8) && chunk.AppendInt16(0) && chunk.AppendInt16(0) &&
+            chunk.AppendInt16((int16_t)special) && chunk.AppendInt16(0);
+    }
+
+    // Find the digits, skipping the decimal point, and the exponent.
+
+    const char* digits = p;
+    int cDigits = 0;
+    int cFraction = 0;
+    bool point = false;
+    for (; *p; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            cDigits += 1;
+            if (point)
+                cFraction += 1;
+        }
+        else if (*p == '.' && !point)
+        {
+            point = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    long exponent = 0;
+    if (*p == 'e' || *p == 'E')
+    {
+        char* end;
+        exponent = strtol(p + 1, &end, 10);
+        p = end;
+    }
+
+    if (cDigits == 0 || *p != 0 || exponent > 100000 || exponent < -100000)
+    {
+        PyErr_Format(Error, "Invalid numeric value: '%s'", sz);
+        return false;
+    }
+
+    // The power of ten of the last digit.  Trailing zeros are significant for the display
+    // scale but not for the digits.
+    int exp = (int)exponent - cFraction;
+    int dscale = MAX(0, -exp);
+
+    // Gather the significant digits, from the first non-zero digit to the last.
+
+    int first = -1;
+    int last  = -1;
+    for (int i = 0, iDigit = 0; digits[i] && iDigit < cDigits; i++)
+    {
+        if (digits[i] == '.')
+            continue;
+        if (digits[i] != '0')
+        {
+            if (first == -1)
+                first = iDigit;
+            last = iDigit;
+        }
+        iDigit++;
+    }
+
+    if (first == -1)
+    {
+        // Zero
+        return chunk.AppendInt32(8) && chunk.AppendInt16(0) && chunk.AppendInt16(0) &&
+            chunk.AppendInt16((int16_t)NUMERIC_POS) && chunk.AppendInt16((int16_t)dscale);
+    }
+
+    int high = exp + (cDigits - 1 - first);
+    int low  = exp + (cDigits - 1 - last);
+    int weight  = FloorDiv4(high);
+    int cGroups = weight - FloorDiv4(low) + 1;
+
+    if (weight > 0x7FFF || weight < -0x8000 || cGroups > 0x7FFF || dscale > 0x3FFF)
+    {
+        PyErr_Format(Error, "Numeric value out of range: '%s'", sz);
+        return false;
+    }
+
+    int16_t* groups = (int16_t*)calloc((size_t)cGroups, sizeof(int16_t));
+    if (groups == 0)
+    {
+        PyErr_NoMemory();
+        return false;
+    }
+
+    for (int i = 0, iDigit = 0; iDigit <= last; i++)
+    {
+        if (digits[i] == '.')
+            continue;
+        int d = digits[i] - '0';
+        if (d != 0)
+        {
+            int power = exp + (cDigits - 1 - iDigit);
+            int group = FloorDiv4(power);
+            groups[weight - group] += (int16_t)(d * pow10[power - group * 4]);
+        }
+        iDigit++;
+    }
+
+    bool ok = chunk.AppendInt32(8 + 2 * cGroups) &&
+        chunk.AppendInt16((int16_t)cGroups) &&
+        chunk.AppendInt16((int16_t)weight) &&
+        chunk.AppendInt16((int16_t)(negative ? NUMERIC_NEG : NUMERIC_POS)) &&
+        chunk.AppendInt16((int16_t)dscale);
+
+    for (int i = 0; ok && i < cGroups; i++)
+        ok = chunk.AppendInt16(groups[i]);
+
+    free(groups);
+
+    if (!ok)
+        PyErr_NoMemory();
+
+    return ok;
+}
+
+static bool GetBoundInteger(Params& params, int i, int64_t& value)
+{
+    // If parameter `i` was bound as an integer, stores it in `value` and returns true.
+
+    const char* p = params.values[i];
+
+    switch (params.types[i])
+    {
+    case INT2OID:
+    {
+        int16_t n;
+        memcpy(&n, p, 2);
+        value = swaps2(n);
+        return true;
+    }
+    case INT4OID:
+    {
+        int32_t n;
+        memcpy(&n, p, 4);
+        value = swaps4(n);
+        return true;
+    }
+    case INT8OID:
+    {
+        int64_t n;
+        memcpy(&n, p, 8);
+        value = swaps8(n);
+        return true;
+    }
+    }
+
+    return false;
+}
+
+static bool GetBoundDouble(Params& params, int i, double& value)
+{
+    if (params.types[i] != FLOAT8OID)
+        return false;
+
+    memcpy(&value, params.values[i], 8);
+    value = swapdouble(value);
+    return true;
+}
+
+static bool AppendRaw(Chunk& chunk, const char* p, int len)
+{
+    if (!chunk.AppendInt32(len) || !chunk.Append(p, (size_t)len))
+    {
+        PyErr_NoMemory();
+        return false;
+    }
+    return true;
+}
+
+static bool IsUTCSession(PGconn* pgconn)
+{
+    // Returns true if the session's TimeZone is UTC, so timestamps and timestamptz values have
+    // the same binary value.
+
+    static const char* const names[] = {
+        "UTC", "Etc/UTC", "GMT", "Etc/GMT", "UCT", "Etc/UCT", "Universal", "Etc/Universal", "Zulu", "Etc/Zulu"
+    };
+
+    const char* zone = PQparameterStatus(pgconn, "TimeZone");
+    if (zone == 0)
+        return false;
+
+    for (size_t i = 0; i < _countof(names); i++)
+        if (PyOS_stricmp(zone, names[i]) == 0)
+            return true;
+
+    return false;
+}
+
+static bool AppendField(Chunk& chunk, Oid target, Params& params, int i, PyObject* value, bool utc)
+{
+    // Appends the value bound in parameter `i` as a field of type `target`.  The binders choose
+    // a type based on the Python value, so they are converted to the column's type here since
+    // binary COPY, unlike a query parameter, must be in exactly the column's format.
+    //
+    // `utc` is true if the session's TimeZone is UTC.  A query parameter converted between
+    // timestamp and timestamptz is interpreted in the session's time zone, which we can only
+    // do here when it is UTC.
+
+    Oid type = params.types[i];
+    const char* p = params.values[i];
+    int len = params.lengths[i];
+
+    if (type == 0)
+    {
+        // NULL
+        if (!chunk.AppendInt32(-1))
+        {
+            PyErr_NoMemory();
+            return false;
+        }
+        return true;
+    }
+
+    if (type == target && params.formats[i] == FORMAT_BINARY)
+        return AppendRaw(chunk, p, len);
+
+    int64_t n;
+    double d;
+
+    switch (target)
+    {
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+        if (GetBoundInteger(params, i, n))
+        {
+            if (target == INT8OID)
+            {
+                int64_t v = swaps8(n);
+                return AppendRaw(chunk, (const char*)&v, 8);
+            }
+            if (target == INT4OID && n >= INT32_MIN && n <= INT32_MAX)
+            {
+                int32_t v = swaps4((int32_t)n);
+                return AppendRaw(chunk, (const char*)&v, 4);
+            }
+            if (target == INT2OID && n >= INT16_MIN && n <= INT16_MAX)
+            {
+                int16_t v = swaps2((int16_t)n);
+                return AppendRaw(chunk, (const char*)&v, 2);
+            }
+            PyErr_Format(Error, "Value %R is out of range for column %d", value, i + 1);
+            return false;
+        }
+        break;
+
+    case FLOAT4OID:
+    case FLOAT8OID:
+        if (GetBoundInteger(params, i, n))
+            d = (double)n;
+        else if (!GetBoundDouble(params, i, d))
+            break;
+
+        if (target == FLOAT4OID)
+        {
+            float v = swapfloat((float)d);
+            return AppendRaw(chunk, (const char*)&v, 4);
+        }
+        else
+        {
+            double v = swapdouble(d);
+            return AppendRaw(chunk, (const char*)&v, 8);
+        }
+
+    case NUMERICOID:
+        if (type == NUMERICOID)
+        {
+            // Decimals are bound as text.
+            return AppendNumeric(chunk, p);
+        }
+        if (GetBoundInteger(params, i, n))
+        {
+            char sz[32];
+            snprintf(sz, sizeof(sz), "%lld", (long long)n);
+            return AppendNumeric(chunk, sz);
+        }
+        if (GetBoundDouble(params, i, d))
+        {
+            char* sz = PyOS_double_to_string(d, 'r', 0, 0, 0);
+            if (sz == 0)
+                return false;
+            bool ok = AppendNumeric(chunk, sz);
+            PyMem_Free(sz);
+            return ok;
+        }
+        break;
+
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case NAMEOID:
+    case JSONOID:
+        // The binary format of these is just the text.
+        if (type == TEXTOID)
+            return AppendRaw(chunk, p, len);
+        // Dicts and lists are bound as jsonb, which is the text after a version byte.
+        if (type == JSONBOID && target == JSONOID)
+            return AppendRaw(chunk, p + 1, len - 1);
+        break;
+
+    case JSONBOID:
+        if (type == JSONBOID)
+            return AppendRaw(chunk, p, len);
+        if (type == TEXTOID)
+        {
+            const char version = 1;
+            if (!chunk.AppendInt32(len + 1) || !chunk.Append(&version, 1) || !chunk.Append(p, (size_t)len))
+            {
+                PyErr_NoMemory();
+                return false;
+            }
+            return true;
+        }
+        break;
+
+    case TIMESTAMPTZOID:
+    case TIMESTAMPOID:
+        // Both are microseconds since 2000-01-01, so in a UTC session a naive datetime copied
+        // into timestamptz, or an aware one copied into timestamp, is the same value.
+        if (type == TIMESTAMPOID || type == TIMESTAMPTZOID)
+        {
+            if (utc)
+                return AppendRaw(chunk, p, len);
+            PyErr_Format(Error,
+                         "Unable to copy %s datetime %R into column %d: a %s datetime can only be copied into a %s "
+                         "column when the session's TimeZone is UTC",
+                         (type == TIMESTAMPOID) ? "naive" : "aware", value, i + 1,
+                         (type == TIMESTAMPOID) ? "naive" : "aware",
+                         (target == TIMESTAMPOID) ? "timestamp" : "timestamptz");
+            return false;
+        }
+        break;
+
+    case TIMEOID:
+        // Like the server's timetz to time cast, the offset is dropped.  The time comes first.
+        if (type == TIMETZOID)
+            return AppendRaw(chunk, p, 8);
+        break;
+    }
+
+    PyErr_Format(Error, "Unable to copy a %s value into column %d (type OID %u)", Py_TYPE(value)->tp_name, i + 1, (unsigned int)target);
+    return false;
+}
+
+const char BINARY_HEADER[] =
+    "PGCOPY\n\377\r\n\0"   // signature
+    "\0\0\0\0"              // flags
+    "\0\0\0\0";             // header extension length
+
+PyObject* CopyIn_Rows(Connection* cnxn, int cColumns, const Oid* types, PyObject* rows)
+{
+    Object iter(PyObject_GetIter(rows));
+    if (!iter)
+    {
+        CopyIn_Abort(cnxn, "Invalid rows");
+        return 0;
+    }
+
+    Params params(cColumns);
+    if (!params.valid())
+    {
+        PyErr_NoMemory();
+        CopyIn_Abort(cnxn, "Out of memory");
+        return 0;
+    }
+
+    bool utc = IsUTCSession(cnxn->pgconn);
+
+    Chunk chunk;
+    if (!chunk.Append(BINARY_HEADER, BINARY_HEADER_SIZE))
+    {
+        PyErr_NoMemory();
+        CopyIn_Abort(cnxn, "Out of memory");
+        return 0;
+    }
+
+    for (;;)
+    {
+        Object row(PyIter_Next(iter));
+        if (!row)
+        {
+            if (PyErr_Occurred())
+            {
+                CopyIn_Abort(cnxn, "An error occurred reading the rows");
+                return 0;
+            }
+            break;
+        }
+
+        Object seq(PySequence_Fast(row, "Each row must be a sequence"));
+        if (!seq)
+        {
+            CopyIn_Abort(cnxn, "Invalid row");
+            return 0;
+        }
+
+        if (PySequence_Fast_GET_SIZE(seq.Get()) != cColumns)
+        {
+            PyErr_Format(Error, "Expected %d values in each row but got %zd", cColumns, PySequence_Fast_GET_SIZE(seq.Get()));
+            CopyIn_Abort(cnxn, "Invalid row");
+            return 0;
+        }
+
+        PyObject** items = PySequence_Fast_ITEMS(seq.Get());
+
+        params.Reset();
+
+        if (!chunk.AppendInt16((int16_t)cColumns))
+        {
+            PyErr_NoMemory();
+            CopyIn_Abort(cnxn, "Out of memory");
+            return 0;
+        }
+
+        for (int i = 0; i < cColumns; i++)
+        {
+            if (!BindParam(cnxn, params, items[i]) || !AppendField(chunk, types[i], params, i, items[i], utc))
+            {
+                CopyIn_Abort(cnxn, "Invalid value");
+                return 0;
+            }
+        }
+
+        if (chunk.len >= COPY_CHUNK_SIZE && !PutChunk(cnxn, chunk))
+        {
+            CopyIn_Abort(cnxn, "Unable to send data");
+            return 0;
+        }
+    }
+
+    // The trailer is a tuple with a field count of -1.
+    if (!chunk.AppendInt16(-1))
+    {
+        PyErr_NoMemory();
+        CopyIn_Abort(cnxn, "Out of memory");
+        return 0;
+    }
+
+    if (!PutChunk(cnxn, chunk))
+    {
+        CopyIn_Abort(cnxn, "Unable to send data");
+        return 0;
+    }
+
+    return CopyIn_End(cnxn);
+}
@@ -0,0 +1,99 @@
+
+#ifndef COPY_H
+#define COPY_H
+
+#include "compress.h"
+
+struct Connection;
+struct ColumnLayout;
+
+extern PyTypeObject CopyOutType;
+
+// The following are called after a COPY TO STDOUT command has been executed and returned
+// PGRES_COPY_OUT.  If an error occurs, the rest of the data is discarded so the connection can
+// be used again.
+
+PyObject* CopyOut_New(Connection* cnxn, Compression compression);
+// Returns an iterator that yields the data, compressed if requested, as bytes objects.
+
+PyObject* CopyOut_ToFd(Connection* cnxn, int fd, Compression compression);
+// Writes the data to a file descriptor with the GIL released and returns the number of rows.
+
+PyObject* CopyOut_ToFile(Connection* cnxn, PyObject* file, Compression compression);
+// Writes the data to a file-like object's write method and returns the number of rows.
+
+PyObject* CopyOut_ToColumns(Connection* cnxn, const ColumnLayout** layouts, int cColumns);
+// Parses binary COPY data, which must have a column for each layout, into a ColumnBuffer per
+// column and returns a list of them.
+
+struct FdSink
+{
+    int fd;
+    int error;
+    // The errno from a failed write, or zero.
+};
+
+bool WriteFd(void* context, const char* p, size_t cb);
+// A CodecSink that writes to the FdSink `context`, retrying partial writes.  Does not use the
+// GIL.
+
+// The following are called after a COPY FROM STDIN command has returned PGRES_COPY_IN.
+
+extern const char BINARY_HEADER[];
+const size_t BINARY_HEADER_SIZE = 19;
+// The header of binary COPY data with no flags or extension, as written by CopyIn_Rows.
+
+PyObject* CopyIn_Rows(Connection* cnxn, int cColumns, const Oid* types, PyObject* rows);
+// Sends the rows from the iterable `rows` in the binary COPY format, encoding each value as
+// the corresponding type in `types`.  Returns the number of rows copied.
+
+struct CopySource
+{
+    // The data for a COPY FROM command.  Exactly one of `buffer`, `fd`, or `file` is used.
+
+    const char* buffer;
+    Py_ssize_t cb;
+    // Points into a str or bytes object owned by the caller.
+
+    int fd;
+    bool close_fd;
+    // True if we opened `fd` from a path and must close it.
+
+    PyObject* file;
+    // A borrowed reference to a file-like object with a readinto or read method.
+
+    CopySource();
+    ~CopySource();
+};
+
+bool CopySource_Init(CopySource& source, PyObject* obj);
+// Initializes `source` from a str, bytes, integer file descriptor, os.PathLike, or file-like
+// object.  Paths are opened with the GIL released.
+
+enum
+{
+    READ_ERROR = -1
+    // ReadSource could not read the data and a Python exception is set.
+};
+
+int ReadSource(CopySource& source, Py_ssize_t chunk_size, Codec& codec, CodecSink sink, void* context);
+// Reads all of the source `chunk_size` bytes at a time and passes it through `codec` to
+// `sink`.  Returns a CODEC_ code or READ_ERROR.  Must be called with the GIL held.  It is
+// released while reading buffers and file descriptors and while the codec and sink run.
+
+PyObject* CopyIn_Source(Connection* cnxn, CopySource& source, Py_ssize_t chunk_size, Compression compression);
+// Sends the source, decompressing it first if `compression` is not COMPRESSION_NONE, and
+// ends the copy.  Returns the number of rows copied.
+
+PyObject* CopyIn_End(Connection* cnxn);
+// Ends the copy and returns the number of rows copied.
+
+void CopyIn_Abort(Connection* cnxn, const char* szReason);
+// Aborts the copy, leaving the current exception, if any, alone.
+
+int OpenForReading(const char* szPath);
+// Opens a file with the GIL released and returns its file descriptor, or -1 with errno set.
+
+void CloseFile(int fd);
+
+#endif // COPY_H
@@ -0,0 +1,423 @@
+
+// Server-side cursors.
+//
+// A Cursor declares a cursor on the server and fetches its rows in blocks of `itersize` rows.
+// If prefetching is enabled, the FETCH for the next block is sent as soon as the current block
+// is received, so the server produces the next block while we are converting the current one.
+//
+// Cursors declared without WITH HOLD only exist until the end of the transaction, so they can
+// only be used inside a transaction.
+
+#include "pglib.h"
+#include "cursor.h"
+#include "connection.h"
+#include "resultset.h"
+#include "row.h"
+#include "params.h"
+#include "errors.h"
+
+struct Cursor
+{
+    PyObject_HEAD
+
+    Connection* cnxn;
+    // A reference is held.  This is set to zero once the cursor has been closed.
+
+    char name[32];
+
+    int itersize;
+    bool prefetch;
+
+    bool pending;
+    // True if a FETCH has been sent but its result has not been read.
+
+    bool exhausted;
+    // True once we've received the last block.
+
+    ResultSet* rset;
+    // The current block, or zero.
+
+    int iRow;
+    // The next row to return from `rset`.
+
+    PyObject* columns;
+    PyObject* plan;
+    // Shared by all blocks.  Set from the first block.
+};
+
+static unsigned int next_cursor_id = 0;
+
+static bool SendFetch(Cursor* cursor)
+{
+    if (cursor->cnxn->busy)
+    {
+        SetStringError(Error, "The connection is busy reading the results of a stream or cursor");
+        return false;
+    }
+
+    char szSQL[64];
+    snprintf(szSQL, sizeof(szSQL), "FETCH FORWARD %d FROM %s", cursor->itersize, cursor->name);
+
+    int sent;
+    Py_BEGIN_ALLOW_THREADS
+    sent = PQsendQueryParams(cursor->cnxn->pgconn, szSQL, 0, 0, 0, 0, 0, 1);
+    Py_END_ALLOW_THREADS
+
+    if (!sent)
+    {
+        SetConnectionError(cursor->cnxn);
+        return false;
+    }
+
+    cursor->pending = true;
+    cursor->cnxn->busy = true;
+    return true;
+}
+
+static PGresult* ReadFetch(Cursor* cursor)
+{
+    // Waits for the result of the outstanding FETCH.  libpq returns a NULL after each
+    // command's results, which we read so the connection is ready for the next command.
+
+    PGresult* result;
+    Py_BEGIN_ALLOW_THREADS
+    result = PQgetResult(cursor->cnxn->pgconn);
+    PGresult* tmp;
+    while ((tmp = PQgetResult(cursor->cnxn->pgconn)) != 0)
+        PQclear(tmp);
+    Py_END_ALLOW_THREADS
+
+    cursor->pending = false;
+    cursor->cnxn->busy = false;
+
+    if (result == 0)
+        SetConnectionError(cursor->cnxn);
+
+    return result;
+}
+
+static void CloseCursor(Cursor* cursor, bool verify)
+{
+    // Closes the cursor on the server and releases the connection.
+    //
+    // If `verify` is true we first make sure the cursor still exists.  If the transaction it
+    // was declared in has ended, a CLOSE would fail and abort whatever transaction the
+    // connection is in now.
+
+    if (cursor->cnxn == 0)
+        return;
+
+    PGconn* pgconn = cursor->cnxn->pgconn;
+
+    if (pgconn)
+    {
+        if (cursor->pending)
+        {
+            // This is called from dealloc and error paths, so keep any exception that is
+            // already pending rather than replacing it with one from the fetch.
+            PyObject *type, *value, *tb;
+            PyErr_Fetch(&type, &value, &tb);
+            PGresult* result = ReadFetch(cursor);
+            if (result)
+                PQclear(result);
+            else
+                PyErr_Clear();
+            PyErr_Restore(type, value, tb);
+        }
+
+        char szSQL[64];
+        snprintf(szSQL, sizeof(szSQL), "CLOSE %s", cursor->name);
+        const char* values[1] = { cursor->name };
+
+        Py_BEGIN_ALLOW_THREADS
+        if (PQtransactionStatus(pgconn) == PQTRANS_INTRANS)
+        {
+            bool exists = true;
+            if (verify)
+            {
+                PGresult* result = PQexecParams(pgconn, "SELECT 1 FROM pg_catalog.pg_cursors WHERE name = $1",
+                                                1, 0, values, 0, 0, 0);
+                exists = (result && PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) == 1);
+                if (result)
+                    PQclear(result);
+            }
+
+            if (exists)
+            {
+                PGresult* result = PQexec(pgconn, szSQL);
+                if (result)
+                    PQclear(result);
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    Py_CLEAR(cursor->cnxn);
+}
+
+PyObject* Cursor_New(Connection* cnxn, PyObject* args, int itersize, bool prefetch)
+{
+    Py_ssize_t cParams = PyTuple_Size(args) - 1;
+    if (cParams < 0)
+        return SetStringError(PyExc_TypeError, "Expected at least 1 argument (0 given)");
+
+    PyObject* pSql = PyTuple_GET_ITEM(args, 0);
+    if (!PyUnicode_Check(pSql))
+        return SetStringError(PyExc_TypeError, "The first argument must be a string.");
+
+    Cursor* cursor = PyObject_NEW(Cursor, &CursorType);
+    if (cursor == 0)
+        return 0;
+
+    cursor->cnxn      = 0;
+    cursor->itersize  = itersize;
+    cursor->prefetch  = prefetch;
+    cursor->pending   = false;
+    cursor->exhausted = false;
+    cursor->rset      = 0;
+    cursor->iRow      = 0;
+    cursor->columns   = 0;
+    cursor->plan   = 0;
+    snprintf(cursor->name, sizeof(cursor->name), "pglib_cursor_%u", next_cursor_id++);
+
+    Object self((PyObject*)cursor);
+
+    Object sql(PyUnicode_FromFormat("DECLARE %s BINARY NO SCROLL CURSOR FOR %U", cursor->name, pSql));
+    if (!sql)
+        return 0;
+
+    const char* szSQL = PyUnicode_AsUTF8(sql);
+    if (szSQL == 0)
+        return 0;
+
+    Params params(cParams);
+    if (!BindParams(cnxn, params, args))
+        return 0;
+
+    ResultHolder result;
+    Py_BEGIN_ALLOW_THREADS
+    result = PQexecParams(cnxn->pgconn, szSQL,
+                          cParams,
+                          params.types,
+                          params.values,
+                          params.lengths,
+                          params.formats,
+                          1); // binary format
+    Py_END_ALLOW_THREADS
+
+    if (result == 0)
+        return SetConnectionError(cnxn);
+
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+        return SetResultError(result.Detach());
+
+    cursor->cnxn = cnxn;
+    Py_INCREF(cnxn);
+
+    // Get the server started on the first block right away.
+    if (prefetch && !SendFetch(cursor))
+        return 0;
+
+    return self.Detach();
+}
+
+static void Cursor_dealloc(PyObject* self)
+{
+    Cursor* cursor = (Cursor*)self;
+
+    CloseCursor(cursor, true);
+
+    Py_XDECREF(cursor->rset);
+    Py_XDECREF(cursor->columns);
+    Py_XDECREF(cursor->plan);
+    PyObject_Del(self);
+}
+
+static PyObject* Cursor_iter(PyObject* self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static bool NextBlock(Cursor* cursor)
+{
+    // Reads the next block of rows into cursor->rset.  Returns false when there are no more
+    // rows or if an error occurs, in which case an exception will be set.
+
+    Py_CLEAR(cursor->rset);
+    cursor->iRow = 0;
+
+    if (cursor->exhausted || cursor->cnxn == 0)
+        return false;
+
+    if (!cursor->pending && !SendFetch(cursor))
+        return false;
+
+    PGresult* result = ReadFetch(cursor);
+    if (result == 0)
+        return false;
+
+    if (PQresultStatus(result) != PGRES_TUPLES_OK)
+    {
+        cursor->exhausted = true;
+        Py_CLEAR(cursor->cnxn);
+        SetResultError(result);
+        return false;
+    }
+
+    int cRows = PQntuples(result);
+
+    PyObject* rset = ResultSet_New(cursor->cnxn, result, cursor->columns, cursor->plan);
+    if (rset == 0)
+        return false;
+
+    cursor->rset = (ResultSet*)rset;
+
+    if (cursor->columns == 0)
+    {
+        cursor->columns = cursor->rset->columns;
+        Py_XINCREF(cursor->columns);
+        cursor->plan = cursor->rset->planobj;
+        Py_XINCREF(cursor->plan);
+    }
+
+    if (cRows < cursor->itersize)
+    {
+        // A short block means there are no more rows, so we can close the cursor now.  We
+        // just fetched from it, so we know it still exists.
+        cursor->exhausted = true;
+        CloseCursor(cursor, false);
+    }
+    else if (cursor->prefetch)
+    {
+        if (!SendFetch(cursor))
+            return false;
+    }
+
+    return cRows > 0;
+}
+
+static PyObject* Cursor_iternext(PyObject* self)
+{
+    Cursor* cursor = (Cursor*)self;
+
+    if (cursor->rset == 0 || cursor->iRow >= PQntuples(cursor->rset->result))
+    {
+        if (!NextBlock(cursor))
+            return 0;
+    }
+
+    return Row_New(cursor->rset, cursor->iRow++);
+}
+
+static PyObject* Cursor_close(PyObject* self, PyObject* args)
+{
+    UNUSED(args);
+    Cursor* cursor = (Cursor*)self;
+    Py_CLEAR(cursor->rset);
+    cursor->exhausted = true;
+    CloseCursor(cursor, true);
+    Py_RETURN_NONE;
+}
+
+static PyObject* Cursor_enter(PyObject* self, PyObject* args)
+{
+    UNUSED(args);
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject* Cursor_exit(PyObject* self, PyObject* args)
+{
+    return Cursor_close(self, 0);
+}
+
+static PyObject* Cursor_getcolumns(Cursor* self, void* closure)
+{
+    UNUSED(closure);
+
+    if (self->columns == 0)
+    {
+        Py_RETURN_NONE;
+    }
+
+    Py_INCREF(self->columns);
+    return self->columns;
+}
+
+static PyObject* Cursor_getname(Cursor* self, void* closure)
+{
+    UNUSED(closure);
+    return PyUnicode_FromString(self->name);
+}
+
+static PyObject* Cursor_getitersize(Cursor* self, void* closure)
+{
+    UNUSED(closure);
+    return PyLong_FromLong(self->itersize);
+}
+
+static PyGetSetDef Cursor_getsetters[] =
+{
+    { (char*)"columns",  (getter)Cursor_getcolumns,  0, (char*)"tuple of column names, or None until the first block is read", 0 },
+    { (char*)"name",     (getter)Cursor_getname,     0, (char*)"the name of the cursor on the server", 0 },
+    { (char*)"itersize", (getter)Cursor_getitersize, 0, (char*)"the number of rows fetched at a time", 0 },
+    { 0 }
+};
+
+static struct PyMethodDef Cursor_methods[] =
+{
+    { "close",     Cursor_close, METH_NOARGS,  "Closes the cursor on the server." },
+    { "__enter__", Cursor_enter, METH_NOARGS,  0 },
+    { "__exit__",  Cursor_exit,  METH_VARARGS, 0 },
+    { 0, 0, 0, 0 }
+};
+
+PyTypeObject CursorType =
+{
+    PyVarObject_HEAD_INIT(0, 0)
+    "pglib.Cursor",             // tp_name
+    sizeof(Cursor),             // tp_basicsize
+    0,                          // tp_itemsize
+    Cursor_dealloc,             // destructor tp_dealloc
+    0,                          // tp_print
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_compare
+    0,                          // tp_repr
+    0,                          // tp_as_number
+    0,                          // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    0,                          // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,         // tp_flags
+    0,                          // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    Cursor_iter,                // tp_iter
+    Cursor_iternext,            // tp_iternext
+    Cursor_methods,             // tp_methods
+    0,                          // tp_members
+    Cursor_getsetters,          // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    0,                          // tp_new
+    0,                          // tp_free
+    0,                          // tp_is_gc
+    0,                          // tp_bases
+    0,                          // tp_mro
+    0,                          // tp_cache
+    0,                          // tp_subclasses
+    0,                          // tp_weaklist
+};
@@ -0,0 +1,13 @@
+
+#ifndef CURSOR_H
+#define CURSOR_H
+
+struct Connection;
+
+extern PyTypeObject CursorType;
+
+PyObject* Cursor_New(Connection* cnxn, PyObject* args, int itersize, bool prefetch);
+// Declares a server-side cursor for the query in args[0] using args[1:] as parameters and
+// returns a Cursor that fetches its rows `itersize` at a time.
+
+#endif // CURSOR_H
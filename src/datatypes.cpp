@@ -2,11 +2,25 @@
 #include "pglib.h"
 #include "datatypes.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define HAVE_SSE2 1
+#endif
+
 PyObject* decimal_type;
 PyObject* uuid_type;
 
 static PyObject* NaN;
 
+// The uuid.UUID slot descriptors and the default is_safe value, used to build UUIDs without
+// calling UUID.__init__.  These are zero if the uuid module doesn't use slots, in which case
+// the constructor is called.
+
+static PyObject* uuid_int;
+static PyObject* uuid_is_safe;
+static PyObject* uuid_safe_unknown;
+static PyObject* empty_tuple;
+
 bool DataTypes_Init()
 {
     PyObject* mod = PyImport_ImportModule("decimal");
@@ -42,6 +56,7 @@ bool DataTypes_Init()
     }
 
     uuid_type = PyObject_GetAttrString(mod, "UUID");
+    Object safe(PyObject_GetAttrString(mod, "SafeUUID"));
     Py_DECREF(mod);
 
     if (uuid_type == 0)
@@ -50,16 +65,41 @@ bool DataTypes_Init()
         return false;
     }
 
+    // UUID.__init__ validates its arguments and is by far the most expensive part of reading a
+    // UUID.  A UUID is immutable and only holds an int and an is_safe flag in slots, so we
+    // create the object with __new__ and set the slots directly.
+
+    uuid_int          = PyObject_GetAttrString(uuid_type, "int");
+    uuid_is_safe      = PyObject_GetAttrString(uuid_type, "is_safe");
+    uuid_safe_unknown = safe ? PyObject_GetAttrString(safe, "unknown") : 0;
+    empty_tuple       = PyTuple_New(0);
+    PyErr_Clear();
+
+    if (!uuid_int || Py_TYPE(uuid_int) != &PyMemberDescr_Type ||
+        !uuid_is_safe || Py_TYPE(uuid_is_safe) != &PyMemberDescr_Type ||
+        !uuid_safe_unknown || !empty_tuple)
+    {
+        Py_CLEAR(uuid_int);
+        Py_CLEAR(uuid_is_safe);
+    }
+
     return true;
 }
 
-PyObject* Decimal_FromASCII(const char* sz)
+PyObject* Decimal_FromASCII(const char* sz, Py_ssize_t len)
 {
-    Object str(PyUnicode_DecodeASCII(sz, strlen(sz), 0));
+    // The text is known to be ASCII, so the str is filled in directly instead of decoding it.
+
+    Object str(PyUnicode_New(len, 127));
     if (!str)
         return 0;
+    memcpy(PyUnicode_1BYTE_DATA(str.Get()), sz, (size_t)len);
 
-    return PyObject_CallFunction(decimal_type, (char*)"O", str.Get());
+#if PY_VERSION_HEX >= 0x03090000
+    return PyObject_CallOneArg(decimal_type, str);
+#else
+    return PyObject_CallFunctionObjArgs(decimal_type, str.Get(), 0);
+#endif
 }
 
 PyObject* Decimal_NaN()
@@ -70,5 +110,97 @@ PyObject* Decimal_NaN()
 
 PyObject* UUID_FromBytes(const char* pch)
 {
-    return PyObject_CallFunction(uuid_type, (char*)"sy#", NULL, pch, 16);
+    if (uuid_int == 0)
+        return PyObject_CallFunction(uuid_type, (char*)"sy#", NULL, pch, 16);
+
+#if PY_VERSION_HEX >= 0x030D0000
+    Object value(PyLong_FromUnsignedNativeBytes(pch, 16, Py_ASNATIVEBYTES_BIG_ENDIAN));
+#else
+    Object value(_PyLong_FromByteArray((const unsigned char*)pch, 16, 0, 0));
+#endif
+    if (!value)
+        return 0;
+
+    PyTypeObject* type = (PyTypeObject*)uuid_type;
+    Object uuid(type->tp_new(type, empty_tuple, 0));
+    if (!uuid)
+        return 0;
+
+    if (Py_TYPE(uuid_int)->tp_descr_set(uuid_int, uuid, value) != 0 ||
+        Py_TYPE(uuid_is_safe)->tp_descr_set(uuid_is_safe, uuid, uuid_safe_unknown) != 0)
+    {
+        return 0;
+    }
+
+    return uuid.Detach();
+}
+
+PyObject* UUID_ToText(const char* pch)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    PyObject* str = PyUnicode_New(36, 127);
+    if (str == 0)
+        return 0;
+
+    Py_UCS1* p = PyUnicode_1BYTE_DATA(str);
+    for (int i = 0; i < 16; i++)
+    {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+            *p++ = '-';
+        *p++ = hex[(uint8_t)pch[i] >> 4];
+        *p++ = hex[pch[i] & 0xF];
+    }
+
+    return str;
+}
+
+static bool IsASCII(const char* p, Py_ssize_t len)
+{
+    // SSE2 is part of every x86-64 CPU, so it needs no runtime check.  Elsewhere the bytes are
+    // checked 8 at a time.
+
+    const char* end = p + len;
+
+#ifdef HAVE_SSE2
+    while (end - p >= 32)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0)
+            return false;
+        p += 32;
+    }
+    if (end - p >= 16)
+    {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p)) != 0)
+            return false;
+        p += 16;
+    }
+#endif
+
+    while (end - p >= 8)
+    {
+        uint64_t n;
+        memcpy(&n, p, 8);
+        if (n & 0x8080808080808080ULL)
+            return false;
+        p += 8;
+    }
+
+    uint8_t high = 0;
+    while (p < end)
+        high |= (uint8_t)*p++;
+    return (high & 0x80) == 0;
+}
+
+PyObject* Text_FromUTF8(const char* p, Py_ssize_t len)
+{
+    if (!IsASCII(p, len))
+        return PyUnicode_DecodeUTF8(p, len, 0);
+
+    PyObject* str = PyUnicode_New(len, 127);
+    if (str)
+        memcpy(PyUnicode_1BYTE_DATA(str), p, (size_t)len);
+    return str;
 }
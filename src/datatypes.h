@@ -13,14 +13,24 @@ inline bool UUID_Check(PyObject* p)
 }
 
 PyObject* UUID_FromBytes(const char* pch);
+// Returns a uuid.UUID from the 16 bytes of a binary uuid.
+
+PyObject* UUID_ToText(const char* pch);
+// Returns the canonical lowercase str, such as "4bfe4344-e7f2-41c3-ab88-1aecd79abd12", of the
+// 16 bytes of a binary uuid.
 
 inline bool Decimal_Check(PyObject* p)
 {
     return Py_TYPE(p) == (_typeobject*)decimal_type;
 }
 
-PyObject* Decimal_FromASCII(const char* sz);
+PyObject* Decimal_FromASCII(const char* sz, Py_ssize_t len);
+// Returns a Decimal from `len` ASCII characters, such as "-12.50".
 
 PyObject* Decimal_NaN();
 
+PyObject* Text_FromUTF8(const char* p, Py_ssize_t len);
+// Returns a str from `len` bytes of UTF-8.  ASCII text, which most text is, is copied into a
+// compact ASCII str without going through the UTF-8 decoder.
+
 #endif // DATATYPES_H
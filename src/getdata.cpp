@@ -11,6 +11,7 @@
 #include "datatypes.h"
 #include "juliandate.h"
 #include "pgarrays.h"
+#include "pgjson.h"
 #include "pgtypes.h"
 
 #include "debug.h"
@@ -53,177 +54,304 @@ struct TempBuffer
 };
 
 
-static PyObject* GetCash(const char* p, int format)
+static char* PutDigits(char* p, int value, int width)
 {
-    if (format == FORMAT_TEXT)
+    // Writes a non-negative value zero padded to `width` digits and returns the end.
+
+    for (int i = width - 1; i >= 0; i--)
     {
-        PyErr_SetString(Error, "Invalid result: 'money' data was returned as text instead of binary.");
-        return 0;
+        p[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    return p + width;
+}
+
+static char* PutUnsigned(char* p, uint64_t value)
+{
+    char sz[20];
+    int cch = 0;
+    do
+    {
+        sz[cch++] = (char)('0' + value % 10);
+        value /= 10;
     }
+    while (value);
 
+    while (cch)
+        *p++ = sz[--cch];
+    return p;
+}
+
+static PyObject* GetCash(const char* p, int len)
+{
     // Apparently a 64-bit integer * 100.
 
-    int64_t n = swaps8(*(int64_t*)p);
+    int64_t n = FromNetwork(*(int64_t*)p);
 
-    // Use 03 to ensure we have "x.yz".  We use a buffer big enough that we know we can insert a '.'.
     char sz[30];
-    sprintf(sz, "%03lld", n);
+    char* pch = sz;
+
+    uint64_t u = (uint64_t)n;
+    if (n < 0)
+    {
+        *pch++ = '-';
+        u = 0 - u;
+    }
 
-    size_t cch = strlen(sz);
-    sz[cch+1] = sz[cch];
-    sz[cch]   = sz[cch-1];
-    sz[cch-1] = sz[cch-2];
-    sz[cch-2] = '.';
+    pch = PutUnsigned(pch, u / 100);
+    *pch++ = '.';
+    pch = PutDigits(pch, (int)(u % 100), 2);
 
-    return Decimal_FromASCII(sz);
+    return Decimal_FromASCII(sz, pch - sz);
 }
 
+enum
+{
+    NUMERIC_POS  = 0x0000,
+    NUMERIC_NEG  = 0x4000,
+    NUMERIC_NAN  = 0xC000,
+    NUMERIC_PINF = 0xD000,
+    NUMERIC_NINF = 0xF000
+};
 
-static PyObject* GetNumeric(const char* p, int len, int format)
+struct Numeric
 {
-    if (format == FORMAT_TEXT)
+    // A binary numeric value:
+    //
+    //   int16 ndigits, int16 weight, uint16 sign, uint16 dscale, int16 digits[ndigits]
+    //
+    // The digits are base 10000 and weight is the power of 10000 of the first one.  dscale is
+    // the number of decimal digits after the point.
+
+    int ndigits;
+    int weight;
+    int sign;
+    int dscale;
+    const int16_t* digits;
+
+    Numeric(const char* p)
     {
-        PyErr_SetString(Error, "Invalid result: 'numeric' data was returned as text instead of binary.");
-        return 0;
+        const int16_t* pi = (const int16_t*)p;
+        ndigits = swaps2(pi[0]);
+        weight  = swaps2(pi[1]);
+        sign    = (uint16_t)swaps2(pi[2]);
+        dscale  = swaps2(pi[3]);
+        digits  = &pi[4];
+    }
+
+    int Digit(int i) const
+    {
+        // Returns digit `i`, which is worth 10000^(weight - i).  Digits that aren't stored are
+        // zero.
+        return (i >= 0 && i < ndigits) ? swaps2(digits[i]) : 0;
+    }
+
+    bool IsFinite() const
+    {
+        return sign == NUMERIC_POS || sign == NUMERIC_NEG;
     }
 
-    int16_t* pi = (int16_t*)p;
+    int MaxLength() const
+    {
+        // The most characters ToASCII can write: the digits, sign, point, and terminator.
+        return 4 * (MAX(weight, 0) + 1) + dscale + 3;
+    }
 
-    int16_t ndigits = swaps2(pi[0]);
-    int16_t weight  = swaps2(pi[1]);
-    int16_t sign    = swaps2(pi[2]);
-    int16_t dscale  = swaps2(pi[3]);
+    Py_ssize_t ToASCII(char* sz) const
+    {
+        // Writes a finite value as a decimal string and returns its length.
 
-    if (sign == -16384)
-        return Decimal_NaN();
+        char* p = sz;
+
+        if (sign == NUMERIC_NEG)
+            *p++ = '-';
 
-    // Calculate the string length.  Each 16-bit "digit" represents 4 digits.
+        if (weight < 0)
+        {
+            *p++ = '0';
+        }
+        else
+        {
+            for (int i = 0; i <= weight; i++)
+                p = (i == 0) ? PutUnsigned(p, (uint64_t)Digit(0)) : PutDigits(p, Digit(i), 4);
+        }
+
+        if (dscale > 0)
+        {
+            *p++ = '.';
+
+            // The fraction starts with digit weight + 1, which is negative if the value has
+            // leading zeros after the point.
+
+            char* end = p + dscale;
+            for (int i = weight + 1; p < end; i++)
+            {
+                char digit[4];
+                PutDigits(digit, Digit(i), 4);
+                for (int j = 0; j < 4 && p < end; j++)
+                    *p++ = digit[j];
+            }
+        }
+
+        *p = 0;
+        return p - sz;
+    }
+};
+
+static PyObject* GetNumeric(const char* p, int len)
+{
+    Numeric n(p);
 
-    int slen = (ndigits * 4) + dscale + 2; // 2 == '.' and '-'
+    if (n.sign == NUMERIC_NAN)
+        return Decimal_NaN();
+    if (n.sign == NUMERIC_PINF)
+        return Decimal_FromASCII("Infinity", 8);
+    if (n.sign == NUMERIC_NINF)
+        return Decimal_FromASCII("-Infinity", 9);
 
     char szBuffer[1024];
-    TempBuffer buffer(szBuffer, _countof(szBuffer), slen);
+    TempBuffer buffer(szBuffer, _countof(szBuffer), n.MaxLength());
     if (buffer.p == 0)
         return 0;
 
-    char* pch = buffer.p;
+    return Decimal_FromASCII(buffer.p, n.ToASCII(buffer.p));
+}
 
-    if (sign != 0)
-        *pch++ = '-';
+static PyObject* GetNumericInt(const char* p, int len)
+{
+    // Used when numeric_as is int.  Values with digits after the decimal point are still
+    // returned as Decimals.
 
-    // Digits before decimal point.
+    Numeric n(p);
 
-    int iDigit = 0;
+    if (!n.IsFinite() || n.dscale != 0)
+        return GetNumeric(p, len);
 
-    if (weight >= 0)
+    if (n.weight < 4)
     {
-        bool nonzero = false;
+        // Less than 10000^4, so it fits in 64 bits.
 
-        for (iDigit = 0; iDigit <= weight; iDigit++)
-        {
-            int digit = (iDigit < ndigits) ? swaps2(pi[4 + iDigit]) : 0;
+        int64_t value = 0;
+        for (int i = 0; i <= n.weight; i++)
+            value = value * 10000 + n.Digit(i);
 
-            int d = digit / 1000;
-            digit -= d * 1000;
-            if (nonzero || d > 0)
-            {
-                nonzero = true;
-                *pch++ = (d + '0');
-            }
+        return PyLong_FromLongLong(n.sign == NUMERIC_NEG ? -value : value);
+    }
 
-            d = digit / 100;
-            digit -= d * 100;
-            if (nonzero || d > 0)
-            {
-                nonzero = true;
-                *pch++ = (d + '0');
-            }
+    char szBuffer[1024];
+    TempBuffer buffer(szBuffer, _countof(szBuffer), n.MaxLength());
+    if (buffer.p == 0)
+        return 0;
 
-            d = digit / 10;
-            digit -= d * 10;
-            if (nonzero || d > 0)
-            {
-                nonzero = true;
-                *pch++ = (d + '0');
-            }
+    n.ToASCII(buffer.p);
+    return PyLong_FromString(buffer.p, 0, 10);
+}
 
-            d = digit;
-            if (nonzero || d > 0)
-            {
-                nonzero = true;
-                *pch++ = (d + '0');
-            }
-        }
-    }
+static PyObject* GetNumericFloat(const char* p, int len)
+{
+    // Used when numeric_as is float.
+
+    Numeric n(p);
 
-    // Digits after the decimal.
+    if (n.sign == NUMERIC_NAN)
+        return PyFloat_FromDouble(Py_NAN);
+    if (n.sign == NUMERIC_PINF)
+        return PyFloat_FromDouble(Py_HUGE_VAL);
+    if (n.sign == NUMERIC_NINF)
+        return PyFloat_FromDouble(-Py_HUGE_VAL);
 
-    if (dscale > 0)
+    if (n.ndigits <= 3)
     {
-        *pch++ = '.';
+        // The digits are less than 10^12 and powers of ten up to 10^22 are exact doubles, so
+        // a single multiplication or division gives the correctly rounded result.
 
-        int scale = 0;
-        while (scale < dscale)
+        static const double powers[] =
         {
-            int digit = (iDigit < ndigits) ? swaps2(pi[4 + iDigit]) : 0;
-            iDigit++;
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
 
-            int d = digit / 1000;
-            digit -= d * 1000;
-            *pch++ = (d + '0');
-            scale += 1;
+        int exponent = 4 * (n.weight - n.ndigits + 1);
 
-            if (scale < dscale)
-            {
-                d = digit / 100;
-                digit -= d * 100;
-                *pch++ = (d + '0');
-                scale += 1;
-            }
+        if (exponent >= -22 && exponent <= 22)
+        {
+            int64_t digits = 0;
+            for (int i = 0; i < n.ndigits; i++)
+                digits = digits * 10000 + n.Digit(i);
 
-            if (scale < dscale)
-            {
-                d = digit / 10;
-                digit -= d * 10;
-                *pch++ = (d + '0');
-                scale += 1;
-            }
+            double value = (double)digits;
+            if (exponent >= 0)
+                value *= powers[exponent];
+            else
+                value /= powers[-exponent];
 
-            if (scale < dscale)
-            {
-                d = digit;
-                *pch++ = (d + '0');
-                scale += 1;
-            }
+            return PyFloat_FromDouble(n.sign == NUMERIC_NEG ? -value : value);
         }
     }
 
-    *pch = 0;
+    char szBuffer[1024];
+    TempBuffer buffer(szBuffer, _countof(szBuffer), n.MaxLength());
+    if (buffer.p == 0)
+        return 0;
 
-    return Decimal_FromASCII(buffer.p);
+    n.ToASCII(buffer.p);
+    double value = PyOS_string_to_double(buffer.p, 0, 0);
+    if (value == -1.0 && PyErr_Occurred())
+        return 0;
+    return PyFloat_FromDouble(value);
 }
 
-static PyObject* GetDate(const char* p, int format)
+static PyObject* GetTextDate(const char* p, int len)
 {
-    int year, month, date;
+    // YYYY-MM-DD.
+    int year  = strtol(&p[0], 0, 10);
+    int month = strtol(&p[5], 0, 10);
+    int date  = strtol(&p[8], 0, 10);
+    return PyDate_FromDate(year, month, date);
+}
 
-    if (format == FORMAT_TEXT)
-    {
-        // YYYY-MM-DD.
-        year  = strtol(&p[0], 0, 10);
-        month = strtol(&p[5], 0, 10);
-        date  = strtol(&p[8], 0, 10);
-    }
-    else
+// Dates in a result tend to cluster on a few days, so recently created date objects are kept in
+// a small direct-mapped cache indexed by the low bits of the day number and shared.  Dates are
+// immutable, and decoders are only called with the GIL held.
+
+static const int DATE_CACHE_SIZE = 256;
+
+struct DateCacheEntry
+{
+    int32_t days;
+    PyObject* date;
+};
+
+static DateCacheEntry dateCache[DATE_CACHE_SIZE];
+
+static PyObject* GetDate(const char* p, int len)
+{
+    // Days since 2000-01-01.
+
+    int32_t days = FromNetwork(*(int32_t*)p);
+
+    DateCacheEntry& entry = dateCache[days & (DATE_CACHE_SIZE - 1)];
+    if (entry.date && entry.days == days)
     {
-        uint32_t value = swapu4(*(uint32_t*)p) + JULIAN_START;
-        julianToDate(value, year, month, date);
+        Py_INCREF(entry.date);
+        return entry.date;
     }
 
-    return PyDate_FromDate(year, month, date);
+    int year, month, day;
+    julianToDate(days + JULIAN_START, year, month, day);
+    PyObject* date = PyDate_FromDate(year, month, day);
+    if (date == 0)
+        return 0;
+
+    Py_XDECREF(entry.date);
+    entry.days = days;
+    entry.date = date;
+    Py_INCREF(date);
+
+    return date;
 }
 
-static PyObject* GetTime(const char* p)
+static PyObject* GetTime(const char* p, int len)
 {
     uint64_t value = swapu8(*(uint64_t*)p);
 
@@ -238,12 +366,68 @@ static PyObject* GetTime(const char* p)
     return PyTime_FromTime(hour, minute, second, microsecond);
 }
 
-inline PyObject* GetBytes(const char* p, int len)
+// A timetz carries its own UTC offset, and most columns only ever use one or two, so the
+// timezone objects are cached by offset rather than created for each value.
+
+const int ZONE_CACHE_SIZE = 64;
+
+struct ZoneCacheEntry
+{
+    int32_t zone;
+    PyObject* tzinfo;
+};
+
+static ZoneCacheEntry zoneCache[ZONE_CACHE_SIZE];
+
+static PyObject* GetTimeZone(int32_t zone)
+{
+    // Returns a borrowed reference to a timezone for `zone`, which is seconds *west* of UTC
+    // like the server's, so the offset is its negation.
+
+    if (zone == 0)
+        return PyDateTime_TimeZone_UTC;
+
+    ZoneCacheEntry& entry = zoneCache[(uint32_t)zone % ZONE_CACHE_SIZE];
+    if (entry.tzinfo != 0 && entry.zone == zone)
+        return entry.tzinfo;
+
+    Object offset(PyDelta_FromDSU(0, -zone, 0));
+    if (!offset)
+        return 0;
+    PyObject* tzinfo = PyTimeZone_FromOffset(offset);
+    if (tzinfo == 0)
+        return 0;
+
+    Py_XDECREF(entry.tzinfo);
+    entry.zone   = zone;
+    entry.tzinfo = tzinfo;
+
+    return tzinfo;
+}
+
+static PyObject* GetTimeTZ(const char* p, int len)
+{
+    // A timetz is the time in microseconds followed by the zone in seconds.
+
+    int64_t value = FromNetwork(*(int64_t*)p);
+    int32_t zone  = FromNetwork(*(int32_t*)(p + 8));
+
+    PyObject* tzinfo = GetTimeZone(zone);
+    if (tzinfo == 0)
+        return 0;
+
+    int microsecond = (int)(value % 1000000);
+    int seconds     = (int)(value / 1000000);
+
+    return PyDateTimeAPI->Time_FromTime(seconds / 3600, seconds / 60 % 60, seconds % 60, microsecond, tzinfo, PyDateTimeAPI->TimeType);
+}
+
+static PyObject* GetBytes(const char* p, int len)
 {
     return PyBytes_FromStringAndSize(p, len);
 }
 
-static PyObject* GetInterval(const char* p) // , bool integer_datetimes)
+static PyObject* GetInterval(const char* p, int len)
 {
     Interval* pinterval = (Interval*)p;
 
@@ -268,114 +452,327 @@ static PyObject* GetInterval(const char* p) // , bool integer_datetimes)
     return PyDelta_FromDSU(days, seconds, 0);
 }
 
-static PyObject* GetTimestamp(const char* p, bool integer_datetimes)
+static PyObject* MakeTimestamp(int64_t n, PyObject* tzinfo)
 {
-    int year, month, day, hour, minute, second, microsecond;
+    // Microseconds since 2000-01-01, which are negative before then.
 
-    if (integer_datetimes)
+    const int64_t USECS_PER_DAY = 86400LL * 1000000;
+
+    int64_t days = n / USECS_PER_DAY;
+    int64_t time = n % USECS_PER_DAY;
+    if (time < 0)
     {
-        // Number of milliseconds since the Postgres epoch.
+        time += USECS_PER_DAY;
+        days -= 1;
+    }
+
+    int microsecond = (int)(time % 1000000);
+    int seconds     = (int)(time / 1000000);
+
+    int year, month, day;
+    julianToDate((int)days + JULIAN_START, year, month, day);
+
+    return PyDateTimeAPI->DateTime_FromDateAndTime(year, month, day, seconds / 3600, seconds / 60 % 60, seconds % 60, microsecond,
+                                                   tzinfo, PyDateTimeAPI->DateTimeType);
+}
+
+static PyObject* GetTimestamp(const char* p, int len)
+{
+    return MakeTimestamp(FromNetwork(*(int64_t*)p), Py_None);
+}
+
+static PyObject* GetTimestampTZ(const char* p, int len)
+{
+    // The server always sends timestamptz values in UTC.  Converting them to the session's
+    // time zone would need its rules, so we return them in UTC and leave that to the caller.
+    return MakeTimestamp(FromNetwork(*(int64_t*)p), PyDateTime_TimeZone_UTC);
+}
+
+static PyObject* GetFloatTimestamp(const char* p, int len)
+{
+    // Servers built without integer datetimes send an 8-byte floating point.
+    PyErr_SetString(Error, "Floating unhandled!\n");
+    return 0;
+}
+
+static PyObject* GetTextNumeric(const char* p, int len)
+{
+    PyErr_SetString(Error, "Invalid result: 'numeric' data was returned as text instead of binary.");
+    return 0;
+}
+
+static PyObject* GetTextCash(const char* p, int len)
+{
+    PyErr_SetString(Error, "Invalid result: 'money' data was returned as text instead of binary.");
+    return 0;
+}
+
+static PyObject* GetText(const char* p, int len)
+{
+    return Text_FromUTF8(p, len);
+}
+
+static PyObject* GetStrippedText(const char* p, int len)
+{
+    // char(n) values are padded with spaces, which the server includes in both formats.
+
+    while (len > 0 && p[len - 1] == ' ')
+        len--;
+    return Text_FromUTF8(p, len);
+}
+
+// The integer and float types only differ by size, so their binary decoders are generated from
+// templates using the FromNetwork overloads.
+
+template<typename T>
+static PyObject* GetInteger(const char* p, int len)
+{
+    T n = FromNetwork(*(T*)p);
+    if (sizeof(T) <= sizeof(long))
+        return PyLong_FromLong((long)n);
+    return PyLong_FromLongLong((long long)n);
+}
+
+template<typename T>
+static PyObject* GetFloat(const char* p, int len)
+{
+    return PyFloat_FromDouble(FromNetwork(*(T*)p));
+}
+
+static PyObject* GetTextInteger(const char* p, int len)
+{
+    return PyLong_FromString(p, 0, 10);
+}
+
+static PyObject* GetTextFloat(const char* p, int len)
+{
+    return PyFloat_FromDouble(strtod(p, 0));
+}
+
+static PyObject* GetBool(const char* p, int len)
+{
+    return PyBool_FromLong(*p);
+}
+
+static PyObject* GetTextBool(const char* p, int len)
+{
+    return PyBool_FromLong(*p == 't');
+}
+
+static PyObject* GetUUID(const char* p, int len)
+{
+    return UUID_FromBytes(p);
+}
+
+static PyObject* GetUUIDBytes(const char* p, int len)
+{
+    return PyBytes_FromStringAndSize(p, 16);
+}
+
+static PyObject* GetUUIDText(const char* p, int len)
+{
+    return UUID_ToText(p);
+}
 
-        uint64_t n = swapu8(*(uint64_t*)p);
+static bool ParseTextUUID(const char* p, int len, char* pch)
+{
+    // Reads the 16 bytes from the text format, which is 32 hex digits and hyphens.
 
-        microsecond = n % 1000000;
-        n /= 1000000;
-        second = n % 60;
-        n /= 60;
-        minute = n % 60;
-        n /= 60;
-        hour = n % 24;
-        n /= 24;
-        int days = n;
+    int cDigits = 0;
+    for (int i = 0; i < len; i++)
+    {
+        char ch = p[i];
+        int digit;
+        if (ch >= '0' && ch <= '9')
+            digit = ch - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            digit = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F')
+            digit = ch - 'A' + 10;
+        else if (ch == '-')
+            continue;
+        else
+            break;
 
-        julianToDate(days + JULIAN_START, year, month, day);
+        if (cDigits == 32)
+            break;
+        if (cDigits % 2 == 0)
+            pch[cDigits / 2] = (char)(digit << 4);
+        else
+            pch[cDigits / 2] |= (char)digit;
+        cDigits++;
     }
-    else
+
+    if (cDigits != 32)
     {
-        // 8-byte floating point
-        PyErr_SetString(Error, "Floating unhandled!\n");
-        return 0;
+        PyErr_SetString(Error, "Invalid uuid text");
+        return false;
     }
+    return true;
+}
+
+static PyObject* GetTextUUID(const char* p, int len)
+{
+    char pch[16];
+    if (!ParseTextUUID(p, len, pch))
+        return 0;
+    return UUID_FromBytes(pch);
+}
+
+static PyObject* GetTextUUIDBytes(const char* p, int len)
+{
+    char pch[16];
+    if (!ParseTextUUID(p, len, pch))
+        return 0;
+    return PyBytes_FromStringAndSize(pch, 16);
+}
+
+static PyObject* GetInt4ArrayValue(const char* p, int len)
+{
+    return GetInt4Array(p);
+}
+
+static PyObject* GetInt8ArrayValue(const char* p, int len)
+{
+    return GetInt8Array(p);
+}
 
-    return PyDateTime_FromDateAndTime(year, month, day, hour, minute, second, microsecond);
+static PyObject* GetJSON(const char* p, int len)
+{
+    return JSON_Parse(p, len);
 }
 
-PyObject* ConvertValue(PGresult* result, int iRow, int iCol, bool integer_datetimes, int format)
+static bool CheckJSONBVersion(const char* p, int len)
 {
-    // Used to read a column from the database and return a Python object.
+    // Binary jsonb is the text after a version byte, which has only ever been 1.
+
+    if (len < 1 || *p != 1)
+    {
+        PyErr_Format(Error, "Unsupported jsonb version %d", len < 1 ? -1 : (int)*p);
+        return false;
+    }
+    return true;
+}
 
-    if (PQgetisnull(result, iRow, iCol))
-        Py_RETURN_NONE;
+static PyObject* GetJSONB(const char* p, int len)
+{
+    if (!CheckJSONBVersion(p, len))
+        return 0;
+    return JSON_Parse(p + 1, len - 1);
+}
 
-    Oid oid = PQftype(result, iCol);
+static PyObject* GetJSONBText(const char* p, int len)
+{
+    if (!CheckJSONBVersion(p, len))
+        return 0;
+    return GetText(p + 1, len - 1);
+}
 
-    const char* p = PQgetvalue(result, iRow, iCol);
+static PyObject* GetTextArrayValue(const char* p, int len)
+{
+    return GetTextArray(p);
+}
 
-    // printf("OID: %d -> %s\n", oid, (format == 0) ? p : "(binary)");
+Decoder GetDecoder(Oid oid, int format, const DecodeOptions& options)
+{
+    bool text = (format == FORMAT_TEXT);
 
     switch (oid)
     {
     case TEXTOID:
-    case BPCHAROID:
     case VARCHAROID:
-        return PyUnicode_DecodeUTF8((const char*)p, strlen((const char*)p), 0);
+        return GetText;
+
+    case BPCHAROID:
+        return options.strip_char ? GetStrippedText : GetText;
 
     case BYTEAOID:
-        return GetBytes(p, PQgetlength(result, iRow, iCol));
+        return GetBytes;
 
     case INT2OID:
-        return (format == FORMAT_TEXT) ? PyLong_FromString(p, 0, 10) : PyLong_FromLong(swaps2(*(int16_t*)p));
+        return text ? GetTextInteger : GetInteger<int16_t>;
 
     case INT4OID:
-        return (format == FORMAT_TEXT) ? PyLong_FromString(p, 0, 10) : PyLong_FromLong(swaps4(*(int32_t*)p));
+        return text ? GetTextInteger : GetInteger<int32_t>;
 
     case INT8OID:
-        return (format == FORMAT_TEXT) ? PyLong_FromString(p, 0, 10) : PyLong_FromLongLong(swaps8(*(int64_t*)p));
+        return text ? GetTextInteger : GetInteger<int64_t>;
 
     case NUMERICOID:
-        return GetNumeric(p, PQgetlength(result, iRow, iCol), format);
+        if (text)
+            return GetTextNumeric;
+        if (options.numeric_as == NUMERIC_AS_INT)
+            return GetNumericInt;
+        if (options.numeric_as == NUMERIC_AS_FLOAT)
+            return GetNumericFloat;
+        return GetNumeric;
 
     case CASHOID:
-        return GetCash(p, format);
+        return text ? GetTextCash : GetCash;
 
     case DATEOID:
-        return GetDate(p, format);
+        return text ? GetTextDate : GetDate;
 
     case TIMEOID:
-        return GetTime(p);
+        return GetTime;
+
+    case TIMETZOID:
+        return GetTimeTZ;
 
     case FLOAT4OID:
-        return PyFloat_FromDouble((format == FORMAT_TEXT) ? strtod(p, 0) : swapfloat(*(float*)p));
+        return text ? GetTextFloat : GetFloat<float>;
 
     case FLOAT8OID:
-        return PyFloat_FromDouble((format == FORMAT_TEXT) ? strtod(p, 0) : swapdouble(*(double*)p));
+        return text ? GetTextFloat : GetFloat<double>;
 
     case TIMESTAMPOID:
-        return GetTimestamp(p, integer_datetimes);
+        return options.integer_datetimes ? GetTimestamp : GetFloatTimestamp;
+
+    case TIMESTAMPTZOID:
+        return options.integer_datetimes ? GetTimestampTZ : GetFloatTimestamp;
 
     case BOOLOID:
         // If format is text, we'll get 't' and 'f'.
-        return PyBool_FromLong((format == FORMAT_TEXT) ? (*p == 't') : *p);
+        return text ? GetTextBool : GetBool;
 
     case UUIDOID:
-        return UUID_FromBytes(p);
+        // The server's text format is the canonical form.
+        if (options.uuid_as == UUID_AS_STR)
+            return text ? GetText : GetUUIDText;
+        if (options.uuid_as == UUID_AS_BYTES)
+            return text ? GetTextUUIDBytes : GetUUIDBytes;
+        return text ? GetTextUUID : GetUUID;
 
     case INT4ARRAYOID:
-        return GetInt4Array(p);
+        return GetInt4ArrayValue;
 
     case INT8ARRAYOID:
-        return GetInt8Array(p);
+        return GetInt8ArrayValue;
 
     case TEXTARRAYOID:
-        return GetTextArray(p);
+        return GetTextArrayValue;
 
     case INTERVALOID:
-        return GetInterval(p);
-    }
+        return GetInterval;
+
+    case JSONOID:
+        return (options.json_as == JSON_AS_STR) ? GetText : GetJSON;
 
-    // printf("OID: %d\n", oid);
+    case JSONBOID:
+        if (text)
+            return (options.json_as == JSON_AS_STR) ? GetText : GetJSON;
+        return (options.json_as == JSON_AS_STR) ? GetJSONBText : GetJSONB;
+    }
 
     // I'm now going to return all unknown types as bytes.  This allows users to
     // potentially workaround missing types until I can add them.
-    return GetBytes(p, PQgetlength(result, iRow, iCol));
+    return GetBytes;
+}
+
+PyObject* ConvertValue(PGresult* result, int iRow, int iCol, const DecodeOptions& options, int format)
+{
+    // Used to read a single value when there is no ResultSet to build a plan for.
+
+    Decoder decoder = GetDecoder(PQftype(result, iCol), format, options);
+    return DecodeValue(result, iRow, iCol, decoder);
 }
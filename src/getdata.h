@@ -3,6 +3,87 @@
 #define GETDATA_H
 
 bool GetData_Init();
-PyObject* ConvertValue(PGresult* result, int iRow, int iCol, bool integer_datetimes, int format);
+
+enum NumericAs
+{
+    // How numeric values are returned.
+
+    NUMERIC_AS_DECIMAL,
+
+    NUMERIC_AS_INT,
+    // As int if the value has no digits after the decimal point, otherwise as Decimal.
+
+    NUMERIC_AS_FLOAT
+};
+
+enum JsonAs
+{
+    // How json and jsonb values are returned.
+
+    JSON_AS_OBJECT,
+    // Parsed into dicts, lists, and other objects like json.loads.
+
+    JSON_AS_STR
+    // The JSON text.
+};
+
+enum UuidAs
+{
+    // How uuid values are returned.
+
+    UUID_AS_UUID,
+    // uuid.UUID objects.
+
+    UUID_AS_BYTES,
+    // The 16 bytes, the same as UUID.bytes.
+
+    UUID_AS_STR
+    // The canonical str, the same as str(UUID).
+};
+
+struct DecodeOptions
+{
+    // The connection settings that choose how values are converted.  Each ColumnPlan records
+    // the options it was built with so it is not reused after they change.
+
+    bool integer_datetimes;
+
+    NumericAs numeric_as;
+
+    JsonAs json_as;
+
+    UuidAs uuid_as;
+
+    bool strip_char;
+    // If true, trailing spaces are removed from char(n) values.
+};
+
+inline bool operator==(const DecodeOptions& a, const DecodeOptions& b)
+{
+    return a.integer_datetimes == b.integer_datetimes && a.numeric_as == b.numeric_as && a.json_as == b.json_as &&
+        a.uuid_as == b.uuid_as && a.strip_char == b.strip_char;
+}
+
+inline bool operator!=(const DecodeOptions& a, const DecodeOptions& b)
+{
+    return !(a == b);
+}
+
+typedef PyObject* (*Decoder)(const char* p, int len);
+// Converts a non-NULL value to a Python object.  `len` is the value's length from
+// PQgetlength.
+
+Decoder GetDecoder(Oid oid, int format, const DecodeOptions& options);
+// Returns the decoder for values of type `oid` sent in `format`.  This is looked up once per
+// column when a ResultSet is created so converting each value is a single indirect call.
+
+inline PyObject* DecodeValue(PGresult* result, int iRow, int iCol, Decoder decoder)
+{
+    if (PQgetisnull(result, iRow, iCol))
+        Py_RETURN_NONE;
+    return decoder(PQgetvalue(result, iRow, iCol), PQgetlength(result, iRow, iCol));
+}
+
+PyObject* ConvertValue(PGresult* result, int iRow, int iCol, const DecodeOptions& options, int format);
 
 #endif // GETDATA_H
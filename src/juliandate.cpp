@@ -1,67 +1,51 @@
-
 #include "pglib.h"
+#include "juliandate.h"
 
-// PostgreSQL stores data as 32-bit Julian dates, offset from 2001-01-01.
+// PostgreSQL stores dates as days from 2000-01-01, which we convert to and from Julian day
+// numbers.  Both use the proleptic Gregorian calendar, like Python's date.
+//
+// These are the days_from_civil and civil_from_days algorithms from Howard Hinnant's
+// "chrono-Compatible Low-Level Date Algorithms", which only use integer arithmetic.  They count
+// days from 0000-03-01 so the leap day is the last day of the year, and work in 400 year eras,
+// each exactly 146097 days.
 
 enum
 {
-    JULIAN_START     = 2451545, // 2000-01-01
-    GREGORIAN_OFFSET = 15 + 31*(10+12*1582)
+    MARCH_1_YEAR_0 = 1721120 // The Julian day number of 0000-03-01.
 };
 
 void julianToDate(int julian, int& year, int& month, int& day)
 {
-    // This is the standard conversion from some book that I forgot to record the name of.  However, this
-    // implementation is from one of my Java projects, so we need to double-check the C.
+    int days = julian - MARCH_1_YEAR_0;
 
-    int jalpha, ja, jb, jc, jd, je;
+    int era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned doe = (unsigned)(days - era * 146097);                              // [0, 146096]
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;         // [0, 399]
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);                       // [0, 365]
+    unsigned mp  = (5 * doy + 2) / 153;                                           // [0, 11] from March
 
-    ja = julian;
-    if (ja >= GREGORIAN_OFFSET)
-    {
-        jalpha = (int) (((ja - 1867216) - 0.25) / 36524.25);
-        ja = ja + 1 + jalpha - jalpha / 4;
-    }
+    day   = (int)(doy - (153 * mp + 2) / 5 + 1);
+    month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    year  = (int)yoe + era * 400 + (month <= 2);
 
-    jb = ja + 1524;
-    jc = (int) (6680.0 + ((jb - 2439870) - 122.1) / 365.25);
-    jd = 365 * jc + jc / 4;
-    je = (int) ((jb - jd) / 30.6001);
-    day = jb - jd - (int) (30.6001 * je);
-    month = je - 1;
-    if (month > 12)
-        month = month - 12;
-    year = jc - 4715;
-    if (month > 2)
-        year--;
+    // There is no year 0: 1 BC is -1.
     if (year <= 0)
         year--;
 }
 
 uint32_t dateToJulian(int year, int month, int day)
 {
-    int julianYear = year;
     if (year < 0)
-        julianYear++;
+        year++;
 
-    int julianMonth = month;
-    if (month > 2)
-    {
-        julianMonth++;
-    }
-    else
-    {
-        julianYear--;
-        julianMonth += 13;
-    }
+    // Count January and February with the previous year.
+    if (month <= 2)
+        year--;
 
-    double julian = (long)(365.25 * julianYear) + (long)(30.6001*julianMonth) + day + 1720995.0;
-    if (day + 31 * (month + 12 * year) >= GREGORIAN_OFFSET)
-    {
-        // change over to Gregorian calendar
-        int ja = (int)(0.01 * julianYear);
-        julian += 2 - ja + (0.25 * ja);
-    }
+    int era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yoe = (unsigned)(year - era * 400);                                  // [0, 399]
+    unsigned doy = (unsigned)((153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1);
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;                         // [0, 146096]
 
-    return (int)julian;
+    return (uint32_t)(era * 146097 + (int)doe + MARCH_1_YEAR_0);
 }
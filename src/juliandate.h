@@ -9,6 +9,9 @@ enum
 
 
 void julianToDate(int julian, int& year, int& month, int& day);
+// Converts a Julian day number to a date.  Years before 1 AD are negative, with 1 BC as -1.
+
 uint32_t dateToJulian(int year, int month, int day);
+// Converts a date to a Julian day number.  Years are numbered the same as julianToDate.
 
 #endif // JULIANDATE_H
@@ -0,0 +1,818 @@
+
+// pglib.parallel_copy: a COPY FROM split across several connections.
+//
+// A single COPY is processed by a single backend, so loading into a table is limited to one
+// server core.  Here the calling thread reads the source, decompresses it if needed, and
+// splits it into parts of about chunk_size bytes that end on row boundaries.  The parts are
+// put on a bounded queue and worker threads, each with its own connection, take them off and
+// send them with PQputCopyData.  The workers never touch Python objects and the calling thread
+// only holds the GIL while calling a file-like object's read method.
+//
+// Each worker copies inside its own transaction.  Once every worker's COPY has succeeded they
+// are all committed, otherwise they are all rolled back.
+
+#include "pglib.h"
+#include "parallel.h"
+#include "copy.h"
+#include "compress.h"
+#include "errors.h"
+#include "byteswap.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <string>
+#include <new>
+
+enum CopyFormat
+{
+    COPY_CSV,
+    COPY_TEXT,
+    COPY_BINARY
+};
+
+struct Part
+{
+    char* data;
+    size_t len;
+};
+
+struct Shared
+{
+    // The state shared by the reading thread and the workers.
+
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+    // The following are protected by `mutex`.
+
+    std::deque<Part> parts;
+    size_t max_parts;
+
+    bool done;
+    // Set when all parts have been queued.
+
+    bool failed;
+    // Set when a worker or the reader fails.  Everyone stops as soon as they notice.
+
+    Shared(size_t max_parts_)
+    {
+        max_parts = max_parts_;
+        done      = false;
+        failed    = false;
+    }
+
+    ~Shared()
+    {
+        for (size_t i = 0; i < parts.size(); i++)
+            free(parts[i].data);
+    }
+
+    void Stop(bool failure)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failure)
+            failed = true;
+        else
+            done = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+static bool PutPart(Shared& shared, Part part)
+{
+    // Queues `part`, waiting for room if necessary.  Returns false, after freeing the part, if
+    // a worker has failed.
+
+    std::unique_lock<std::mutex> lock(shared.mutex);
+    shared.not_full.wait(lock, [&] { return shared.failed || shared.parts.size() < shared.max_parts; });
+    if (shared.failed)
+    {
+        lock.unlock();
+        free(part.data);
+        return false;
+    }
+    shared.parts.push_back(part);
+    shared.not_empty.notify_one();
+    return true;
+}
+
+enum
+{
+    TAKE_PART,
+    TAKE_DONE,
+    TAKE_FAILED
+};
+
+static int TakePart(Shared& shared, Part& part)
+{
+    std::unique_lock<std::mutex> lock(shared.mutex);
+    shared.not_empty.wait(lock, [&] { return shared.failed || shared.done || !shared.parts.empty(); });
+    if (shared.failed)
+        return TAKE_FAILED;
+    if (shared.parts.empty())
+        return TAKE_DONE;
+    part = shared.parts.front();
+    shared.parts.pop_front();
+    shared.not_full.notify_one();
+    return TAKE_PART;
+}
+
+// -----------------------------------------------------------------------------------------------
+// Splitting
+
+struct Splitter
+{
+    // A CodecSink that collects data until it has at least chunk_size bytes of complete rows
+    // and then queues them as a part.
+    //
+    // For CSV, a newline only ends a row if it is not inside quotes.  A doubled quote toggles
+    // the state twice so it needs no special handling.  For text, a newline ends a row unless
+    // it is escaped with a backslash.  Binary data is parsed tuple by tuple.  Its header and
+    // trailer are removed here and each worker sends its own.
+
+    Shared* shared;
+    CopyFormat format;
+    size_t chunk_size;
+
+    bool skip_header;
+    // True if the first row is a CSV header that has not been skipped yet.
+
+    char* data;
+    size_t len;
+    size_t cap;
+
+    size_t start;
+    // The start of the rows that have not been queued yet.
+
+    size_t scanned;
+    // The number of bytes already scanned for row boundaries.  For binary data, this is
+    // always the end of the last complete tuple.
+
+    bool in_quote;
+    bool escaped;
+
+    bool binary_started;
+    bool binary_ended;
+    // True once the binary header or trailer has been read.
+
+    const char* szError;
+    // A static description of why the data could not be split.  If this is zero after the
+    // sink stops, a worker failed.
+
+    Splitter(Shared* shared_, CopyFormat format_, size_t chunk_size_, bool skip_header_)
+    {
+        shared         = shared_;
+        format         = format_;
+        chunk_size     = chunk_size_;
+        skip_header    = skip_header_;
+        data           = 0;
+        len            = 0;
+        cap            = 0;
+        start          = 0;
+        scanned        = 0;
+        in_quote       = false;
+        escaped        = false;
+        binary_started = false;
+        binary_ended   = false;
+        szError        = 0;
+    }
+
+    ~Splitter()
+    {
+        free(data);
+    }
+};
+
+static bool Fail(Splitter& splitter, const char* szError)
+{
+    splitter.szError = szError;
+    return false;
+}
+
+static bool Queue(Splitter& splitter, size_t end)
+{
+    // Queues the rows from `start` to `end`.
+
+    Part part;
+    part.len  = end - splitter.start;
+    part.data = (char*)malloc(part.len);
+    if (part.data == 0)
+        return Fail(splitter, "Out of memory");
+    memcpy(part.data, &splitter.data[splitter.start], part.len);
+
+    splitter.start = end;
+
+    return PutPart(*splitter.shared, part);
+}
+
+static bool SplitText(Splitter& splitter)
+{
+    bool csv     = splitter.format == COPY_CSV;
+    bool quoted  = splitter.in_quote;
+    bool escaped = splitter.escaped;
+
+    const char* data = splitter.data;
+    size_t len = splitter.len;
+
+    for (size_t i = splitter.scanned; i < len; i++)
+    {
+        char ch = data[i];
+
+        if (csv)
+        {
+            if (ch == '"')
+            {
+                quoted = !quoted;
+                continue;
+            }
+            if (quoted || ch != '\n')
+                continue;
+        }
+        else
+        {
+            if (escaped)
+            {
+                escaped = false;
+                continue;
+            }
+            if (ch == '\\')
+            {
+                escaped = true;
+                continue;
+            }
+            if (ch != '\n')
+                continue;
+        }
+
+        if (splitter.skip_header)
+        {
+            splitter.skip_header = false;
+            splitter.start = i + 1;
+        }
+        else if (i + 1 - splitter.start >= splitter.chunk_size)
+        {
+            if (!Queue(splitter, i + 1))
+                return false;
+        }
+    }
+
+    splitter.scanned  = len;
+    splitter.in_quote = quoted;
+    splitter.escaped  = escaped;
+    return true;
+}
+
+static bool SplitBinary(Splitter& splitter)
+{
+    const char* data = splitter.data;
+    size_t len = splitter.len;
+
+    if (!splitter.binary_started)
+    {
+        if (len < BINARY_HEADER_SIZE)
+            return true;
+
+        if (memcmp(data, BINARY_HEADER, 11) != 0)
+            return Fail(splitter, "The data does not start with a binary COPY header");
+
+        uint32_t extension = (uint32_t)ReadInt32(&data[15]);
+        if (extension > 0x7FFFFFFF)
+            return Fail(splitter, "The binary COPY header is invalid");
+        if (len - BINARY_HEADER_SIZE < extension)
+            return true;
+
+        splitter.binary_started = true;
+        splitter.start = splitter.scanned = BINARY_HEADER_SIZE + extension;
+    }
+
+    while (!splitter.binary_ended)
+    {
+        size_t pos = splitter.scanned;
+
+        if (len - pos < 2)
+            return true;
+
+        int16_t fields = ReadInt16(&data[pos]);
+        pos += 2;
+
+        if (fields == -1)
+        {
+            splitter.binary_ended = true;
+            break;
+        }
+
+        if (fields < 0)
+            return Fail(splitter, "The binary COPY data has an invalid field count");
+
+        for (int16_t i = 0; i < fields; i++)
+        {
+            if (len - pos < 4)
+                return true;
+
+            int32_t cb = ReadInt32(&data[pos]);
+            pos += 4;
+
+            if (cb == -1)
+                continue;
+
+            if (cb < 0)
+                return Fail(splitter, "The binary COPY data has an invalid field length");
+
+            if (len - pos < (size_t)cb)
+                return true;
+
+            pos += (size_t)cb;
+        }
+
+        splitter.scanned = pos;
+
+        if (pos - splitter.start >= splitter.chunk_size && !Queue(splitter, pos))
+            return false;
+    }
+
+    if (splitter.scanned + 2 != len)
+        return Fail(splitter, "The binary COPY data has data after the trailer");
+
+    return true;
+}
+
+static bool SplitSink(void* context, const char* p, size_t cb)
+{
+    Splitter& splitter = *(Splitter*)context;
+
+    if (splitter.len + cb > splitter.cap)
+    {
+        size_t cap = splitter.cap ? splitter.cap * 2 : splitter.chunk_size + 64 * 1024;
+        if (cap < splitter.len + cb)
+            cap = splitter.len + cb;
+        char* data = (char*)realloc(splitter.data, cap);
+        if (data == 0)
+            return Fail(splitter, "Out of memory");
+        splitter.data = data;
+        splitter.cap  = cap;
+    }
+
+    memcpy(&splitter.data[splitter.len], p, cb);
+    splitter.len += cb;
+
+    bool ok = (splitter.format == COPY_BINARY) ? SplitBinary(splitter) : SplitText(splitter);
+    if (!ok)
+        return false;
+
+    // Move the unqueued rows to the front.  This only happens after queuing a part, so we
+    // only move the remainder of one row.
+
+    if (splitter.start != 0)
+    {
+        splitter.len -= splitter.start;
+        memmove(splitter.data, &splitter.data[splitter.start], splitter.len);
+        splitter.scanned -= splitter.start;
+        splitter.start = 0;
+    }
+
+    return true;
+}
+
+static bool SplitFinish(Splitter& splitter)
+{
+    // Queues the last part.  A CSV or text file does not need a final newline.
+
+    size_t end = splitter.len;
+
+    if (splitter.format == COPY_BINARY)
+    {
+        if (!splitter.binary_started)
+        {
+            if (splitter.len == 0)
+                return true;
+            return Fail(splitter, "The binary COPY header is truncated");
+        }
+
+        if (!splitter.binary_ended && splitter.scanned != splitter.len)
+            return Fail(splitter, "The binary COPY data is truncated");
+
+        end = splitter.scanned;
+    }
+    else if (splitter.skip_header)
+    {
+        return true;
+    }
+
+    if (end == splitter.start)
+        return true;
+
+    return Queue(splitter, end);
+}
+
+// -----------------------------------------------------------------------------------------------
+// Workers
+
+struct Worker
+{
+    Shared* shared;
+    const char* conninfo;
+    const char* szSQL;
+    CopyFormat format;
+
+    PGconn* pgconn;
+    std::thread thread;
+
+    std::string error;
+    // Why the worker failed.  Empty if it has not.
+
+    long long rows;
+    bool committed;
+
+    Worker()
+    {
+        pgconn    = 0;
+        rows      = 0;
+        committed = false;
+    }
+
+    ~Worker()
+    {
+        if (pgconn)
+            PQfinish(pgconn);
+    }
+};
+
+static void SetError(Worker& worker, const char* szMessage)
+{
+    worker.error = (szMessage && *szMessage) ? szMessage : "Unknown error";
+    while (!worker.error.empty() && isspace((unsigned char)worker.error.back()))
+        worker.error.pop_back();
+}
+
+static void Fail(Worker& worker, const char* szMessage)
+{
+    SetError(worker, szMessage);
+    worker.shared->Stop(true);
+}
+
+static bool Exec(Worker& worker, const char* szSQL, ExecStatusType expected)
+{
+    ResultHolder result(PQexec(worker.pgconn, szSQL));
+
+    if (result == 0)
+    {
+        Fail(worker, PQerrorMessage(worker.pgconn));
+        return false;
+    }
+
+    if (PQresultStatus(result) != expected)
+    {
+        Fail(worker, PQresultErrorMessage(result));
+        return false;
+    }
+
+    return true;
+}
+
+static void RunWorker(Worker* pworker)
+{
+    Worker& worker = *pworker;
+
+    worker.pgconn = PQconnectdb(worker.conninfo);
+    if (worker.pgconn == 0)
+    {
+        Fail(worker, "Out of memory");
+        return;
+    }
+
+    if (PQstatus(worker.pgconn) != CONNECTION_OK)
+    {
+        Fail(worker, PQerrorMessage(worker.pgconn));
+        return;
+    }
+
+    if (!Exec(worker, "BEGIN", PGRES_COMMAND_OK) || !Exec(worker, worker.szSQL, PGRES_COPY_IN))
+        return;
+
+    PGconn* pgconn = worker.pgconn;
+    bool binary = worker.format == COPY_BINARY;
+
+    bool sent = !binary || PQputCopyData(pgconn, BINARY_HEADER, (int)BINARY_HEADER_SIZE) == 1;
+    const char* szAbort = 0;
+
+    while (sent)
+    {
+        Part part;
+        int take = TakePart(*worker.shared, part);
+
+        if (take == TAKE_FAILED)
+        {
+            szAbort = "Another parallel_copy worker failed";
+            break;
+        }
+
+        if (take == TAKE_DONE)
+            break;
+
+        sent = PQputCopyData(pgconn, part.data, (int)part.len) == 1;
+        free(part.data);
+    }
+
+    if (sent && binary && !szAbort)
+        sent = PQputCopyData(pgconn, "\377\377", 2) == 1;
+
+    if (!sent || PQputCopyEnd(pgconn, szAbort) != 1)
+    {
+        Fail(worker, PQerrorMessage(pgconn));
+        return;
+    }
+
+    ResultHolder result(PQgetResult(pgconn));
+
+    if (szAbort == 0)
+    {
+        if (result == 0)
+            Fail(worker, PQerrorMessage(pgconn));
+        else if (PQresultStatus(result) != PGRES_COMMAND_OK)
+            Fail(worker, PQresultErrorMessage(result));
+        else
+            worker.rows = atoll(PQcmdTuples(result));
+    }
+
+    if (result != 0)
+    {
+        PGresult* extra;
+        while ((extra = PQgetResult(pgconn)) != 0)
+            PQclear(extra);
+    }
+}
+
+static void Finish(Worker* workers, int count, bool commit)
+{
+    // Commits or rolls back every worker's transaction.  If a commit fails we keep going so
+    // the caller can report which were committed.
+
+    for (int i = 0; i < count; i++)
+    {
+        Worker& worker = workers[i];
+
+        if (worker.pgconn == 0 || PQstatus(worker.pgconn) != CONNECTION_OK)
+            continue;
+
+        if (commit)
+        {
+            ResultHolder result(PQexec(worker.pgconn, "COMMIT"));
+            if (result == 0)
+                SetError(worker, PQerrorMessage(worker.pgconn));
+            else if (PQresultStatus(result) != PGRES_COMMAND_OK)
+                SetError(worker, PQresultErrorMessage(result));
+            else
+                worker.committed = true;
+        }
+        else if (PQtransactionStatus(worker.pgconn) != PQTRANS_IDLE)
+        {
+            PQclear(PQexec(worker.pgconn, "ROLLBACK"));
+        }
+
+        PQfinish(worker.pgconn);
+        worker.pgconn = 0;
+    }
+}
+
+static PyObject* WorkerError(Worker* workers, int count, bool committed)
+{
+    // Raises an Error listing each worker's failure.  The exception's `errors` attribute is a
+    // list with the error message, or None, for each worker and its `committed` attribute is a
+    // list of the workers that were committed.
+
+    List errors(count);
+    List done(0);
+    List lines(0);
+    if (!errors.Get() || !done.Get() || !lines.Get())
+        return 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        Worker& worker = workers[i];
+
+        if (worker.committed)
+        {
+            Object index(PyLong_FromLong(i));
+            if (!index || !done.AppendAndBorrow(index))
+                return 0;
+        }
+
+        if (worker.error.empty())
+        {
+            Py_INCREF(Py_None);
+            PyList_SET_ITEM(errors.Get(), i, Py_None);
+            continue;
+        }
+
+        PyObject* error = PyUnicode_DecodeUTF8(worker.error.c_str(), (Py_ssize_t)worker.error.size(), "replace");
+        if (!error)
+            return 0;
+        PyList_SET_ITEM(errors.Get(), i, error);
+
+        Object line(PyUnicode_FromFormat("\n  worker %d: %U", i, error));
+        if (!line || !lines.AppendAndBorrow(line))
+            return 0;
+    }
+
+    Object text(lines.Join(strEmpty));
+    if (!text)
+        return 0;
+
+    Object msg;
+    if (committed)
+        msg.Attach(PyUnicode_FromFormat("parallel_copy could not commit every worker.  %zd of %d were committed:%U",
+                                        PyList_GET_SIZE(done.Get()), count, text.Get()));
+    else
+        msg.Attach(PyUnicode_FromFormat("parallel_copy failed and was rolled back:%U", text.Get()));
+    if (!msg)
+        return 0;
+
+    Object exc(PyObject_CallFunctionObjArgs(Error, msg.Get(), 0));
+    if (!exc)
+        return 0;
+
+    if (PyObject_SetAttrString(exc, "errors", errors) == -1 || PyObject_SetAttrString(exc, "committed", done) == -1)
+        return 0;
+
+    PyErr_SetObject(Error, exc);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------------------------
+// parallel_copy
+
+const char doc_parallel_copy[] =
+    "parallel_copy(conninfo, table, source, workers=4, format='csv', header=False, chunk_size=1048576, compression=None) --> int\n"
+    "\n"
+    "Copies data into a table using several connections at once and returns the number of\n"
+    "rows copied.\n"
+    "\n"
+    "The source is split on row boundaries into parts of about chunk_size bytes which are sent\n"
+    "by `workers` threads, each with its own connection, without holding the GIL.  Each\n"
+    "connection copies in its own transaction and they are only committed if every one\n"
+    "succeeds.  Otherwise they are all rolled back and an Error is raised with an `errors`\n"
+    "attribute holding each worker's error message or None.\n"
+    "\n"
+    "source\n"
+    "  A string or bytes object, a file-like object, an integer file descriptor, or an\n"
+    "  os.PathLike object, as accepted by Connection.copy_from_csv.\n"
+    "\n"
+    "format\n"
+    "  'csv', 'text', or 'binary'.\n"
+    "\n"
+    "header\n"
+    "  True if the first line of CSV or text data is a header to skip.\n"
+    "\n"
+    "compression\n"
+    "  None, 'gzip', 'zstd', or 'auto' to decompress the source.\n";
+
+static bool ParseFormat(const char* szFormat, CopyFormat& format)
+{
+    if (strcmp(szFormat, "csv") == 0)
+        format = COPY_CSV;
+    else if (strcmp(szFormat, "text") == 0)
+        format = COPY_TEXT;
+    else if (strcmp(szFormat, "binary") == 0)
+        format = COPY_BINARY;
+    else
+        return false;
+    return true;
+}
+
+PyObject* mod_parallel_copy(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    UNUSED(self);
+
+    static const char *kwlist[] = { "conninfo", "table", "source", "workers", "format", "header", "chunk_size", "compression", 0 };
+
+    PyObject* pConninfo;
+    PyObject* table;
+    PyObject* source;
+    int cWorkers = 4;
+    const char* szFormat = "csv";
+    int header = 0;
+    Py_ssize_t chunk_size = 1024 * 1024;
+    PyObject* pCompression = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "UUO|ispnO", (char**)kwlist, &pConninfo, &table, &source,
+                                     &cWorkers, &szFormat, &header, &chunk_size, &pCompression))
+        return 0;
+
+    CopyFormat format;
+    if (!ParseFormat(szFormat, format))
+        return PyErr_Format(PyExc_ValueError, "Invalid format '%s'.  Must be 'csv', 'text', or 'binary'.", szFormat);
+
+    if (header && format == COPY_BINARY)
+        return SetStringError(PyExc_ValueError, "header cannot be used with the binary format");
+
+    if (cWorkers < 1 || cWorkers > 1024)
+        return SetStringError(PyExc_ValueError, "workers must be between 1 and 1024");
+
+    if (chunk_size < 1 || chunk_size > INT_MAX)
+        return SetStringError(PyExc_ValueError, "chunk_size must be a positive integer");
+
+    Compression compression;
+    if (!Compression_FromObject(pCompression, true, compression))
+        return 0;
+
+    const char* szConninfo = PyUnicode_AsUTF8(pConninfo);
+    if (!szConninfo)
+        return 0;
+
+    Object sql(PyUnicode_FromFormat("copy %U from stdin with (format %s)", table, szFormat));
+    const char* szSQL = sql ? PyUnicode_AsUTF8(sql) : 0;
+    if (!szSQL)
+        return 0;
+
+    CopySource copysource;
+    if (!CopySource_Init(copysource, source))
+        return 0;
+
+    // Each worker gets two parts in the queue so it never waits for the reader unless the
+    // reader is slower than the server.
+
+    Shared shared((size_t)cWorkers * 2);
+
+    Worker* workers = new (std::nothrow) Worker[cWorkers];
+    if (!workers)
+        return PyErr_NoMemory();
+
+    int cStarted = 0;
+    for (; cStarted < cWorkers; cStarted++)
+    {
+        Worker& worker = workers[cStarted];
+        worker.shared   = &shared;
+        worker.conninfo = szConninfo;
+        worker.szSQL    = szSQL;
+        worker.format   = format;
+
+        try
+        {
+            worker.thread = std::thread(RunWorker, &worker);
+        }
+        catch (const std::system_error&)
+        {
+            break;
+        }
+    }
+
+    Splitter splitter(&shared, format, (size_t)chunk_size, header != 0);
+    Codec codec(compression, false);
+
+    int rc = READ_ERROR;
+    if (cStarted < cWorkers)
+        PyErr_SetString(Error, "Unable to start the parallel_copy threads");
+    else
+        rc = ReadSource(copysource, chunk_size, codec, SplitSink, &splitter);
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = (rc == CODEC_OK && SplitFinish(splitter));
+    shared.Stop(!ok);
+
+    for (int i = 0; i < cStarted; i++)
+        workers[i].thread.join();
+
+    for (int i = 0; i < cStarted && ok; i++)
+        ok = workers[i].error.empty();
+
+    Finish(workers, cStarted, ok);
+    Py_END_ALLOW_THREADS
+
+    PyObject* result = 0;
+
+    if (rc == READ_ERROR)
+    {
+        // The exception is already set.
+    }
+    else if (rc == CODEC_ERROR)
+    {
+        SetStringError(Error, codec.szError);
+    }
+    else if (splitter.szError)
+    {
+        SetStringError(Error, splitter.szError);
+    }
+    else
+    {
+        bool failed = false;
+        long long rows = 0;
+        for (int i = 0; i < cWorkers; i++)
+        {
+            failed = failed || !workers[i].error.empty();
+            rows  += workers[i].rows;
+        }
+
+        if (failed)
+            WorkerError(workers, cWorkers, ok);
+        else
+            result = PyLong_FromLongLong(rows);
+    }
+
+    delete[] workers;
+
+    return result;
+}
@@ -0,0 +1,9 @@
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+extern const char doc_parallel_copy[];
+
+PyObject* mod_parallel_copy(PyObject* self, PyObject* args, PyObject* kwargs);
+
+#endif // PARALLEL_H
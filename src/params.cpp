@@ -7,6 +7,7 @@
 #include "juliandate.h"
 #include "byteswap.h"
 #include "pgarrays.h"
+#include "pgjson.h"
 #include "pgtypes.h"
 
 
@@ -96,6 +97,14 @@ bool Params::Bind(Oid type, const void* value, int length, int format)
     return true;
 }
 
+void Params::Reset()
+{
+    bound = 0;
+
+    for (Pool* p = pool; p != 0; p = p->next)
+        p->remaining = p->total;
+}
+
 char* Params::Allocate(size_t amount)
 {
     // See if we have a pool that is large enough.
@@ -115,7 +124,7 @@ char* Params::Allocate(size_t amount)
     if (*pp == 0)
     {
         size_t total = amount + 1024;
-        *pp = (Pool*)malloc(total);
+        *pp = (Pool*)malloc(sizeof(Pool) + total);
 
         if (*pp == 0)
         {
@@ -238,9 +247,49 @@ static bool BindDate(Connection* cnxn, Params& params, PyObject* param)
     return true;
 }
 
+static bool GetUTCOffset(PyObject* param, bool& aware, int64_t& offset)
+{
+    // Sets `aware` if the datetime or time has a tzinfo that returns an offset, and `offset` to
+    // that offset in microseconds.
+
+    aware = false;
+
+    if (!_PyDateTime_HAS_TZINFO(param))
+        return true;
+
+    Object delta(PyObject_CallMethod(param, "utcoffset", 0));
+    if (!delta)
+        return false;
+
+    if (delta.Get() == Py_None)
+        return true;
+
+    if (!PyDelta_Check(delta.Get()))
+    {
+        PyErr_Format(Error, "utcoffset() returned %R instead of a timedelta", delta.Get());
+        return false;
+    }
+
+    aware  = true;
+    offset = ((int64_t)PyDateTime_DELTA_GET_DAYS(delta.Get()) * 86400 + PyDateTime_DELTA_GET_SECONDS(delta.Get())) * 1000000
+             + PyDateTime_DELTA_GET_MICROSECONDS(delta.Get());
+    return true;
+}
+
 static bool BindDateTime(Connection* cnxn, Params& params, PyObject* param)
 {
-    uint64_t timestamp = dateToJulian(PyDateTime_GET_YEAR(param), PyDateTime_GET_MONTH(param), PyDateTime_GET_DAY(param)) - JULIAN_START;
+    // Aware datetimes are converted to UTC and bound as timestamptz so the server doesn't
+    // reinterpret them in the session's time zone.  Naive ones are bound as timestamp.
+
+    bool aware;
+    int64_t offset;
+    if (!GetUTCOffset(param, aware, offset))
+        return false;
+
+    // The day is signed since dates before 2000 are negative.
+    int32_t day = (int32_t)(dateToJulian(PyDateTime_GET_YEAR(param), PyDateTime_GET_MONTH(param), PyDateTime_GET_DAY(param)) - JULIAN_START);
+
+    uint64_t timestamp = (uint64_t)(int64_t)day;
     timestamp *= 24;
     timestamp += PyDateTime_DATE_GET_HOUR(param);
     timestamp *= 60;
@@ -250,13 +299,16 @@ static bool BindDateTime(Connection* cnxn, Params& params, PyObject* param)
     timestamp *= 1000000;
     timestamp += PyDateTime_DATE_GET_MICROSECOND(param);
 
+    if (aware)
+        timestamp -= (uint64_t)offset;
+
     uint64_t* p = (uint64_t*)params.Allocate(8);
     if (p == 0)
         return false;
 
     *p = swapu8(timestamp);
 
-    params.Bind(TIMESTAMPOID, p, 8, 1);
+    params.Bind(aware ? TIMESTAMPTZOID : TIMESTAMPOID, p, 8, 1);
     return true;
 }
 
@@ -268,6 +320,17 @@ static bool BindNone(Connection* cnxn, Params& params, PyObject* param)
 
 static bool BindTime(Connection* cnxn, Params& params, PyObject* param)
 {
+    // Aware times are bound as timetz, which is the time followed by the zone in seconds west
+    // of UTC.
+
+    bool aware;
+    int64_t offset;
+    if (!GetUTCOffset(param, aware, offset))
+        return false;
+
+    if (aware && offset % 1000000 != 0)
+        return PyErr_Format(Error, "Microseconds are not supported in time zone offsets.");
+
     uint64_t value = PyDateTime_TIME_GET_HOUR(param);
     value *= 60;
     value += PyDateTime_TIME_GET_MINUTE(param);
@@ -276,13 +339,28 @@ static bool BindTime(Connection* cnxn, Params& params, PyObject* param)
     value *= 1000000;
     value += PyDateTime_TIME_GET_MICROSECOND(param);
 
-    uint64_t* p = (uint64_t*)params.Allocate(8);
+    if (!aware)
+    {
+        uint64_t* p = (uint64_t*)params.Allocate(8);
+        if (p == 0)
+            return false;
+
+        *p = swapu8(value);
+
+        params.Bind(TIMEOID, p, 8, 1);
+        return true;
+    }
+
+    char* p = (char*)params.Allocate(12);
     if (p == 0)
         return false;
 
-    *p = swapu8(value);
+    uint64_t time = swapu8(value);
+    uint32_t zone = swapu4((uint32_t)(int32_t)(-offset / 1000000));
+    memcpy(p, &time, 8);
+    memcpy(p + 8, &zone, 4);
 
-    params.Bind(TIMEOID, p, 8, 1);
+    params.Bind(TIMETZOID, p, 12, 1);
     return true;
 }
 
@@ -354,6 +432,61 @@ static bool BindUUID(Connection* cnxn, Params& params, PyObject* param)
     return params.Bind(UUIDOID, pch, cch, 1);
 }
 
+bool BindParam(Connection* cnxn, Params& params, PyObject* param)
+{
+    // Binds a single parameter into the next slot of `params`.
+
+    // Remember that a bool is a long, a datetime is a date, etc, so the order we check them in is important.
+
+    if (param == Py_None)
+        return BindNone(cnxn, params, param);
+
+    if (PyBool_Check(param))
+        return BindBool(cnxn, params, param);
+
+    if (PyLong_Check(param))
+        return BindLong(cnxn, params, param);
+
+    if (PyUnicode_Check(param))
+        return BindUnicode(cnxn, params, param);
+
+    if (Decimal_Check(param))
+        return BindDecimal(cnxn, params, param);
+
+    if (PyDateTime_Check(param))
+        return BindDateTime(cnxn, params, param);
+
+    if (PyDate_Check(param))
+        return BindDate(cnxn, params, param);
+
+    if (PyTime_Check(param))
+        return BindTime(cnxn, params, param);
+
+    if (PyDelta_Check(param))
+        return BindDelta(cnxn, params, param);
+
+    if (PyFloat_Check(param))
+        return BindFloat(cnxn, params, param);
+
+    if (PyBytes_Check(param))
+        return BindBytes(cnxn, params, param);
+
+    if (PyByteArray_Check(param))
+        return BindByteArray(cnxn, params, param);
+
+    if (UUID_Check(param))
+        return BindUUID(cnxn, params, param);
+
+    if (PyDict_Check(param))
+        return BindJSON(params, param);
+
+    if (PyList_Check(param) || PyTuple_Check(param))
+        return BindArray(params, param);
+
+    PyErr_Format(Error, "Unable to bind parameter %d: unhandled object type %R", (params.bound + 1), param);
+    return false;
+}
+
 bool BindParams(Connection* cnxn, Params& params, PyObject* args)
 {
     // Binds arguments 1-n.  Argument zero is expected to be the SQL statement itself.
@@ -369,84 +502,8 @@ bool BindParams(Connection* cnxn, Params& params, PyObject* args)
 
     for (int i = 0, c = PyTuple_GET_SIZE(args)-1; i < c; i++)
     {
-        // Remember that a bool is a long, a datetime is a date, etc, so the order we check them in is important.
-
-        PyObject* param = PyTuple_GET_ITEM(args, i+1);
-        if (param == Py_None)
-        {
-            if (!BindNone(cnxn, params, param))
-                return false;
-        }
-        else if (PyBool_Check(param))
-        {
-            if (!BindBool(cnxn, params, param))
-                return false;
-        }
-        else if (PyLong_Check(param))
-        {
-            if (!BindLong(cnxn, params, param))
-                return false;
-        }
-        else if (PyUnicode_Check(param))
-        {
-            if (!BindUnicode(cnxn, params, param))
-                return false;
-        }
-        else if (Decimal_Check(param))
-        {
-            if (!BindDecimal(cnxn, params, param))
-                return false;
-        }
-        else if (PyDateTime_Check(param))
-        {
-            if (!BindDateTime(cnxn, params, param))
-                return false;
-        }
-        else if (PyDate_Check(param))
-        {
-            if (!BindDate(cnxn, params, param))
-                return false;
-        }
-        else if (PyTime_Check(param))
-        {
-            if (!BindTime(cnxn, params, param))
-                return false;
-        }
-        else if (PyDelta_Check(param))
-        {
-            if (!BindDelta(cnxn, params, param))
-                return false;
-        }
-        else if (PyFloat_Check(param))
-        {
-            if (!BindFloat(cnxn, params, param))
-                return false;
-        }
-        else if (PyBytes_Check(param))
-        {
-            if (!BindBytes(cnxn, params, param))
-                return false;
-        }
-        else if (PyByteArray_Check(param))
-        {
-            if (!BindByteArray(cnxn, params, param))
-                return false;
-        }
-        else if (UUID_Check(param))
-        {
-            if (!BindUUID(cnxn, params, param))
-                return false;
-        }
-        else if (PyList_Check(param) || PyTuple_Check(param))
-        {
-            if (!BindArray(params, param))
-                return false;
-        }
-        else
-        {
-            PyErr_Format(Error, "Unable to bind parameter %d: unhandled object type %R", (i+1), param);
+        if (!BindParam(cnxn, params, PyTuple_GET_ITEM(args, i+1)))
             return false;
-        }
     }
 
     return true;
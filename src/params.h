@@ -28,9 +28,16 @@ struct Params
 
     char* Allocate(size_t cbNeeded);
 
+    void Reset();
+    // Unbinds all parameters so the object can be reused, keeping the memory it allocated.
+
     bool Bind(Oid type, const void* value, int length, int format);
 };
 
 bool BindParams(Connection* cnxn, Params& params, PyObject* args);
+// Binds args[1:] into `params`.  Argument zero is expected to be the SQL statement.
+
+bool BindParam(Connection* cnxn, Params& params, PyObject* param);
+// Binds a single parameter into the next slot of `params`.
 
 #endif // PARAMS_H
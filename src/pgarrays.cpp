@@ -27,6 +27,8 @@
 #include "errors.h"
 #include "debug.h"
 #include "byteswap.h"
+#include "pgjson.h"
+#include "datatypes.h"
 
 struct ArrayHeader
 {
@@ -38,19 +40,38 @@ struct ArrayHeader
     char buffer[0];
 };
 
-static PyObject* FindFirstParam(Object& seq)
+enum ElementKind
 {
-    // Returns a *borrowed* reference to the first non-None parameter in the sequence.  Returns
-    // zero if the list is empty or all are None.
+    ELEMENTS_NONE,              // empty or all None
+    ELEMENTS_STR,
+    ELEMENTS_INT,
+    ELEMENTS_OTHER              // anything else, including a mix of strs and ints
+};
+
+static ElementKind GetElementKind(Object& seq, Py_ssize_t cItems)
+{
+    // Determines the kind of the non-None elements in the sequence.
+
+    ElementKind kind = ELEMENTS_NONE;
 
-    Py_ssize_t cItems = PySequence_Length(seq);
-    for (int i = 0; i < cItems; i++)
+    for (Py_ssize_t i = 0; i < cItems; i++)
     {
         PyObject* item = PySequence_Fast_GET_ITEM(seq.Get(), i);
-        if (item != Py_None)
-            return item;
+        if (item == Py_None)
+            continue;
+
+        ElementKind itemKind = PyUnicode_Check(item) ? ELEMENTS_STR : PyLong_Check(item) ? ELEMENTS_INT : ELEMENTS_OTHER;
+
+        if (kind == ELEMENTS_NONE)
+            kind = itemKind;
+        else if (kind != itemKind)
+            return ELEMENTS_OTHER;
+
+        if (kind == ELEMENTS_OTHER)
+            return kind;
     }
-    return 0;
+
+    return kind;
 }
 
 bool BindUnicodeArray(Params& params, Object& seq, Py_ssize_t cItems)
@@ -221,8 +242,8 @@ bool BindLongArray(Params& params, Object& seq, Py_ssize_t cItems)
 
 bool BindArray(Params& params, PyObject* param)
 {
-    // Binds a list or tuple as an array.  All elements must be of the same type, though None
-    // (NULL) is supported.
+    // Binds a list or tuple as a text or integer array, or as jsonb if its elements are not
+    // all strings or all integers.  None elements are NULLs in arrays and nulls in JSON.
 
     Object seq = PySequence_Fast(param, "a list or tuple is required");
     if (!seq)
@@ -230,19 +251,21 @@ bool BindArray(Params& params, PyObject* param)
 
     Py_ssize_t cItems = PySequence_Length(param);
 
-    // Figure out what kind of elements are in the array.  Find the first non-None item.
-
-    PyObject* first = FindFirstParam(seq);
+    // Only lists of strings and lists of integers are bound as arrays.  Anything else, such as
+    // lists of dicts, other lists, or a mix of types, is bound as JSON.
 
-    if (!first || PyUnicode_Check(first))
+    switch (GetElementKind(seq, cItems))
+    {
+    case ELEMENTS_NONE:
+    case ELEMENTS_STR:
         return BindUnicodeArray(params, seq, cItems);
 
-    if (PyLong_Check(first))
+    case ELEMENTS_INT:
         return BindLongArray(params, seq, cItems);
 
-    SetStringError(Error, "Unhandled type in parameter array");
-
-    return false;
+    default:
+        return BindJSON(params, seq);
+    }
 }
 
 PyObject* GetInt4Array(const char* p)
@@ -357,7 +380,7 @@ PyObject* GetTextArray(const char* p)
             }
             else
             {
-                PyObject* str = PyUnicode_DecodeUTF8(pT, len, "strict");
+                PyObject* str = Text_FromUTF8(pT, len);
                 if (!str)
                     return 0;
                 pT += len;
@@ -0,0 +1,787 @@
+
+#include "pglib.h"
+#include <math.h>
+#include "connection.h"
+#include "params.h"
+#include "pgjson.h"
+#include "datatypes.h"
+#include "errors.h"
+
+struct Buffer
+{
+    // A growable buffer for escaped strings and serialized values.
+
+    char* data;
+    size_t len;
+    size_t cap;
+
+    Buffer()
+    {
+        data = 0;
+        len  = 0;
+        cap  = 0;
+    }
+
+    ~Buffer()
+    {
+        free(data);
+    }
+
+    bool Append(const char* p, size_t cb)
+    {
+        if (len + cb > cap)
+        {
+            size_t newcap = MAX(cap * 2, MAX(len + cb, (size_t)256));
+            char* newdata = (char*)realloc(data, newcap);
+            if (newdata == 0)
+            {
+                PyErr_NoMemory();
+                return false;
+            }
+            data = newdata;
+            cap  = newcap;
+        }
+        memcpy(&data[len], p, cb);
+        len += cb;
+        return true;
+    }
+
+    bool Append(char ch)
+    {
+        return Append(&ch, 1);
+    }
+};
+
+// -----------------------------------------------------------------------------------------------
+// Parsing
+
+struct Parser
+{
+    const char* start;
+    const char* p;
+    const char* end;
+};
+
+static PyObject* ParseValue(Parser& parser);
+
+static PyObject* ParseError(Parser& parser)
+{
+    if (!PyErr_Occurred())
+        PyErr_Format(Error, "Invalid JSON at offset %zd", (Py_ssize_t)(parser.p - parser.start));
+    return 0;
+}
+
+inline void SkipWhitespace(Parser& parser)
+{
+    while (parser.p < parser.end && (*parser.p == ' ' || *parser.p == '\n' || *parser.p == '\r' || *parser.p == '\t'))
+        parser.p++;
+}
+
+inline bool Match(Parser& parser, const char* sz, size_t cch)
+{
+    if ((size_t)(parser.end - parser.p) < cch || memcmp(parser.p, sz, cch) != 0)
+        return false;
+    parser.p += cch;
+    return true;
+}
+
+static PyObject* NewASCII(const char* p, Py_ssize_t len)
+{
+    PyObject* str = PyUnicode_New(len, 127);
+    if (str)
+        memcpy(PyUnicode_1BYTE_DATA(str), p, len);
+    return str;
+}
+
+// Objects in a column usually have the same keys, so short ASCII keys are cached and shared
+// rather than creating a new str for every one.  This is a direct-mapped cache like the one
+// for dates.
+
+const int KEY_CACHE_SIZE = 256;
+const Py_ssize_t KEY_CACHE_MAX_LENGTH = 32;
+
+static PyObject* keyCache[KEY_CACHE_SIZE];
+
+static PyObject* GetKey(const char* p, Py_ssize_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (Py_ssize_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)p[i]) * 16777619u;
+
+    PyObject*& entry = keyCache[hash % KEY_CACHE_SIZE];
+    if (entry != 0 && PyUnicode_GET_LENGTH(entry) == len && memcmp(PyUnicode_1BYTE_DATA(entry), p, len) == 0)
+    {
+        Py_INCREF(entry);
+        return entry;
+    }
+
+    PyObject* key = NewASCII(p, len);
+    if (key == 0)
+        return 0;
+
+    Py_XDECREF(entry);
+    entry = key;
+    Py_INCREF(key);
+
+    return key;
+}
+
+static int HexDigit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+static bool ParseHex4(Parser& parser, uint32_t& value)
+{
+    if (parser.end - parser.p < 4)
+        return false;
+
+    value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int digit = HexDigit(parser.p[i]);
+        if (digit < 0)
+            return false;
+        value = value * 16 + (uint32_t)digit;
+    }
+    parser.p += 4;
+    return true;
+}
+
+static bool AppendUTF8(Buffer& buffer, uint32_t ch)
+{
+    // Lone surrogates are encoded like any other code point and let through by the
+    // "surrogatepass" error handler, the same as json.loads allows.
+
+    char sz[4];
+    size_t cb;
+
+    if (ch < 0x80)
+    {
+        sz[0] = (char)ch;
+        cb = 1;
+    }
+    else if (ch < 0x800)
+    {
+        sz[0] = (char)(0xC0 | (ch >> 6));
+        sz[1] = (char)(0x80 | (ch & 0x3F));
+        cb = 2;
+    }
+    else if (ch < 0x10000)
+    {
+        sz[0] = (char)(0xE0 | (ch >> 12));
+        sz[1] = (char)(0x80 | ((ch >> 6) & 0x3F));
+        sz[2] = (char)(0x80 | (ch & 0x3F));
+        cb = 3;
+    }
+    else
+    {
+        sz[0] = (char)(0xF0 | (ch >> 18));
+        sz[1] = (char)(0x80 | ((ch >> 12) & 0x3F));
+        sz[2] = (char)(0x80 | ((ch >> 6) & 0x3F));
+        sz[3] = (char)(0x80 | (ch & 0x3F));
+        cb = 4;
+    }
+
+    return buffer.Append(sz, cb);
+}
+
+static PyObject* ParseEscapedString(Parser& parser, const char* begin)
+{
+    // Called with parser.p at the first backslash.  The text before it has no escapes.
+
+    Buffer buffer;
+    if (!buffer.Append(begin, parser.p - begin))
+        return 0;
+
+    for (;;)
+    {
+        if (parser.p >= parser.end)
+            return ParseError(parser);
+
+        char ch = *parser.p;
+
+        if (ch == '"')
+        {
+            parser.p++;
+            break;
+        }
+
+        if ((uint8_t)ch < 0x20)
+            return ParseError(parser);
+
+        if (ch != '\\')
+        {
+            const char* run = parser.p;
+            while (parser.p < parser.end && *parser.p != '"' && *parser.p != '\\' && (uint8_t)*parser.p >= 0x20)
+                parser.p++;
+            if (!buffer.Append(run, parser.p - run))
+                return 0;
+            continue;
+        }
+
+        parser.p++;
+        if (parser.p >= parser.end)
+            return ParseError(parser);
+
+        ch = *parser.p++;
+        switch (ch)
+        {
+        case '"':  ch = '"';  break;
+        case '\\': ch = '\\'; break;
+        case '/':  ch = '/';  break;
+        case 'b':  ch = '\b'; break;
+        case 'f':  ch = '\f'; break;
+        case 'n':  ch = '\n'; break;
+        case 'r':  ch = '\r'; break;
+        case 't':  ch = '\t'; break;
+
+        case 'u':
+        {
+            uint32_t code;
+            if (!ParseHex4(parser, code))
+                return ParseError(parser);
+
+            // Combine a surrogate pair into one code point.
+            uint32_t low;
+            if (code >= 0xD800 && code <= 0xDBFF && parser.end - parser.p >= 6 && parser.p[0] == '\\' && parser.p[1] == 'u')
+            {
+                Parser lookahead = parser;
+                lookahead.p += 2;
+                if (ParseHex4(lookahead, low) && low >= 0xDC00 && low <= 0xDFFF)
+                {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    parser.p = lookahead.p;
+                }
+            }
+
+            if (!AppendUTF8(buffer, code))
+                return 0;
+            continue;
+        }
+
+        default:
+            parser.p--;
+            return ParseError(parser);
+        }
+
+        if (!buffer.Append(ch))
+            return 0;
+    }
+
+    return PyUnicode_DecodeUTF8(buffer.data, (Py_ssize_t)buffer.len, "surrogatepass");
+}
+
+static PyObject* ParseString(Parser& parser, bool key)
+{
+    // Called with parser.p after the opening quote.
+
+    const char* begin = parser.p;
+    uint8_t high = 0;
+
+    while (parser.p < parser.end)
+    {
+        uint8_t ch = (uint8_t)*parser.p;
+        if (ch == '"' || ch == '\\' || ch < 0x20)
+            break;
+        high |= ch;
+        parser.p++;
+    }
+
+    if (parser.p >= parser.end || *parser.p != '"')
+    {
+        if (parser.p < parser.end && *parser.p == '\\')
+            return ParseEscapedString(parser, begin);
+        return ParseError(parser);
+    }
+
+    Py_ssize_t len = parser.p - begin;
+    parser.p++;
+
+    if (high & 0x80)
+        return PyUnicode_DecodeUTF8(begin, len, 0);
+
+    if (key && len <= KEY_CACHE_MAX_LENGTH)
+        return GetKey(begin, len);
+
+    return NewASCII(begin, len);
+}
+
+static PyObject* ParseNumber(Parser& parser)
+{
+    const char* begin = parser.p;
+
+    bool negative = (*parser.p == '-');
+    if (negative)
+        parser.p++;
+
+    const char* digits = parser.p;
+    while (parser.p < parser.end && *parser.p >= '0' && *parser.p <= '9')
+        parser.p++;
+    Py_ssize_t cDigits = parser.p - digits;
+    if (cDigits == 0)
+        return ParseError(parser);
+
+    bool isfloat = false;
+
+    if (parser.p < parser.end && *parser.p == '.')
+    {
+        isfloat = true;
+        parser.p++;
+        const char* fraction = parser.p;
+        while (parser.p < parser.end && *parser.p >= '0' && *parser.p <= '9')
+            parser.p++;
+        if (parser.p == fraction)
+            return ParseError(parser);
+    }
+
+    if (parser.p < parser.end && (*parser.p == 'e' || *parser.p == 'E'))
+    {
+        isfloat = true;
+        parser.p++;
+        if (parser.p < parser.end && (*parser.p == '+' || *parser.p == '-'))
+            parser.p++;
+        const char* exponent = parser.p;
+        while (parser.p < parser.end && *parser.p >= '0' && *parser.p <= '9')
+            parser.p++;
+        if (parser.p == exponent)
+            return ParseError(parser);
+    }
+
+    if (!isfloat && cDigits <= 18)
+    {
+        // Fits in an int64 without overflow checks.
+        int64_t n = 0;
+        for (const char* p = digits; p < parser.p; p++)
+            n = n * 10 + (*p - '0');
+        return PyLong_FromLongLong(negative ? -n : n);
+    }
+
+    // The conversion functions need a terminated string, which the value isn't since the
+    // number is usually followed by more JSON.
+
+    char sz[64];
+    Buffer buffer;
+    size_t cch = (size_t)(parser.p - begin);
+    char* p = sz;
+    if (cch >= sizeof(sz))
+    {
+        if (!buffer.Append(begin, cch) || !buffer.Append('\0'))
+            return 0;
+        p = buffer.data;
+    }
+    else
+    {
+        memcpy(sz, begin, cch);
+        sz[cch] = 0;
+    }
+
+    if (!isfloat)
+        return PyLong_FromString(p, 0, 10);
+
+    double d = PyOS_string_to_double(p, 0, 0);
+    if (d == -1.0 && PyErr_Occurred())
+        return 0;
+    return PyFloat_FromDouble(d);
+}
+
+static PyObject* ParseObject(Parser& parser)
+{
+    // Called with parser.p after the opening brace.
+
+    Object dict(PyDict_New());
+    if (!dict)
+        return 0;
+
+    SkipWhitespace(parser);
+    if (parser.p < parser.end && *parser.p == '}')
+    {
+        parser.p++;
+        return dict.Detach();
+    }
+
+    for (;;)
+    {
+        SkipWhitespace(parser);
+        if (parser.p >= parser.end || *parser.p != '"')
+            return ParseError(parser);
+        parser.p++;
+
+        Object key(ParseString(parser, true));
+        if (!key)
+            return 0;
+
+        SkipWhitespace(parser);
+        if (parser.p >= parser.end || *parser.p != ':')
+            return ParseError(parser);
+        parser.p++;
+
+        Object value(ParseValue(parser));
+        if (!value)
+            return 0;
+
+        if (PyDict_SetItem(dict, key, value) != 0)
+            return 0;
+
+        SkipWhitespace(parser);
+        if (parser.p < parser.end && *parser.p == ',')
+        {
+            parser.p++;
+            continue;
+        }
+        if (parser.p < parser.end && *parser.p == '}')
+        {
+            parser.p++;
+            return dict.Detach();
+        }
+        return ParseError(parser);
+    }
+}
+
+static PyObject* ParseArray(Parser& parser)
+{
+    // Called with parser.p after the opening bracket.
+
+    Object list(PyList_New(0));
+    if (!list)
+        return 0;
+
+    SkipWhitespace(parser);
+    if (parser.p < parser.end && *parser.p == ']')
+    {
+        parser.p++;
+        return list.Detach();
+    }
+
+    for (;;)
+    {
+        Object value(ParseValue(parser));
+        if (!value)
+            return 0;
+
+        if (PyList_Append(list, value) != 0)
+            return 0;
+
+        SkipWhitespace(parser);
+        if (parser.p < parser.end && *parser.p == ',')
+        {
+            parser.p++;
+            continue;
+        }
+        if (parser.p < parser.end && *parser.p == ']')
+        {
+            parser.p++;
+            return list.Detach();
+        }
+        return ParseError(parser);
+    }
+}
+
+static PyObject* ParseValue(Parser& parser)
+{
+    SkipWhitespace(parser);
+
+    if (parser.p >= parser.end)
+        return ParseError(parser);
+
+    PyObject* result;
+
+    switch (*parser.p)
+    {
+    case '{':
+    case '[':
+        if (Py_EnterRecursiveCall(" while parsing JSON"))
+            return 0;
+        parser.p++;
+        result = (parser.p[-1] == '{') ? ParseObject(parser) : ParseArray(parser);
+        Py_LeaveRecursiveCall();
+        return result;
+
+    case '"':
+        parser.p++;
+        return ParseString(parser, false);
+
+    case 't':
+        if (!Match(parser, "true", 4))
+            return ParseError(parser);
+        Py_RETURN_TRUE;
+
+    case 'f':
+        if (!Match(parser, "false", 5))
+            return ParseError(parser);
+        Py_RETURN_FALSE;
+
+    case 'n':
+        if (!Match(parser, "null", 4))
+            return ParseError(parser);
+        Py_RETURN_NONE;
+
+    default:
+        if (*parser.p == '-' || (*parser.p >= '0' && *parser.p <= '9'))
+            return ParseNumber(parser);
+        return ParseError(parser);
+    }
+}
+
+PyObject* JSON_Parse(const char* p, Py_ssize_t len)
+{
+    Parser parser;
+    parser.start = p;
+    parser.p     = p;
+    parser.end   = p + len;
+
+    Object value(ParseValue(parser));
+    if (!value)
+        return 0;
+
+    SkipWhitespace(parser);
+    if (parser.p != parser.end)
+        return ParseError(parser);
+
+    return value.Detach();
+}
+
+// -----------------------------------------------------------------------------------------------
+// Serializing
+
+static bool WriteValue(Buffer& buffer, PyObject* o);
+
+static bool WriteString(Buffer& buffer, PyObject* o)
+{
+    // Only the quote, backslash, and control characters need escaping.  Everything else is
+    // written as UTF-8.
+
+    static const char hex[] = "0123456789abcdef";
+
+    Py_ssize_t cb;
+    const char* p = PyUnicode_AsUTF8AndSize(o, &cb);
+    if (p == 0)
+        return false;
+
+    const char* end = p + cb;
+
+    if (!buffer.Append('"'))
+        return false;
+
+    while (p < end)
+    {
+        const char* run = p;
+        while (p < end && *p != '"' && *p != '\\' && (uint8_t)*p >= 0x20)
+            p++;
+        if (!buffer.Append(run, p - run))
+            return false;
+        if (p == end)
+            break;
+
+        char sz[6] = { '\\', 0, 0, 0, 0, 0 };
+        size_t cch = 2;
+        switch (*p)
+        {
+        case '"':  sz[1] = '"';  break;
+        case '\\': sz[1] = '\\'; break;
+        case '\b': sz[1] = 'b';  break;
+        case '\f': sz[1] = 'f';  break;
+        case '\n': sz[1] = 'n';  break;
+        case '\r': sz[1] = 'r';  break;
+        case '\t': sz[1] = 't';  break;
+        default:
+            sz[1] = 'u';
+            sz[2] = '0';
+            sz[3] = '0';
+            sz[4] = hex[(uint8_t)*p >> 4];
+            sz[5] = hex[*p & 0xF];
+            cch = 6;
+            break;
+        }
+        if (!buffer.Append(sz, cch))
+            return false;
+        p++;
+    }
+
+    return buffer.Append('"');
+}
+
+static bool WriteText(Buffer& buffer, PyObject* str)
+{
+    // Writes the str of a number, which is ASCII.
+
+    if (str == 0)
+        return false;
+
+    Py_ssize_t cb;
+    const char* p = PyUnicode_AsUTF8AndSize(str, &cb);
+    bool ok = (p != 0) && buffer.Append(p, cb);
+    Py_DECREF(str);
+    return ok;
+}
+
+static bool WriteLong(Buffer& buffer, PyObject* o)
+{
+    int overflow;
+    long long n = PyLong_AsLongLongAndOverflow(o, &overflow);
+    if (overflow)
+        return WriteText(buffer, PyLong_Type.tp_repr(o));
+    if (n == -1 && PyErr_Occurred())
+        return false;
+
+    char sz[32];
+    int cch = snprintf(sz, sizeof(sz), "%lld", n);
+    return buffer.Append(sz, cch);
+}
+
+static bool WriteFloat(Buffer& buffer, PyObject* o)
+{
+    double d = PyFloat_AS_DOUBLE(o);
+    if (!isfinite(d))
+    {
+        PyErr_Format(Error, "Unable to bind %R as JSON: NaN and infinity are not valid JSON", o);
+        return false;
+    }
+
+    char* sz = PyOS_double_to_string(d, 'r', 0, Py_DTSF_ADD_DOT_0, 0);
+    if (sz == 0)
+        return false;
+    bool ok = buffer.Append(sz, strlen(sz));
+    PyMem_Free(sz);
+    return ok;
+}
+
+static bool WriteDecimal(Buffer& buffer, PyObject* o)
+{
+    // A finite Decimal's str, including any exponent, is a valid JSON number.  The others are
+    // NaN, sNaN, and Infinity.
+
+    Object str(PyObject_Str(o));
+    if (!str)
+        return false;
+
+    Py_ssize_t cb;
+    const char* p = PyUnicode_AsUTF8AndSize(str, &cb);
+    if (p == 0)
+        return false;
+
+    if (strpbrk(p, "IN") != 0)
+    {
+        PyErr_Format(Error, "Unable to bind %R as JSON: NaN and infinity are not valid JSON", o);
+        return false;
+    }
+
+    return buffer.Append(p, cb);
+}
+
+static bool WriteDict(Buffer& buffer, PyObject* o)
+{
+    if (!buffer.Append('{'))
+        return false;
+
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* value;
+    bool first = true;
+
+    while (PyDict_Next(o, &pos, &key, &value))
+    {
+        if (!first && !buffer.Append(','))
+            return false;
+        first = false;
+
+        if (PyUnicode_Check(key))
+        {
+            if (!WriteString(buffer, key))
+                return false;
+        }
+        else if (PyLong_Check(key) && !PyBool_Check(key))
+        {
+            // Like json.dumps, integer keys are written as strings.
+            if (!buffer.Append('"') || !WriteLong(buffer, key) || !buffer.Append('"'))
+                return false;
+        }
+        else
+        {
+            PyErr_Format(Error, "Unable to bind a dict as JSON: keys must be str or int, not %s", Py_TYPE(key)->tp_name);
+            return false;
+        }
+
+        if (!buffer.Append(':') || !WriteValue(buffer, value))
+            return false;
+    }
+
+    return buffer.Append('}');
+}
+
+static bool WriteSequence(Buffer& buffer, PyObject* o)
+{
+    if (!buffer.Append('['))
+        return false;
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(o);
+    PyObject** items = PySequence_Fast_ITEMS(o);
+
+    for (Py_ssize_t i = 0; i < count; i++)
+    {
+        if (i > 0 && !buffer.Append(','))
+            return false;
+        if (!WriteValue(buffer, items[i]))
+            return false;
+    }
+
+    return buffer.Append(']');
+}
+
+static bool WriteValue(Buffer& buffer, PyObject* o)
+{
+    if (o == Py_None)
+        return buffer.Append("null", 4);
+
+    if (o == Py_True)
+        return buffer.Append("true", 4);
+
+    if (o == Py_False)
+        return buffer.Append("false", 5);
+
+    if (PyUnicode_Check(o))
+        return WriteString(buffer, o);
+
+    if (PyLong_Check(o))
+        return WriteLong(buffer, o);
+
+    if (PyFloat_Check(o))
+        return WriteFloat(buffer, o);
+
+    if (Decimal_Check(o))
+        return WriteDecimal(buffer, o);
+
+    if (PyDict_Check(o) || PyList_Check(o) || PyTuple_Check(o))
+    {
+        if (Py_EnterRecursiveCall(" while serializing JSON"))
+            return false;
+        bool ok = PyDict_Check(o) ? WriteDict(buffer, o) : WriteSequence(buffer, o);
+        Py_LeaveRecursiveCall();
+        return ok;
+    }
+
+    PyErr_Format(Error, "Unable to bind %s as JSON", Py_TYPE(o)->tp_name);
+    return false;
+}
+
+bool BindJSON(Params& params, PyObject* param)
+{
+    // The jsonb binary format is a version byte followed by the text.
+
+    Buffer buffer;
+    if (!buffer.Append('\x01') || !WriteValue(buffer, param))
+        return false;
+
+    char* p = params.Allocate(buffer.len);
+    if (p == 0)
+        return false;
+    memcpy(p, buffer.data, buffer.len);
+
+    return params.Bind(JSONBOID, p, (int)buffer.len, FORMAT_BINARY);
+}
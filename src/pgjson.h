@@ -0,0 +1,17 @@
+
+#ifndef PGJSON_H
+#define PGJSON_H
+
+// Converts json and jsonb values to and from Python objects without going through the json
+// module.
+
+struct Params;
+
+PyObject* JSON_Parse(const char* p, Py_ssize_t len);
+// Parses JSON text into dicts, lists, strs, ints, floats, bools, and None, the same as
+// json.loads.  Numbers with a fraction or exponent are floats.
+
+bool BindJSON(Params& params, PyObject* param);
+// Serializes a dict, list, or tuple and binds it as jsonb.
+
+#endif // PGJSON_H
@@ -3,6 +3,12 @@
 #include "connection.h"
 #include "resultset.h"
 #include "row.h"
+#include "stream.h"
+#include "cursor.h"
+#include "pool.h"
+#include "copy.h"
+#include "parallel.h"
+#include "columnbuffer.h"
 #include "datatypes.h"
 #include "getdata.h"
 #include "params.h"
@@ -63,24 +69,7 @@ static PyObject* mod_connect(PyObject* self, PyObject* args, PyObject* kwargs)
     if (!PyArg_ParseTuple(args, "s", &conninfo))
         return 0;
 
-    PGconn* pgconn;
-    Py_BEGIN_ALLOW_THREADS
-    pgconn = PQconnectdb(conninfo);
-    Py_END_ALLOW_THREADS
-    if (pgconn == 0)
-        return PyErr_NoMemory();
-
-    if (PQstatus(pgconn) != CONNECTION_OK)
-    {
-        const char* szError = PQerrorMessage(pgconn);
-        PyErr_SetString(Error, szError);
-        Py_BEGIN_ALLOW_THREADS
-        PQfinish(pgconn);
-        Py_END_ALLOW_THREADS
-        return 0;
-    }
-
-    return Connection_New(pgconn, false);
+    return Connection_Connect(conninfo);
 }
 
 static PyObject* mod_async_connect(PyObject* self, PyObject* args, PyObject* kwargs)
@@ -124,6 +113,7 @@ static PyMethodDef pglib_methods[] =
     { "connect",  (PyCFunction)mod_connect,  METH_VARARGS, connect_doc },
     { "async_connect",  (PyCFunction)mod_async_connect,  METH_VARARGS, connect_doc },
     { "defaults", (PyCFunction)mod_defaults, METH_NOARGS,  doc_defaults },
+    { "parallel_copy", (PyCFunction)mod_parallel_copy, METH_VARARGS | METH_KEYWORDS, doc_parallel_copy },
     { 0, 0, 0, 0 }
 };
 
@@ -183,7 +173,9 @@ PyMODINIT_FUNC PyInit__pglib()
         return 0;
     }
 
-    if (PyType_Ready(&ConnectionType) < 0 || PyType_Ready(&ResultSetType) < 0 || PyType_Ready(&RowType) < 0)
+    if (PyType_Ready(&ConnectionType) < 0 || PyType_Ready(&ResultSetType) < 0 || PyType_Ready(&RowType) < 0 ||
+        PyType_Ready(&StreamType) < 0 || PyType_Ready(&CursorType) < 0 ||
+        PyType_Ready(&PoolType) < 0 || PyType_Ready(&CopyOutType) < 0 || PyType_Ready(&ColumnBufferType) < 0)
         return 0;
 
     if (!DataTypes_Init())
@@ -220,6 +212,16 @@ PyMODINIT_FUNC PyInit__pglib()
     Py_INCREF((PyObject*)&RowType);
     PyModule_AddObject(module, "ResultSet", (PyObject*)&ResultSetType);
     Py_INCREF((PyObject*)&ResultSetType);
+    PyModule_AddObject(module, "Stream", (PyObject*)&StreamType);
+    Py_INCREF((PyObject*)&StreamType);
+    PyModule_AddObject(module, "Cursor", (PyObject*)&CursorType);
+    Py_INCREF((PyObject*)&CursorType);
+    PyModule_AddObject(module, "Pool", (PyObject*)&PoolType);
+    Py_INCREF((PyObject*)&PoolType);
+    PyModule_AddObject(module, "CopyOut", (PyObject*)&CopyOutType);
+    Py_INCREF((PyObject*)&CopyOutType);
+    PyModule_AddObject(module, "ColumnBuffer", (PyObject*)&ColumnBufferType);
+    Py_INCREF((PyObject*)&ColumnBufferType);
 
     return module.Detach();
 }
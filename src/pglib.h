@@ -41,6 +41,7 @@ extern "C"
 inline void UNUSED(...) { }
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
+#define MIN(a,b) (((a)<(b))?(a):(b))
 
 extern PyObject* Error;
 
@@ -62,11 +63,16 @@ extern PyObject* Error;
 #define INT8ARRAYOID    1016
 #define INT8OID         20
 #define INTERVALOID		1186
+#define JSONBOID        3802
+#define JSONOID         114
+#define NAMEOID         19
 #define NUMERICOID      1700
 #define TEXTARRAYOID    1009
 #define TEXTOID         25
 #define TIMEOID         1083
 #define TIMESTAMPOID    1114
+#define TIMESTAMPTZOID  1184
+#define TIMETZOID       1266
 #define UUIDOID         2950
 #define VARCHAROID      1043
 
@@ -0,0 +1,575 @@
+
+// A thread-safe pool of synchronous connections.
+//
+// The pool's state is protected by a mutex instead of the GIL so threads waiting for a
+// connection can do so with the GIL released.  The mutex is never held while acquiring the
+// GIL or calling into libpq, and reference counts are only changed while holding the GIL.
+//
+// `cTotal` counts every connection the pool is responsible for: idle ones, checked out ones,
+// and those being opened.  A checked out connection holds a reference to its pool so that if
+// it is freed without being released we can still give its slot back.
+
+#include "pglib.h"
+#include "pool.h"
+#include "connection.h"
+#include "errors.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+struct ConnectionPool
+{
+    PyObject_HEAD
+
+    PyObject* conninfo;
+    // A bytes object holding the UTF-8 connection string.
+
+    int min_idle;
+    int max_idle;
+    int max_size;
+    // The maximum number of connections open at once, or zero for no limit.
+
+    std::mutex* mutex;
+    std::condition_variable* cond;
+    // Signaled whenever a connection is returned or a slot is freed.
+
+    // The following are protected by `mutex`.
+
+    Connection** idle;
+    int cIdle;
+    // Idle connections, most recently released last.  `idle` has room for max_idle entries and
+    // a reference is held to each.
+
+    int cTotal;
+    bool closed;
+
+    long long acquires;
+    long long waits;
+    long long timeouts;
+    long long discarded;
+    double wait_time;
+    double max_wait_time;
+    int peak_in_use;
+};
+
+static PyObject* OpenConnection(ConnectionPool* pool)
+{
+    return Connection_Connect(PyBytes_AS_STRING(pool->conninfo));
+}
+
+static Connection* PopIdle(ConnectionPool* pool)
+{
+    std::lock_guard<std::mutex> lock(*pool->mutex);
+    if (pool->cIdle == 0)
+        return 0;
+    pool->cTotal -= 1;
+    return pool->idle[--pool->cIdle];
+}
+
+static void CloseIdle(ConnectionPool* pool)
+{
+    // Closes all idle connections.  The connections are freed one at a time without holding
+    // the mutex since closing a connection releases the GIL.
+
+    Connection* cnxn;
+    while ((cnxn = PopIdle(pool)) != 0)
+        Py_DECREF(cnxn);
+}
+
+static void Refill(ConnectionPool* pool)
+{
+    // Opens connections until there are min_idle idle ones.  Called after a broken connection
+    // is dropped so the pool doesn't shrink below min_idle for good.  Each slot is reserved
+    // under the mutex and the connection is opened without it.  This is best effort: if a
+    // connection can't be opened the error is discarded and the next acquire will report it.
+
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(*pool->mutex);
+            if (pool->closed || pool->cIdle >= pool->min_idle || (pool->max_size != 0 && pool->cTotal >= pool->max_size))
+                return;
+            pool->cTotal += 1;
+        }
+
+        Connection* cnxn = (Connection*)OpenConnection(pool);
+
+        bool kept = false;
+        {
+            std::lock_guard<std::mutex> lock(*pool->mutex);
+            if (cnxn != 0 && !pool->closed && pool->cIdle < pool->max_idle)
+            {
+                pool->idle[pool->cIdle++] = cnxn;
+                kept = true;
+            }
+            else
+            {
+                pool->cTotal -= 1;
+            }
+            pool->cond->notify_one();
+        }
+
+        if (cnxn == 0)
+        {
+            PyErr_Clear();
+            return;
+        }
+
+        if (!kept)
+        {
+            Py_DECREF(cnxn);
+            return;
+        }
+    }
+}
+
+static bool Rollback(Connection* cnxn)
+{
+    ResultHolder result;
+    Py_BEGIN_ALLOW_THREADS
+    result = PQexec(cnxn->pgconn, "ROLLBACK");
+    Py_END_ALLOW_THREADS
+
+    return result != 0 && PQresultStatus(result) == PGRES_COMMAND_OK &&
+        PQtransactionStatus(cnxn->pgconn) == PQTRANS_IDLE;
+}
+
+static bool IsReusable(Connection* cnxn)
+{
+    // Determines whether a released connection can be given to someone else, rolling back any
+    // transaction that was left open.
+
+    if (cnxn->pgconn == 0 || PQstatus(cnxn->pgconn) != CONNECTION_OK)
+        return false;
+
+    switch (PQtransactionStatus(cnxn->pgconn))
+    {
+    case PQTRANS_IDLE:
+        return true;
+
+    case PQTRANS_INTRANS:
+    case PQTRANS_INERROR:
+        return Rollback(cnxn);
+
+    case PQTRANS_ACTIVE:
+        // A command is still running, such as an unfinished stream.
+    case PQTRANS_UNKNOWN:
+    default:
+        return false;
+    }
+}
+
+void Pool_ConnectionLost(PyObject* self)
+{
+    ConnectionPool* pool = (ConnectionPool*)self;
+    std::lock_guard<std::mutex> lock(*pool->mutex);
+    pool->cTotal -= 1;
+    pool->discarded += 1;
+    pool->cond->notify_one();
+}
+
+static PyObject* Pool_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    UNUSED(type);
+
+    static const char* kwlist[] = { "conninfo", "min_idle", "max_idle", "max_size", 0 };
+    const char* conninfo = 0;
+    int min_idle = 0;
+    int max_idle = 10;
+    int max_size = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|iii", (char**)kwlist, &conninfo, &min_idle, &max_idle, &max_size))
+        return 0;
+
+    if (min_idle < 0 || max_idle < min_idle)
+        return SetStringError(PyExc_ValueError, "Expected 0 <= min_idle <= max_idle");
+
+    if (max_size < 0 || (max_size != 0 && max_size < min_idle))
+        return SetStringError(PyExc_ValueError, "max_size must be zero (no limit) or at least min_idle");
+
+    ConnectionPool* pool = PyObject_NEW(ConnectionPool, &PoolType);
+    if (pool == 0)
+        return 0;
+
+    pool->conninfo      = 0;
+    pool->min_idle      = min_idle;
+    pool->max_idle      = max_idle;
+    pool->max_size      = max_size;
+    pool->mutex         = 0;
+    pool->cond          = 0;
+    pool->idle          = 0;
+    pool->cIdle         = 0;
+    pool->cTotal        = 0;
+    pool->closed        = false;
+    pool->acquires      = 0;
+    pool->waits         = 0;
+    pool->timeouts      = 0;
+    pool->discarded     = 0;
+    pool->wait_time     = 0;
+    pool->max_wait_time = 0;
+    pool->peak_in_use   = 0;
+
+    Object self((PyObject*)pool);
+
+    pool->conninfo = PyBytes_FromString(conninfo);
+    if (pool->conninfo == 0)
+        return 0;
+
+    pool->idle = (Connection**)malloc(sizeof(Connection*) * (max_idle ? max_idle : 1));
+    if (pool->idle == 0)
+        return PyErr_NoMemory();
+
+    pool->mutex = new (std::nothrow) std::mutex();
+    pool->cond  = new (std::nothrow) std::condition_variable();
+    if (pool->mutex == 0 || pool->cond == 0)
+        return PyErr_NoMemory();
+
+    // Nothing else can see the pool yet, so we don't need the mutex.
+    while (pool->cIdle < min_idle)
+    {
+        PyObject* cnxn = OpenConnection(pool);
+        if (cnxn == 0)
+            return 0;
+        pool->idle[pool->cIdle++] = (Connection*)cnxn;
+        pool->cTotal += 1;
+    }
+
+    return self.Detach();
+}
+
+static void Pool_dealloc(PyObject* self)
+{
+    ConnectionPool* pool = (ConnectionPool*)self;
+
+    // Checked out connections hold a reference to the pool, so only idle connections can be
+    // left.
+
+    if (pool->mutex)
+        CloseIdle(pool);
+
+    delete pool->cond;
+    delete pool->mutex;
+    free(pool->idle);
+    Py_XDECREF(pool->conninfo);
+
+    PyObject_Del(self);
+}
+
+static const char doc_acquire[] = "Pool.acquire(timeout=None) --> Connection\n"
+    "\n"
+    "Returns an idle connection from the pool, opening a new one if there are none and the\n"
+    "pool is not at max_size.  Otherwise waits up to `timeout` seconds for one to be released.";
+
+static PyObject* Pool_acquire(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = { "timeout", 0 };
+    double timeout = INFINITY;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|d", (char**)kwlist, &timeout))
+        return 0;
+
+    if (timeout < 0)
+        return SetStringError(PyExc_ValueError, "timeout cannot be negative");
+
+    ConnectionPool* pool = (ConnectionPool*)self;
+
+    enum { GOT_IDLE, MUST_CONNECT, TIMED_OUT, CLOSED } outcome;
+    Connection* cnxn = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    {
+        std::unique_lock<std::mutex> lock(*pool->mutex);
+
+        auto ready = [pool] {
+            return pool->closed || pool->cIdle > 0 || pool->max_size == 0 || pool->cTotal < pool->max_size;
+        };
+
+        bool available = ready();
+
+        if (!available && timeout > 0)
+        {
+            Clock::time_point start = Clock::now();
+
+            // Very long timeouts would overflow the clock, so treat them as no timeout.
+            if (timeout > 1e9)
+            {
+                pool->cond->wait(lock, ready);
+                available = true;
+            }
+            else
+            {
+                Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout));
+                available = pool->cond->wait_until(lock, deadline, ready);
+            }
+
+            double waited = std::chrono::duration<double>(Clock::now() - start).count();
+            pool->waits += 1;
+            pool->wait_time += waited;
+            if (waited > pool->max_wait_time)
+                pool->max_wait_time = waited;
+        }
+
+        if (!available)
+        {
+            outcome = TIMED_OUT;
+            pool->timeouts += 1;
+        }
+        else if (pool->closed)
+        {
+            outcome = CLOSED;
+        }
+        else
+        {
+            if (pool->cIdle > 0)
+            {
+                cnxn = pool->idle[--pool->cIdle];
+                outcome = GOT_IDLE;
+            }
+            else
+            {
+                pool->cTotal += 1;
+                outcome = MUST_CONNECT;
+            }
+
+            pool->acquires += 1;
+            int in_use = pool->cTotal - pool->cIdle;
+            if (in_use > pool->peak_in_use)
+                pool->peak_in_use = in_use;
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    if (outcome == CLOSED)
+        return SetStringError(Error, "The pool is closed");
+
+    if (outcome == TIMED_OUT)
+        return SetStringError(Error, "Timed out waiting for a connection");
+
+    if (outcome == GOT_IDLE && PQstatus(cnxn->pgconn) != CONNECTION_OK)
+    {
+        // The server closed it while it was idle.  Replace it, keeping its slot.
+        Py_DECREF(cnxn);
+        cnxn = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(*pool->mutex);
+            pool->discarded += 1;
+        }
+
+        // Other idle connections may have been closed by the server too, which acquire would
+        // find one at a time.
+        Refill(pool);
+    }
+
+    if (cnxn == 0)
+    {
+        cnxn = (Connection*)OpenConnection(pool);
+        if (cnxn == 0)
+        {
+            std::lock_guard<std::mutex> lock(*pool->mutex);
+            pool->cTotal -= 1;
+            pool->acquires -= 1;
+            pool->cond->notify_one();
+            return 0;
+        }
+    }
+
+    cnxn->pool = self;
+    Py_INCREF(self);
+
+    return reinterpret_cast<PyObject*>(cnxn);
+}
+
+static const char doc_release[] = "Pool.release(cnxn)\n"
+    "\n"
+    "Returns a connection to the pool.  Any open transaction is rolled back.  Broken\n"
+    "connections, and connections beyond max_idle, are closed.";
+
+static PyObject* Pool_release(PyObject* self, PyObject* arg)
+{
+    ConnectionPool* pool = (ConnectionPool*)self;
+
+    if (!PyObject_TypeCheck(arg, &ConnectionType))
+        return SetStringError(PyExc_TypeError, "Expected a Connection");
+
+    Connection* cnxn = (Connection*)arg;
+
+    if (cnxn->pool != self)
+        return SetStringError(Error, "The connection was not acquired from this pool");
+
+    bool reusable = IsReusable(cnxn);
+
+    // The caller's reference to the pool keeps it alive after we release the connection's.
+    cnxn->pool = 0;
+    Py_DECREF(self);
+
+    Py_INCREF(cnxn);
+
+    bool kept = false;
+    {
+        std::lock_guard<std::mutex> lock(*pool->mutex);
+
+        if (reusable && !pool->closed && pool->cIdle < pool->max_idle)
+        {
+            pool->idle[pool->cIdle++] = cnxn;
+            kept = true;
+        }
+        else
+        {
+            pool->cTotal -= 1;
+            if (!reusable)
+                pool->discarded += 1;
+        }
+
+        pool->cond->notify_one();
+    }
+
+    if (!kept)
+        Py_DECREF(cnxn);
+
+    if (!reusable)
+        Refill(pool);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* Pool_close(PyObject* self, PyObject* args)
+{
+    UNUSED(args);
+    ConnectionPool* pool = (ConnectionPool*)self;
+
+    {
+        std::lock_guard<std::mutex> lock(*pool->mutex);
+        pool->closed = true;
+        pool->cond->notify_all();
+    }
+
+    CloseIdle(pool);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* Pool_getcounter(ConnectionPool* self, void* closure)
+{
+    // The closure identifies the counter so we can read them all the same way under the
+    // mutex.
+
+    long long value = 0;
+    {
+        std::lock_guard<std::mutex> lock(*self->mutex);
+        switch ((intptr_t)closure)
+        {
+        case 0: value = self->cTotal; break;
+        case 1: value = self->cIdle; break;
+        case 2: value = self->cTotal - self->cIdle; break;
+        case 3: value = self->peak_in_use; break;
+        case 4: value = self->acquires; break;
+        case 5: value = self->waits; break;
+        case 6: value = self->timeouts; break;
+        case 7: value = self->discarded; break;
+        }
+    }
+    return PyLong_FromLongLong(value);
+}
+
+static PyObject* Pool_getwaittime(ConnectionPool* self, void* closure)
+{
+    UNUSED(closure);
+    double value;
+    {
+        std::lock_guard<std::mutex> lock(*self->mutex);
+        value = self->wait_time;
+    }
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject* Pool_getmaxwaittime(ConnectionPool* self, void* closure)
+{
+    UNUSED(closure);
+    double value;
+    {
+        std::lock_guard<std::mutex> lock(*self->mutex);
+        value = self->max_wait_time;
+    }
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject* Pool_getmaxsize(ConnectionPool* self, void* closure)
+{
+    UNUSED(closure);
+    return PyLong_FromLong(self->max_size);
+}
+
+static PyGetSetDef Pool_getsetters[] =
+{
+    { (char*)"size",          (getter)Pool_getcounter,     0, (char*)"the number of connections open or being opened", (void*)0 },
+    { (char*)"idle",          (getter)Pool_getcounter,     0, (char*)"the number of idle connections", (void*)1 },
+    { (char*)"in_use",        (getter)Pool_getcounter,     0, (char*)"the number of connections checked out", (void*)2 },
+    { (char*)"peak_in_use",   (getter)Pool_getcounter,     0, (char*)"the largest number of connections checked out at once", (void*)3 },
+    { (char*)"acquires",      (getter)Pool_getcounter,     0, (char*)"the number of successful calls to acquire", (void*)4 },
+    { (char*)"waits",         (getter)Pool_getcounter,     0, (char*)"the number of calls to acquire that had to wait", (void*)5 },
+    { (char*)"timeouts",      (getter)Pool_getcounter,     0, (char*)"the number of calls to acquire that timed out", (void*)6 },
+    { (char*)"discarded",     (getter)Pool_getcounter,     0, (char*)"the number of broken connections that were closed", (void*)7 },
+    { (char*)"wait_time",     (getter)Pool_getwaittime,    0, (char*)"the total seconds spent waiting in acquire", 0 },
+    { (char*)"max_wait_time", (getter)Pool_getmaxwaittime, 0, (char*)"the longest wait in acquire, in seconds", 0 },
+    { (char*)"max_size",      (getter)Pool_getmaxsize,     0, (char*)"the maximum number of connections, or zero for no limit", 0 },
+    { 0 }
+};
+
+static struct PyMethodDef Pool_methods[] =
+{
+    { "acquire", (PyCFunction)Pool_acquire, METH_VARARGS | METH_KEYWORDS, doc_acquire },
+    { "release", Pool_release,              METH_O,                       doc_release },
+    { "close",   Pool_close,                METH_NOARGS,                  "Closes idle connections and stops handing out new ones." },
+    { 0, 0, 0, 0 }
+};
+
+PyTypeObject PoolType =
+{
+    PyVarObject_HEAD_INIT(0, 0)
+    "pglib.Pool",               // tp_name
+    sizeof(ConnectionPool),     // tp_basicsize
+    0,                          // tp_itemsize
+    Pool_dealloc,               // destructor tp_dealloc
+    0,                          // tp_print
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_compare
+    0,                          // tp_repr
+    0,                          // tp_as_number
+    0,                          // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    0,                          // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,         // tp_flags
+    0,                          // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    0,                          // tp_iter
+    0,                          // tp_iternext
+    Pool_methods,               // tp_methods
+    0,                          // tp_members
+    Pool_getsetters,            // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    Pool_new,                   // tp_new
+    0,                          // tp_free
+    0,                          // tp_is_gc
+    0,                          // tp_bases
+    0,                          // tp_mro
+    0,                          // tp_cache
+    0,                          // tp_subclasses
+    0,                          // tp_weaklist
+};
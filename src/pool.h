@@ -0,0 +1,11 @@
+
+#ifndef POOL_H
+#define POOL_H
+
+extern PyTypeObject PoolType;
+
+void Pool_ConnectionLost(PyObject* pool);
+// Called when a connection checked out of `pool` is freed without being released so its slot
+// can be reused.
+
+#endif // POOL_H
@@ -3,9 +3,17 @@
 #include "resultset.h"
 #include "connection.h"
 #include "row.h"
+#include "getdata.h"
+#include "columnbuffer.h"
+#include "arrow.h"
+#include "writer.h"
+#include "errors.h"
 
 static PyObject* AllocateColumns(PGresult* result)
 {
+    // Returns a tuple of the column names.  The names are interned so looking up an attribute
+    // name, which Python has already interned, usually matches by identity.
+
     int count = PQnfields(result);
 
     Tuple cols(count);
@@ -18,32 +26,66 @@ static PyObject* AllocateColumns(PGresult* result)
         PyObject* col = PyUnicode_DecodeUTF8(szName, strlen(szName), 0);
         if (col == 0)
             return 0;
+        PyUnicode_InternInPlace(&col);
         cols.SetItem(i, col);
     }
 
     return cols.Detach();
 }
 
-static int* AllocateFormats(PGresult* result)
+static void FreePlan(PyObject* capsule)
 {
+    ColumnPlan* plan = (ColumnPlan*)PyCapsule_GetPointer(capsule, 0);
+    Py_XDECREF(plan->index);
+    free(plan);
+}
+
+static PyObject* AllocatePlan(PGresult* result, PyObject* columns, const DecodeOptions& options)
+{
+    // Returns a capsule holding the ColumnPlan.  Returns zero without an exception if there
+    // are no columns.
+
     int count = PQnfields(result);
     if (count == 0)
         return 0;
 
-    int* p = (int*)malloc(sizeof(int) * count);
-    if (p == 0)
+    Object index(PyDict_New());
+    if (!index)
+        return 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        Object position(PyLong_FromLong(i));
+        if (!position || PyDict_SetDefault(index, PyTuple_GET_ITEM(columns, i), position) == 0)
+            return 0;
+    }
+
+    // The decoders are allocated in the same block, after the plan.
+
+    ColumnPlan* plan = (ColumnPlan*)malloc(sizeof(ColumnPlan) + sizeof(Decoder) * count);
+    if (plan == 0)
     {
         PyErr_NoMemory();
         return 0;
     }
 
+    plan->index    = index.Detach();
+    plan->options  = options;
+    plan->decoders = (Decoder*)(plan + 1);
+
     for (int i = 0; i < count; i++)
-        p[i] = PQfformat(result, i);
+        plan->decoders[i] = GetDecoder(PQftype(result, i), PQfformat(result, i), options);
 
-    return p;
+    PyObject* capsule = PyCapsule_New(plan, 0, FreePlan);
+    if (capsule == 0)
+    {
+        Py_DECREF(plan->index);
+        free(plan);
+    }
+    return capsule;
 }
 
-PyObject* ResultSet_New(Connection* cnxn, PGresult* result)
+PyObject* ResultSet_New(Connection* cnxn, PGresult* result, PyObject* columns, PyObject* plan)
 {
     ResultSet* rset = PyObject_NEW(ResultSet, &ResultSetType);
     if (rset == 0)
@@ -53,10 +95,30 @@ PyObject* ResultSet_New(Connection* cnxn, PGresult* result)
     }
 
     rset->result            = result;
-    rset->formats           = AllocateFormats(result);
     rset->cFetched          = 0;
-    rset->columns           = AllocateColumns(result);
-    rset->integer_datetimes = cnxn->integer_datetimes;
+    rset->integer_datetimes = cnxn->decode.integer_datetimes;
+    rset->lazy              = cnxn->lazy_rows;
+    rset->lazy_rows         = 0;
+    rset->planobj           = 0;
+
+    // A shared plan built with different decode options, such as before numeric_as was
+    // changed, can't be used, so a new one is built.
+
+    if (columns && plan && ((ColumnPlan*)PyCapsule_GetPointer(plan, 0))->options == cnxn->decode)
+    {
+        rset->columns = columns;
+        Py_INCREF(columns);
+        rset->planobj = plan;
+        Py_INCREF(plan);
+    }
+    else
+    {
+        rset->columns = AllocateColumns(result);
+        if (rset->columns)
+            rset->planobj = AllocatePlan(result, rset->columns, cnxn->decode);
+    }
+
+    rset->plan = rset->planobj ? (ColumnPlan*)PyCapsule_GetPointer(rset->planobj, 0) : 0;
 
     if (PyErr_Occurred())
     {
@@ -70,12 +132,14 @@ PyObject* ResultSet_New(Connection* cnxn, PGresult* result)
 static void ResultSet_dealloc(PyObject* self)
 {
     ResultSet* rset = (ResultSet*)self;
+
+    if (rset->lazy_rows)
+        Row_MaterializeAll(rset);
+
     if (rset->result)
         PQclear(rset->result);
 
-    if (rset->formats)
-        free(rset->formats);
-
+    Py_XDECREF(rset->planobj);
     Py_XDECREF(rset->columns);
     PyObject_Del(self);
 }
@@ -118,6 +182,241 @@ static PyObject* ResultSet_item(PyObject* o, Py_ssize_t i)
     return Row_New(self, i);
 }
 
+static bool DecodeColumn(ResultSet* self, int iCol, PyObject* list)
+{
+    // Fills `list`, which must have one slot per row, with the values of column `iCol`.
+
+    PGresult* result = self->result;
+    Decoder decoder = self->plan->decoders[iCol];
+
+    for (int iRow = 0, cRows = PQntuples(result); iRow < cRows; iRow++)
+    {
+        PyObject* value = DecodeValue(result, iRow, iCol, decoder);
+        if (value == 0)
+            return false;
+        PyList_SET_ITEM(list, iRow, value);
+    }
+
+    return true;
+}
+
+static int ColumnFromKey(ResultSet* self, PyObject* key)
+{
+    // Returns the position of the column selected by `key`, which can be a name or a position
+    // counting from either end.  Returns -1 with an exception set if there is no such column.
+
+    int cCols = PQnfields(self->result);
+
+    if (PyUnicode_Check(key))
+    {
+        PyObject* position = self->plan ? PyDict_GetItemWithError(self->plan->index, key) : 0;
+        if (position == 0)
+        {
+            if (!PyErr_Occurred())
+                PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+        return (int)PyLong_AsLong(position);
+    }
+
+    if (PyIndex_Check(key))
+    {
+        Py_ssize_t iCol = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (iCol == -1 && PyErr_Occurred())
+            return -1;
+        if (iCol < 0)
+            iCol += cCols;
+        if (iCol < 0 || iCol >= cCols)
+        {
+            PyErr_Format(PyExc_IndexError, "Column %zd out of range.  ResultSet has %d columns", iCol, cCols);
+            return -1;
+        }
+        return (int)iCol;
+    }
+
+    PyErr_Format(PyExc_TypeError, "column must be an integer or column name, not %.200s", Py_TYPE(key)->tp_name);
+    return -1;
+}
+
+static PyObject* ResultSet_column(PyObject* o, PyObject* key)
+{
+    ResultSet* self = (ResultSet*)o;
+
+    int iCol = ColumnFromKey(self, key);
+    if (iCol == -1)
+        return 0;
+
+    List values(PQntuples(self->result));
+    if (!values || !DecodeColumn(self, iCol, values))
+        return 0;
+
+    return values.Detach();
+}
+
+static PyObject* ResultSet_column_buffer(PyObject* o, PyObject* key)
+{
+    ResultSet* self = (ResultSet*)o;
+
+    int iCol = ColumnFromKey(self, key);
+    if (iCol == -1)
+        return 0;
+
+    return ColumnBuffer_FromResult(self->result, iCol, self->integer_datetimes);
+}
+
+static PyObject* ResultSet_arrow_c_array(PyObject* o, PyObject* args, PyObject* kwargs)
+{
+    // The requested schema is optional and we can only produce one, so it is ignored.
+
+    static const char* kwlist[] = { "requested_schema", 0 };
+    PyObject* requested_schema = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", (char**)kwlist, &requested_schema))
+        return 0;
+
+    ResultSet* self = (ResultSet*)o;
+    return Arrow_ExportArray(self->result, self->integer_datetimes);
+}
+
+static PyObject* ResultSet_arrow_c_stream(PyObject* o, PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = { "requested_schema", 0 };
+    PyObject* requested_schema = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", (char**)kwlist, &requested_schema))
+        return 0;
+
+    ResultSet* self = (ResultSet*)o;
+    return Arrow_ExportStream(self->result, self->integer_datetimes);
+}
+
+static PyObject* ResultSet_write_csv(PyObject* o, PyObject* args, PyObject* kwargs)
+{
+    static const char* kwlist[] = { "dest", "header", "delimiter", 0 };
+
+    PyObject* dest;
+    int header = 0;
+    const char* delimiter = ",";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ps", (char**)kwlist, &dest, &header, &delimiter))
+        return 0;
+
+    if (strlen(delimiter) != 1 || delimiter[0] == '"' || delimiter[0] == '\n' || delimiter[0] == '\r' || (delimiter[0] & 0x80))
+        return SetStringError(PyExc_ValueError, "delimiter must be a single ASCII character other than a quote or line break");
+
+    WriteOptions options;
+    options.style     = WRITE_CSV;
+    options.header    = header != 0;
+    options.delimiter = delimiter[0];
+
+    ResultSet* self = (ResultSet*)o;
+    return Writer_Write(self->result, self->integer_datetimes, dest, options);
+}
+
+static PyObject* ResultSet_write_jsonl(PyObject* o, PyObject* dest)
+{
+    WriteOptions options;
+    options.style     = WRITE_JSONL;
+    options.header    = false;
+    options.delimiter = ',';
+
+    ResultSet* self = (ResultSet*)o;
+    return Writer_Write(self->result, self->integer_datetimes, dest, options);
+}
+
+static PyObject* ResultSet_columns_as_lists(PyObject* o, PyObject* args)
+{
+    UNUSED(args);
+
+    ResultSet* self = (ResultSet*)o;
+
+    int cCols = PQnfields(self->result);
+    int cRows = PQntuples(self->result);
+
+    List columns(cCols);
+    if (!columns)
+        return 0;
+
+    for (int iCol = 0; iCol < cCols; iCol++)
+    {
+        PyObject* values = PyList_New(cRows);
+        if (values == 0)
+            return 0;
+        PyList_SET_ITEM(columns.Get(), iCol, values);
+        if (!DecodeColumn(self, iCol, values))
+            return 0;
+    }
+
+    return columns.Detach();
+}
+
+static PyObject* ResultSet_tuples(PyObject* o, PyObject* args)
+{
+    UNUSED(args);
+
+    ResultSet* self = (ResultSet*)o;
+
+    PGresult* result = self->result;
+    int cCols = PQnfields(result);
+    int cRows = PQntuples(result);
+    Decoder* decoders = self->plan ? self->plan->decoders : 0;
+
+    List rows(cRows);
+    if (!rows)
+        return 0;
+
+    for (int iRow = 0; iRow < cRows; iRow++)
+    {
+        PyObject* row = PyTuple_New(cCols);
+        if (row == 0)
+            return 0;
+        PyList_SET_ITEM(rows.Get(), iRow, row);
+
+        for (int iCol = 0; iCol < cCols; iCol++)
+        {
+            PyObject* value = DecodeValue(result, iRow, iCol, decoders[iCol]);
+            if (value == 0)
+                return 0;
+            PyTuple_SET_ITEM(row, iCol, value);
+        }
+    }
+
+    return rows.Detach();
+}
+
+static PyObject* ResultSet_dicts(PyObject* o, PyObject* args)
+{
+    UNUSED(args);
+
+    ResultSet* self = (ResultSet*)o;
+
+    PGresult* result = self->result;
+    int cCols = PQnfields(result);
+    int cRows = PQntuples(result);
+    Decoder* decoders = self->plan ? self->plan->decoders : 0;
+
+    List rows(cRows);
+    if (!rows)
+        return 0;
+
+    for (int iRow = 0; iRow < cRows; iRow++)
+    {
+        PyObject* row = PyDict_New();
+        if (row == 0)
+            return 0;
+        PyList_SET_ITEM(rows.Get(), iRow, row);
+
+        for (int iCol = 0; iCol < cCols; iCol++)
+        {
+            // Use the first column with a name, like Row does.
+            PyObject* name = PyTuple_GET_ITEM(self->columns, iCol);
+
+            Object value(DecodeValue(result, iRow, iCol, decoders[iCol]));
+            if (!value || PyDict_SetDefault(row, name, value) == 0)
+                return 0;
+        }
+    }
+
+    return rows.Detach();
+}
+
 static PyObject* ResultSet_getcolumns(ResultSet* self, void* closure)
 {
     UNUSED(closure);
@@ -146,6 +445,69 @@ static PyGetSetDef ResultSet_getsetters[] =
     { 0 }
 };
 
+static const char doc_column[] =
+    "ResultSet.column(index_or_name) --> list\n"
+    "\n"
+    "Returns a list of the values of one column, selected by position or by name.";
+
+static const char doc_column_buffer[] =
+    "ResultSet.column_buffer(index_or_name) --> ColumnBuffer\n"
+    "\n"
+    "Returns the values of a fixed-width column as a native array supporting the buffer\n"
+    "protocol, without creating a Python object for each value.";
+
+static const char doc_columns_as_lists[] =
+    "ResultSet.columns_as_lists() --> list of lists\n"
+    "\n"
+    "Returns a list for each column holding that column's values.";
+
+static const char doc_tuples[] =
+    "ResultSet.tuples() --> list of tuples\n"
+    "\n"
+    "Returns all rows as tuples.";
+
+static const char doc_dicts[] =
+    "ResultSet.dicts() --> list of dicts\n"
+    "\n"
+    "Returns all rows as dictionaries mapping column names to values.";
+
+static const char doc_arrow_c_array[] =
+    "ResultSet.__arrow_c_array__(requested_schema=None) --> (schema capsule, array capsule)\n"
+    "\n"
+    "Exports the result as an Arrow struct array using the Arrow PyCapsule interface.";
+
+static const char doc_arrow_c_stream[] =
+    "ResultSet.__arrow_c_stream__(requested_schema=None) --> stream capsule\n"
+    "\n"
+    "Exports the result as an Arrow stream with a single batch using the Arrow PyCapsule\n"
+    "interface.";
+
+static const char doc_write_csv[] =
+    "ResultSet.write_csv(dest, header=False, delimiter=',') --> int\n"
+    "\n"
+    "Writes the rows as CSV to a file descriptor or an object with a write method and returns\n"
+    "the number of rows written.  Values are formatted the same way COPY formats them.";
+
+static const char doc_write_jsonl[] =
+    "ResultSet.write_jsonl(dest) --> int\n"
+    "\n"
+    "Writes each row as a JSON object on its own line to a file descriptor or an object with a\n"
+    "write method and returns the number of rows written.";
+
+static PyMethodDef ResultSet_methods[] =
+{
+    { "column",           ResultSet_column,           METH_O,      doc_column },
+    { "column_buffer",    ResultSet_column_buffer,    METH_O,      doc_column_buffer },
+    { "columns_as_lists", ResultSet_columns_as_lists, METH_NOARGS, doc_columns_as_lists },
+    { "tuples",           ResultSet_tuples,           METH_NOARGS, doc_tuples },
+    { "dicts",            ResultSet_dicts,            METH_NOARGS, doc_dicts },
+    { "write_csv",        (PyCFunction)ResultSet_write_csv, METH_VARARGS | METH_KEYWORDS, doc_write_csv },
+    { "write_jsonl",      ResultSet_write_jsonl,      METH_O,      doc_write_jsonl },
+    { "__arrow_c_array__",  (PyCFunction)ResultSet_arrow_c_array,  METH_VARARGS | METH_KEYWORDS, doc_arrow_c_array },
+    { "__arrow_c_stream__", (PyCFunction)ResultSet_arrow_c_stream, METH_VARARGS | METH_KEYWORDS, doc_arrow_c_stream },
+    { 0, 0, 0, 0 }
+};
+
 static PySequenceMethods rset_as_sequence =
 {
     ResultSet_length,           // sq_length
@@ -187,7 +549,7 @@ PyTypeObject ResultSetType =
     0,                          // tp_weaklistoffset
     ResultSet_iter,             // tp_iter
     ResultSet_iternext,         // tp_iternext
-    0, // ResultSet_methods,         // tp_methods
+    ResultSet_methods,          // tp_methods
     0, // ResultSet_members,                          // tp_members
     ResultSet_getsetters,        // tp_getset
     0,                          // tp_base
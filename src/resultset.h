@@ -2,7 +2,29 @@
 #ifndef RESULTSET_H
 #define RESULTSET_H
 
+#include "getdata.h"
+
 struct Connection;
+struct Row;
+
+struct ColumnPlan
+{
+    // How to read each column of a result.  This is built from the first result of a query
+    // and shared, in a capsule, with the statement cache, cursors, and streams so later
+    // results of the same query can reuse it.
+
+    PyObject* index;
+    // A dict mapping each interned column name to its position, shared by all rows.  If a name
+    // is used more than once, it maps to the first column.
+
+    DecodeOptions options;
+    // The connection's options when the plan was built.
+
+    Decoder* decoders;
+    // The function used to convert each column's values, chosen from the column's type and
+    // format.  I don't know why yet, but PostgreSQL can send columns in text even if you ask
+    // for binary, so the format is part of the choice.
+};
 
 extern PyTypeObject ResultSetType;
 
@@ -12,11 +34,10 @@ struct ResultSet
 
     PGresult* result;
 
-    int* formats;
-    // An array containing a format type for each column.  The type can be 0
-    // (text) or 1 (binary).  I don't know why yet, but PostgreSQL can send
-    // columns in text even if you ask for binary.  (I may punt and always ask
-    // for text since I have to handle every OID's text format anyway.)
+    ColumnPlan* plan;
+
+    PyObject* planobj;
+    // The capsule that owns `plan`.  Will be 0 if there are no columns.
 
     PyObject* columns;
     // A tuple of column names, shared among rows.  Will be 0 if there are no column names.
@@ -26,8 +47,19 @@ struct ResultSet
     bool integer_datetimes;
     // Obtained from the connection, but needed when reading timestamps at which time we won't have access to the
     // connection.
+
+    bool lazy;
+    // If true, rows convert each value the first time it is accessed.  Defaults to the
+    // connection's lazy_rows setting.
+
+    Row* lazy_rows;
+    // The head of a list of lazy rows that still need this ResultSet.
 };
 
-PyObject* ResultSet_New(Connection* cnxn, PGresult* result);
+PyObject* ResultSet_New(Connection* cnxn, PGresult* result, PyObject* columns = 0, PyObject* plan = 0);
+// Creates a ResultSet that takes ownership of `result`.
+//
+// If `columns` and `plan` are passed (from a cached prepared statement), they are shared
+// instead of being built from the result.
 
 #endif // RESULTSET_H
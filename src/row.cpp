@@ -4,52 +4,201 @@
 #include "getdata.h"
 #include "resultset.h"
 
-PyObject* Row_New(ResultSet* rset, int iRow)
+// Rows are allocated and freed once per fetched row, so freed rows are kept in a small freelist
+// for each column count and reused.  The lists are protected by the GIL.
+
+const int FREELIST_MAX_COLUMNS = 32;
+const int FREELIST_MAX_ROWS    = 64;
+
+static Row* freelist[FREELIST_MAX_COLUMNS + 1];
+static int  freelist_count[FREELIST_MAX_COLUMNS + 1];
+
+static Row* AllocateRow(Py_ssize_t cCols)
 {
-    I(rset->columns != 0);
+    if (cCols <= FREELIST_MAX_COLUMNS && freelist[cCols])
+    {
+        Row* row = freelist[cCols];
+        freelist[cCols] = row->next;
+        freelist_count[cCols]--;
+        return (Row*)PyObject_InitVar((PyVarObject*)row, &RowType, cCols);
+    }
 
-    int cCols = PyTuple_GET_SIZE(rset->columns);
-    Tuple values(cCols);
-    if (!values)
-        return 0;
+    return PyObject_NewVar(Row, &RowType, cCols);
+}
 
-    for (int i = 0; i < cCols; i++)
+static void FreeRow(Row* row)
+{
+    Py_ssize_t cCols = Py_SIZE(row);
+    if (cCols <= FREELIST_MAX_COLUMNS && freelist_count[cCols] < FREELIST_MAX_ROWS)
     {
-        PyObject* value = ConvertValue(rset->result, iRow, i, rset->integer_datetimes,
-                                       rset->formats[i]);
-        if (value == 0)
-            return 0;
-        values.SetItem(i, value);
+        row->next = freelist[cCols];
+        freelist[cCols] = row;
+        freelist_count[cCols]++;
+        return;
     }
 
-    Row* self = PyObject_NEW(Row, &RowType);
+    PyObject_Del(row);
+}
+
+static void Link(Row* row, ResultSet* rset)
+{
+    row->rset = rset;
+    row->prev = 0;
+    row->next = rset->lazy_rows;
+    if (row->next)
+        row->next->prev = row;
+    rset->lazy_rows = row;
+}
+
+static void Unlink(Row* row)
+{
+    if (row->prev)
+        row->prev->next = row->next;
+    else
+        row->rset->lazy_rows = row->next;
+
+    if (row->next)
+        row->next->prev = row->prev;
+
+    row->rset = 0;
+    row->prev = 0;
+    row->next = 0;
+}
+
+PyObject* Row_New(ResultSet* rset, int iRow)
+{
+    I(rset->columns != 0);
+
+    Py_ssize_t cCols = PyTuple_GET_SIZE(rset->columns);
+
+    Row* self = AllocateRow(cCols);
     if (self == 0)
         return 0;
 
     self->columns = rset->columns;
     Py_INCREF(self->columns);
 
-    self->values = values.Detach();
+    self->index = rset->plan ? rset->plan->index : 0;
+    Py_XINCREF(self->index);
+
+    self->iRow = iRow;
+    self->rset = 0;
+    self->prev = 0;
+    self->next = 0;
+
+    for (Py_ssize_t i = 0; i < cCols; i++)
+        self->values[i] = 0;
+
+    if (rset->lazy)
+    {
+        if (cCols != 0)
+            Link(self, rset);
+        return (PyObject*)self;
+    }
+
+    PGresult* result = rset->result;
+    Decoder* decoders = rset->plan ? rset->plan->decoders : 0;
+
+    for (Py_ssize_t i = 0; i < cCols; i++)
+    {
+        PyObject* value = DecodeValue(result, iRow, (int)i, decoders[i]);
+        if (value == 0)
+        {
+            Py_DECREF(self);
+            return 0;
+        }
+        self->values[i] = value;
+    }
 
     return (PyObject*)self;
 }
 
+static PyObject* GetValue(Row* self, Py_ssize_t i)
+{
+    // Returns a borrowed reference to the value of column `i`, converting it first if this is
+    // a lazy row and it hasn't been yet.
+
+    PyObject* value = self->values[i];
+    if (value == 0)
+    {
+        ResultSet* rset = self->rset;
+        value = DecodeValue(rset->result, self->iRow, (int)i, rset->plan->decoders[i]);
+        if (value == 0)
+            return 0;
+        self->values[i] = value;
+    }
+    return value;
+}
+
+static bool Materialize(Row* self)
+{
+    // Converts any remaining values of a lazy row and detaches it from its ResultSet.
+
+    if (self->rset == 0)
+        return true;
+
+    for (Py_ssize_t i = 0, c = Py_SIZE(self); i < c; i++)
+        if (GetValue(self, i) == 0)
+            return false;
+
+    Unlink(self);
+    return true;
+}
+
+void Row_MaterializeAll(ResultSet* rset)
+{
+    // We are called from the ResultSet's dealloc, which may be running while an exception is
+    // being raised, so the current exception is saved.  A value that cannot be converted here
+    // has nowhere to report the error, so it is reported as unraisable and replaced with None.
+
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+
+    while (rset->lazy_rows)
+    {
+        Row* row = rset->lazy_rows;
+
+        for (Py_ssize_t i = 0, c = Py_SIZE(row); i < c; i++)
+        {
+            if (GetValue(row, i) == 0)
+            {
+                PyErr_WriteUnraisable((PyObject*)row);
+                Py_INCREF(Py_None);
+                row->values[i] = Py_None;
+            }
+        }
+
+        Unlink(row);
+    }
+
+    PyErr_Restore(type, value, tb);
+}
+
 static void Row_dealloc(PyObject* self)
 {
     Row* row = reinterpret_cast<Row*>(self);
+    if (row->rset)
+        Unlink(row);
     Py_DECREF(row->columns);
-    Py_DECREF(row->values);
-    PyObject_Del(self);
+    Py_XDECREF(row->index);
+    for (Py_ssize_t i = 0, c = Py_SIZE(row); i < c; i++)
+        Py_XDECREF(row->values[i]);
+    FreeRow(row);
 }
 
 inline int ColumnFromName(Row* self, PyObject* name)
 {
-    // Returns the column index from a column name.  Returns -1 if not found.
+    // Returns the column index from a column name.  Returns -1 if not found or if an error
+    // occurred, so check PyErr_Occurred.
+
+    if (self->index == 0)
+        return -1;
+
+    PyObject* position = PyDict_GetItemWithError(self->index, name);
+    if (position == 0)
+        return -1;
 
-    for (int i = 0, c = PyTuple_GET_SIZE(self->columns); i < c; i++)
-        if (PyUnicode_Compare(name, PyTuple_GET_ITEM(self->columns, i)) == 0)
-            return i;
-    return -1;
+    return (int)PyLong_AsLong(position);
 }
 
 
@@ -64,10 +213,12 @@ static PyObject* Row_getattro(PyObject* o, PyObject* name)
         int iCol = ColumnFromName(self, name);
         if (iCol != -1)
         {
-            PyObject* value = PyTuple_GET_ITEM(self->values, iCol);
-            Py_INCREF(value);
+            PyObject* value = GetValue(self, iCol);
+            Py_XINCREF(value);
             return value;
         }
+        if (PyErr_Occurred())
+            return 0;
     }
 
     return PyObject_GenericGetAttr(o, name);
@@ -104,33 +255,48 @@ static PyObject* Row_item(PyObject* o, Py_ssize_t i)
 
     Row* self = (Row*)o;
 
-    if (i < 0 || i >= PyTuple_GET_SIZE(self->values))
+    if (i < 0 || i >= Py_SIZE(self))
     {
         PyErr_SetString(PyExc_IndexError, "tuple index out of range");
         return NULL;
     }
 
-    PyObject* value = PyTuple_GetItem(self->values, i);
-    Py_INCREF(value);
+    PyObject* value = GetValue(self, i);
+    Py_XINCREF(value);
     return value;
 }
 
+static int SetValue(Row* self, Py_ssize_t i, PyObject* v)
+{
+    if (v == 0)
+    {
+        PyErr_SetString(Error, "Cannot delete values from a row");
+        return -1;
+    }
+
+    if (!Materialize(self))
+        return -1;
+
+    PyObject* old = self->values[i];
+    Py_INCREF(v);
+    self->values[i] = v;
+    Py_DECREF(old);
+    return 0;
+}
+
 static int Row_assign(PyObject* o, Py_ssize_t i, PyObject* v)
 {
     // Implements row[i] = value.
 
     Row* self = (Row*)o;
 
-    if (i < 0 || i >= PyTuple_GET_SIZE(self->values))
+    if (i < 0 || i >= Py_SIZE(self))
     {
         PyErr_SetString(PyExc_IndexError, "Row assignment index out of range");
         return -1;
     }
 
-    Py_DECREF(PyTuple_GET_ITEM(self->values, i));
-    PyTuple_SET_ITEM(self->values, i, v);
-    Py_INCREF(v);
-    return 0;
+    return SetValue(self, i, v);
 }
 
 
@@ -141,80 +307,210 @@ static int Row_setattro(PyObject* o, PyObject *name, PyObject* v)
     int i = ColumnFromName(self, name);
     if (i == -1)
     {
-        PyErr_SetString(Error, "Cannot add columns or attributes to a row");
+        if (!PyErr_Occurred())
+            PyErr_SetString(Error, "Cannot add columns or attributes to a row");
         return -1;
     }
 
-    Py_DECREF(PyTuple_GET_ITEM(self->values, i));
-    PyTuple_SET_ITEM(self->values, i, v);
-    Py_INCREF(v);
-    return 0;
+    return SetValue(self, i, v);
+}
+
+static PyObject* Slice(Row* self, Py_ssize_t start, Py_ssize_t step, Py_ssize_t count)
+{
+    // Returns a tuple of `count` values starting at `start`.
+
+    Tuple values(count);
+    if (!values)
+        return 0;
+
+    for (Py_ssize_t i = 0, iCol = start; i < count; i++, iCol += step)
+    {
+        PyObject* value = GetValue(self, iCol);
+        if (value == 0)
+            return 0;
+        Py_INCREF(value);
+        values.SetItem(i, value);
+    }
+
+    return values.Detach();
 }
 
 static PyObject* Row_repr(PyObject* o)
 {
     Row* self = (Row*)o;
-    return PyObject_Repr(self->values);
+    Object values(Slice(self, 0, 1, Py_SIZE(self)));
+    if (!values)
+        return 0;
+    return PyObject_Repr(values);
+}
+
+static bool GetItems(PyObject* o, PyObject**& items, Py_ssize_t& count)
+{
+    // Used by the comparison functions to read either a Row or a tuple.  Returns false if `o`
+    // is neither or if a lazy row's values could not be converted.  Check PyErr_Occurred.
+
+    if (Row_Check(o))
+    {
+        Row* row = (Row*)o;
+        if (!Materialize(row))
+            return false;
+        items = row->values;
+        count = Py_SIZE(row);
+        return true;
+    }
+
+    if (PyTuple_Check(o))
+    {
+        items = &PyTuple_GET_ITEM(o, 0);
+        count = PyTuple_GET_SIZE(o);
+        return true;
+    }
+
+    return false;
 }
 
-/*
 static PyObject* Row_richcompare(PyObject* olhs, PyObject* orhs, int op)
 {
-    if (!Row_Check(olhs) || !Row_Check(orhs))
+    // Compares with another Row or a tuple using the same rules as tuples, so rows can be
+    // sorted and compared with literal tuples in tests.
+
+    PyObject** lhs;
+    PyObject** rhs;
+    Py_ssize_t cLhs, cRhs;
+
+    if (!GetItems(olhs, lhs, cLhs) || !GetItems(orhs, rhs, cRhs))
     {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+        if (PyErr_Occurred())
+            return 0;
+        Py_RETURN_NOTIMPLEMENTED;
     }
 
-    Row* lhs = (Row*)olhs;
-    Row* rhs = (Row*)orhs;
+    // Find the first item that is not equal.  An item's __eq__ could replace a value in a row,
+    // so hold references to the items while comparing them.
 
-    if (lhs->cValues != rhs->cValues)
+    Py_ssize_t i = 0;
+    for (; i < cLhs && i < cRhs; i++)
     {
-        // Different sizes, so use the same rules as the tuple class.
-        bool result;
-        switch (op)
+        if (lhs[i] == rhs[i])
+            continue;
+
+        Object left, right;
+        left.AttachAndIncrement(lhs[i]);
+        right.AttachAndIncrement(rhs[i]);
+
+        int equal = PyObject_RichCompareBool(left, right, Py_EQ);
+        if (equal == -1)
+            return 0;
+        if (!equal)
         {
-        case Py_EQ: result = (lhs->cValues == rhs->cValues); break;
-        case Py_GE: result = (lhs->cValues >= rhs->cValues); break;
-        case Py_GT: result = (lhs->cValues >  rhs->cValues); break;
-        case Py_LE: result = (lhs->cValues <= rhs->cValues); break;
-        case Py_LT: result = (lhs->cValues <  rhs->cValues); break;
-        case Py_NE: result = (lhs->cValues != rhs->cValues); break;
-        default:
-            // Can't get here, but don't have a cross-compiler way to silence this.
-            result = false;
+            if (op == Py_EQ)
+                Py_RETURN_FALSE;
+            if (op == Py_NE)
+                Py_RETURN_TRUE;
+            return PyObject_RichCompare(left, right, op);
         }
-        PyObject* p = result ? Py_True : Py_False;
-        Py_INCREF(p);
-        return p;
     }
 
-    for (Py_ssize_t i = 0, c = lhs->cValues; i < c; i++)
-        if (!PyObject_RichCompareBool(lhs->values[i], rhs->values[i], Py_EQ))
-            return PyObject_RichCompare(lhs->values[i], rhs->values[i], op);
+    // One is a prefix of the other (or they are equal), so compare the lengths.
 
-    // All items are equal.
+    bool result;
     switch (op)
     {
-    case Py_EQ:
-    case Py_GE:
-    case Py_LE:
-        Py_RETURN_TRUE;
-
-    case Py_GT:
-    case Py_LT:
-    case Py_NE:
-        break;
+    case Py_EQ: result = (cLhs == cRhs); break;
+    case Py_NE: result = (cLhs != cRhs); break;
+    case Py_LT: result = (cLhs <  cRhs); break;
+    case Py_LE: result = (cLhs <= cRhs); break;
+    case Py_GT: result = (cLhs >  cRhs); break;
+    case Py_GE: result = (cLhs >= cRhs); break;
+    default:
+        // Can't get here, but don't have a cross-compiler way to silence this.
+        result = false;
     }
 
+    if (result)
+        Py_RETURN_TRUE;
     Py_RETURN_FALSE;
 }
 
+static Py_hash_t Row_hash(PyObject* o)
+{
+    // Rows compare equal to tuples with the same values, so this must return the same hash as
+    // the tuple would.  This is the algorithm from CPython's tupleobject.c.
+
+    Row* self = (Row*)o;
+    if (!Materialize(self))
+        return -1;
+
+    Py_ssize_t len = Py_SIZE(self);
+
+#if PY_VERSION_HEX >= 0x03080000
+#if SIZEOF_PY_UHASH_T > 4
+    const Py_uhash_t PRIME_1 = 11400714785074694791ULL;
+    const Py_uhash_t PRIME_2 = 14029467366897019727ULL;
+    const Py_uhash_t PRIME_5 = 2870177450012600261ULL;
+#define ROTATE(x) ((x << 31) | (x >> 33))
+#else
+    const Py_uhash_t PRIME_1 = 2654435761UL;
+    const Py_uhash_t PRIME_2 = 2246822519UL;
+    const Py_uhash_t PRIME_5 = 374761393UL;
+#define ROTATE(x) ((x << 13) | (x >> 19))
+#endif
+
+    Py_uhash_t acc = PRIME_5;
+    for (Py_ssize_t i = 0; i < len; i++)
+    {
+        Py_uhash_t lane = PyObject_Hash(self->values[i]);
+        if (lane == (Py_uhash_t)-1)
+            return -1;
+        acc += lane * PRIME_2;
+        acc = ROTATE(acc);
+        acc *= PRIME_1;
+    }
+#undef ROTATE
+
+    acc += len ^ (PRIME_5 ^ 3527539UL);
+
+    if (acc == (Py_uhash_t)-1)
+        return 1546275796;
+    return (Py_hash_t)acc;
+#else
+    Py_uhash_t x = 0x345678UL;
+    Py_hash_t mult = _PyHASH_MULTIPLIER;
+    for (Py_ssize_t i = 0; i < len; i++)
+    {
+        Py_hash_t y = PyObject_Hash(self->values[i]);
+        if (y == -1)
+            return -1;
+        x = (x ^ y) * mult;
+        mult += (Py_hash_t)(82520UL + 2 * (len - i - 1));
+    }
+    x += 97531UL;
+    if (x == (Py_uhash_t)-1)
+        x = -2;
+    return (Py_hash_t)x;
+#endif
+}
 
 static PyObject* Row_subscript(PyObject* o, PyObject* key)
 {
-    Row* row = (Row*)o;
+    // Implements row[index] and row['name'].
+
+    Row* self = (Row*)o;
+
+    if (PyUnicode_Check(key))
+    {
+        int iCol = ColumnFromName(self, key);
+        if (iCol == -1)
+        {
+            if (!PyErr_Occurred())
+                PyErr_SetObject(PyExc_KeyError, key);
+            return 0;
+        }
+
+        PyObject* value = GetValue(self, iCol);
+        Py_XINCREF(value);
+        return value;
+    }
 
     if (PyIndex_Check(key))
     {
@@ -222,49 +518,44 @@ static PyObject* Row_subscript(PyObject* o, PyObject* key)
         if (i == -1 && PyErr_Occurred())
             return 0;
         if (i < 0)
-            i += row->cValues;
-
-        if (i < 0 || i >= row->cValues)
-            return PyErr_Format(PyExc_IndexError, "row index out of range index=%d len=%d", (int)i, (int)row->cValues);
-
-        Py_INCREF(row->values[i]);
-        return row->values[i];
+            i += Py_SIZE(self);
+        return Row_item(o, i);
     }
 
     if (PySlice_Check(key))
     {
-        Py_ssize_t start, stop, step, slicelength;
-#if PY_VERSION_HEX >= 0x03020000
-        if (PySlice_GetIndicesEx(key, row->cValues, &start, &stop, &step, &slicelength) < 0)
-            return 0;
-#else
-        if (PySlice_GetIndicesEx((PySliceObject*)key, row->cValues, &start, &stop, &step, &slicelength) < 0)
+        // Slices return tuples since a Row must have the same columns as its ResultSet.
+        Py_ssize_t start, stop, step, count;
+        if (PySlice_GetIndicesEx(key, Py_SIZE(self), &start, &stop, &step, &count) < 0)
             return 0;
-#endif
+        return Slice(self, start, step, count);
+    }
 
-        if (slicelength <= 0)
-            return PyTuple_New(0);
+    return PyErr_Format(PyExc_TypeError, "row indices must be integers, slices, or column names, not %.200s", Py_TYPE(key)->tp_name);
+}
 
-        if (start == 0 && step == 1 && slicelength == row->cValues)
-        {
-            Py_INCREF(o);
-            return o;
-        }
+static PyObject* Row_get(PyObject* o, PyObject* args)
+{
+    Row* self = (Row*)o;
 
-        Object result(PyTuple_New(slicelength));
-        if (!result)
+    PyObject* name;
+    PyObject* defaultValue = Py_None;
+    if (!PyArg_ParseTuple(args, "U|O", &name, &defaultValue))
+        return 0;
+
+    int iCol = ColumnFromName(self, name);
+    if (iCol == -1)
+    {
+        if (PyErr_Occurred())
             return 0;
-        for (Py_ssize_t i = 0, index = start; i < slicelength; i++, index += step)
-        {
-            PyTuple_SET_ITEM(result.Get(), i, row->values[index]);
-            Py_INCREF(row->values[index]);
-        }
-        return result.Detach();
+        Py_INCREF(defaultValue);
+        return defaultValue;
     }
 
-    return PyErr_Format(PyExc_TypeError, "row indices must be integers, not %.200s", Py_TYPE(key)->tp_name);
+    PyObject* value = GetValue(self, iCol);
+    Py_XINCREF(value);
+    return value;
 }
-*/
 
 static PyMemberDef Row_members[] = 
 {
@@ -294,18 +585,22 @@ static PySequenceMethods row_as_sequence =
     0, //Row_contains,               // sq_contains
 };
 
-/*
 static PyMappingMethods row_as_mapping =
 {
     Row_length,                 // mp_length
     Row_subscript,              // mp_subscript
     0,                          // mp_ass_subscript
 };
-*/
+
+static const char get_doc[] =
+    "Row.get(name, default=None) --> value\n"
+    "\n"
+    "Returns the value of the named column, or `default` if there is no such column.";
 
 static PyMethodDef Row_methods[] =
 {
     // { "__reduce__", (PyCFunction)Row_reduce, METH_NOARGS, 0 },
+    { "get", Row_get, METH_VARARGS, get_doc },
     { 0, 0, 0, 0 }
 };
 
@@ -328,6 +623,13 @@ static char row_doc[] =
     "  row = cursor.fetchone()\n"
     "  print row.customer_id, row.Name_With_Spaces\n"
     "\n"
+    "Values can also be read using the column name as an index, or with get:\n"
+    "\n"
+    "  print row['customer_id'], row.get('missing', 0)\n"
+    "\n"
+    "Rows compare and hash like tuples, so they can be sorted, used in sets, and used\n"
+    "as dictionary keys.  Slicing a row returns a tuple.\n"
+    "\n"
     "If using this non-standard feature, it is often convenient to specifiy the name\n"
     "using the SQL 'as' keyword:\n"
     "\n"
@@ -339,8 +641,8 @@ PyTypeObject RowType =
 {
     PyVarObject_HEAD_INIT(NULL, 0)
     "pglib.Row",                                            // tp_name
-    sizeof(Row),                                            // tp_basicsize
-    0,                                                      // tp_itemsize
+    offsetof(Row, values),                                  // tp_basicsize
+    sizeof(PyObject*),                                      // tp_itemsize
     Row_dealloc,                                            // tp_dealloc
     0,                                                      // tp_print
     0,                                                      // tp_getattr
@@ -349,8 +651,8 @@ PyTypeObject RowType =
     Row_repr,                                               // tp_repr
     0,                                                      // tp_as_number
     &row_as_sequence,                                       // tp_as_sequence
-    0, // &row_as_mapping,                                        // tp_as_mapping
-    0,                                                      // tp_hash
+    &row_as_mapping,                                        // tp_as_mapping
+    Row_hash,                                               // tp_hash
     0,                                                      // tp_call
     0,                                                      // tp_str
     Row_getattro,                                           // tp_getattro
@@ -360,7 +662,7 @@ PyTypeObject RowType =
     row_doc,                                                // tp_doc
     0,                                                      // tp_traverse
     0,                                                      // tp_clear
-    0, //Row_richcompare,                                        // tp_richcompare
+    Row_richcompare,                                        // tp_richcompare
     0,                                                      // tp_weaklistoffset
     0,                                                      // tp_iter
     0,                                                      // tp_iternext
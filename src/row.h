@@ -6,18 +6,42 @@ struct ResultSet;
 
 struct Row
 {
-    PyObject_HEAD
+    PyObject_VAR_HEAD
+    // ob_size is the number of columns.
 
     PyObject* columns;
     // The column names, shared with the ResultSet.
 
-    PyObject* values;
-    // The values converted to Python objects.
+    PyObject* index;
+    // The ColumnPlan's dict mapping each column name to its position, or zero if there are no
+    // columns.
+
+    ResultSet* rset;
+    // The ResultSet a lazy row converts its values from, or zero once every value has been
+    // converted.  This is not a reference.  Instead the ResultSet keeps a list of its lazy
+    // rows and converts their remaining values before it is freed.
+
+    int iRow;
+
+    Row* prev;
+    Row* next;
+    // Links in the ResultSet's list of lazy rows.  `next` also links rows in the freelist.
+
+    PyObject* values[1];
+    // The values converted to Python objects, allocated inline with ob_size items.  In a lazy
+    // row, an item is zero until its column is first accessed.  Always use GetValue instead of
+    // reading it directly.
 };
 
 extern PyTypeObject RowType;
 
 PyObject* Row_New(ResultSet* rset, int iRow);
+// Creates a Row for row `iRow` of `rset`.  If rset->lazy is set, the values are not converted
+// until they are accessed.
+
+void Row_MaterializeAll(ResultSet* rset);
+// Converts the remaining values of each of rset's lazy rows and detaches them.  Called when
+// the ResultSet is freed.
 
 #define Row_Check(op) PyObject_TypeCheck(op, &RowType)
 #define Row_CheckExact(op) (Py_TYPE(op) == &RowType)
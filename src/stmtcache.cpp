@@ -0,0 +1,250 @@
+
+#include "pglib.h"
+#include "connection.h"
+#include "stmtcache.h"
+#include "params.h"
+
+void StatementCache_Init(StatementCache* cache)
+{
+    cache->head     = 0;
+    cache->tail     = 0;
+    cache->count    = 0;
+    cache->capacity = 0;
+    cache->next_id  = 0;
+    cache->hits     = 0;
+    cache->misses   = 0;
+}
+
+static void Unlink(StatementCache* cache, Statement* stmt)
+{
+    if (stmt->prev)
+        stmt->prev->next = stmt->next;
+    else
+        cache->head = stmt->next;
+
+    if (stmt->next)
+        stmt->next->prev = stmt->prev;
+    else
+        cache->tail = stmt->prev;
+
+    stmt->prev = stmt->next = 0;
+    cache->count -= 1;
+}
+
+static void LinkAtHead(StatementCache* cache, Statement* stmt)
+{
+    stmt->prev = 0;
+    stmt->next = cache->head;
+    if (cache->head)
+        cache->head->prev = stmt;
+    cache->head = stmt;
+    if (cache->tail == 0)
+        cache->tail = stmt;
+    cache->count += 1;
+}
+
+static void Deallocate(Connection* cnxn, Statement* stmt)
+{
+    // Frees the statement on the server.  Errors are ignored - if the transaction is aborted
+    // the statement simply lives until the connection is closed.
+
+    char szSQL[40];
+    snprintf(szSQL, sizeof(szSQL), "DEALLOCATE %s", stmt->name);
+
+    Py_BEGIN_ALLOW_THREADS
+    PGresult* result = PQexec(cnxn->pgconn, szSQL);
+    if (result)
+        PQclear(result);
+    Py_END_ALLOW_THREADS
+}
+
+static void FreeStatement(Statement* stmt)
+{
+    Py_XDECREF(stmt->sql);
+    Py_XDECREF(stmt->columns);
+    Py_XDECREF(stmt->plan);
+    free(stmt->types);
+    free(stmt);
+}
+
+static void Remove(Connection* cnxn, Statement* stmt, bool deallocate)
+{
+    Unlink(&cnxn->stmtcache, stmt);
+    if (deallocate && cnxn->pgconn)
+        Deallocate(cnxn, stmt);
+    FreeStatement(stmt);
+}
+
+void StatementCache_Clear(Connection* cnxn, bool deallocate)
+{
+    while (cnxn->stmtcache.head)
+        Remove(cnxn, cnxn->stmtcache.head, deallocate);
+}
+
+void StatementCache_SetCapacity(Connection* cnxn, int capacity)
+{
+    StatementCache* cache = &cnxn->stmtcache;
+    cache->capacity = capacity;
+    while (cache->count > capacity)
+        Remove(cnxn, cache->tail, true);
+}
+
+static Statement* Find(StatementCache* cache, PyObject* sql, Py_hash_t hash, Params& params)
+{
+    for (Statement* stmt = cache->head; stmt != 0; stmt = stmt->next)
+    {
+        if (stmt->hash != hash || stmt->nparams != params.count)
+            continue;
+
+        if (params.count && memcmp(stmt->types, params.types, sizeof(Oid) * params.count) != 0)
+            continue;
+
+        if (stmt->sql == sql || PyUnicode_Compare(stmt->sql, sql) == 0)
+            return stmt;
+    }
+
+    return 0;
+}
+
+static Statement* Prepare(Connection* cnxn, PyObject* sql, Py_hash_t hash, Params& params, PGresult** presult)
+{
+    // Prepares a new statement on the server and adds it to the cache.  If the server returns
+    // an error, zero is returned and the error result is stored in *presult for the caller to
+    // report.
+
+    StatementCache* cache = &cnxn->stmtcache;
+
+    const char* szSQL = PyUnicode_AsUTF8(sql);
+    if (szSQL == 0)
+        return 0;
+
+    Statement* stmt = (Statement*)malloc(sizeof(Statement));
+    if (stmt == 0)
+    {
+        PyErr_NoMemory();
+        return 0;
+    }
+
+    stmt->prev = stmt->next = 0;
+    stmt->sql     = sql;
+    stmt->hash    = hash;
+    stmt->nparams = params.count;
+    stmt->types   = 0;
+    stmt->columns = 0;
+    stmt->plan = 0;
+    Py_INCREF(sql);
+
+    if (params.count)
+    {
+        stmt->types = (Oid*)malloc(sizeof(Oid) * params.count);
+        if (stmt->types == 0)
+        {
+            FreeStatement(stmt);
+            PyErr_NoMemory();
+            return 0;
+        }
+        memcpy(stmt->types, params.types, sizeof(Oid) * params.count);
+    }
+
+    snprintf(stmt->name, sizeof(stmt->name), "pglib_%u", cache->next_id++);
+
+    // Make room first so we never have more than `capacity` statements on the server.
+
+    while (cache->count >= cache->capacity && cache->tail)
+        Remove(cnxn, cache->tail, true);
+
+    PGresult* result;
+    Py_BEGIN_ALLOW_THREADS
+    result = PQprepare(cnxn->pgconn, stmt->name, szSQL, stmt->nparams, stmt->types);
+    Py_END_ALLOW_THREADS
+
+    if (result == 0)
+    {
+        FreeStatement(stmt);
+        PyErr_SetString(Error, "Fatal error");
+        return 0;
+    }
+
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+    {
+        FreeStatement(stmt);
+        *presult = result;
+        return 0;
+    }
+
+    PQclear(result);
+
+    LinkAtHead(cache, stmt);
+
+    return stmt;
+}
+
+static bool IsStaleStatementError(PGresult* result)
+{
+    // Returns true if the error means the prepared statement can no longer be used:
+    //
+    // 0A000: "cached plan must not change result type" after a table was altered.
+    // 26000: the statement no longer exists, e.g. after a DEALLOCATE ALL or DISCARD ALL.
+
+    ExecStatusType status = PQresultStatus(result);
+    if (status != PGRES_FATAL_ERROR && status != PGRES_NONFATAL_ERROR)
+        return false;
+
+    const char* szSQLSTATE = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+    return szSQLSTATE && (strcmp(szSQLSTATE, "0A000") == 0 || strcmp(szSQLSTATE, "26000") == 0);
+}
+
+PGresult* StatementCache_Execute(Connection* cnxn, PyObject* sql, Params& params, Statement** pstmt)
+{
+    StatementCache* cache = &cnxn->stmtcache;
+
+    *pstmt = 0;
+
+    Py_hash_t hash = PyObject_Hash(sql);
+    if (hash == -1)
+        return 0;
+
+    Statement* stmt = Find(cache, sql, hash, params);
+
+    if (stmt)
+    {
+        cache->hits += 1;
+
+        if (stmt != cache->head)
+        {
+            Unlink(cache, stmt);
+            LinkAtHead(cache, stmt);
+        }
+    }
+    else
+    {
+        cache->misses += 1;
+
+        PGresult* error = 0;
+        stmt = Prepare(cnxn, sql, hash, params, &error);
+        if (stmt == 0)
+            return error;
+    }
+
+    PGresult* result;
+    Py_BEGIN_ALLOW_THREADS
+    result = PQexecPrepared(cnxn->pgconn, stmt->name,
+                            params.count,
+                            params.values,
+                            params.lengths,
+                            params.formats,
+                            1); // binary format
+    Py_END_ALLOW_THREADS
+
+    if (result && IsStaleStatementError(result))
+    {
+        // Drop it so the next call prepares it again.  We don't retry here since we may be
+        // in a transaction which is now aborted.
+        Remove(cnxn, stmt, true);
+        stmt = 0;
+    }
+
+    *pstmt = stmt;
+
+    return result;
+}
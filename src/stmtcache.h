@@ -0,0 +1,67 @@
+
+#ifndef STMTCACHE_H
+#define STMTCACHE_H
+
+// A per-connection LRU cache of server-side prepared statements.  When enabled, execute, row,
+// and scalar prepare each distinct SQL statement once and then execute it by name, saving the
+// server from parsing and planning the same text over and over.
+
+struct Connection;
+struct Params;
+
+struct Statement
+{
+    Statement* prev;
+    Statement* next;
+    // The LRU list.  The most recently used statement is at the head.
+
+    PyObject* sql;
+    Py_hash_t hash;
+    // The SQL text and its hash.  Unicode objects cache their hash so this is cheap.
+
+    int nparams;
+    Oid* types;
+    // The parameter types the statement was prepared with.  BindLong chooses the smallest
+    // integer type that fits, so the same SQL can be prepared more than once.
+
+    char name[24];
+    // The server-side statement name: "pglib_<id>".
+
+    PyObject* columns;
+    PyObject* plan;
+    // Cached from the first result so ResultSet_New doesn't have to rebuild them.  These are
+    // zero until the statement has returned a result set.
+};
+
+struct StatementCache
+{
+    Statement* head;
+    Statement* tail;
+
+    int count;
+    int capacity;
+    // The maximum number of statements to keep prepared.  Zero disables the cache.
+
+    unsigned int next_id;
+
+    long hits;
+    long misses;
+};
+
+void StatementCache_Init(StatementCache* cache);
+
+void StatementCache_Clear(Connection* cnxn, bool deallocate);
+// Removes all statements from the cache.  If `deallocate` is true, each statement is also
+// deallocated on the server.  Pass false if the server has already forgotten them (e.g. after
+// a reset).
+
+void StatementCache_SetCapacity(Connection* cnxn, int capacity);
+
+PGresult* StatementCache_Execute(Connection* cnxn, PyObject* sql, Params& params, Statement** pstmt);
+// Executes `sql` using a cached prepared statement, preparing it first if necessary.  Returns
+// the result just like PQexecParams.  If the statement was executed, *pstmt is set to it so
+// the caller can use or populate the cached column information.
+//
+// This releases the GIL while talking to the server.
+
+#endif // STMTCACHE_H
@@ -0,0 +1,315 @@
+
+// An iterator over a query's rows that are read from the server in small chunks instead of
+// all at once.
+//
+// libpq normally collects the entire result before returning it.  In single-row mode (or
+// chunked mode, libpq 17+) PQgetResult instead returns a PGresult for each row (or chunk of
+// rows) as it arrives, followed by a final, empty PGRES_TUPLES_OK result.  We wrap each chunk
+// in a ResultSet that shares the column information from the first chunk, return its rows,
+// and then free it.
+
+#include "pglib.h"
+#include "stream.h"
+#include "connection.h"
+#include "resultset.h"
+#include "row.h"
+#include "errors.h"
+
+struct Stream
+{
+    PyObject_HEAD
+
+    Connection* cnxn;
+    // A reference is held.  This is set to zero once all results have been read.
+
+    ResultSet* rset;
+    // The current chunk, or zero.
+
+    int iRow;
+    // The next row to return from `rset`.
+
+    PyObject* columns;
+    PyObject* plan;
+    // Shared by all chunks.  Set from the first chunk.
+};
+
+static void DrainResults(Connection* cnxn)
+{
+    // Reads and discards any remaining results so the connection can be used again.
+
+    Py_BEGIN_ALLOW_THREADS
+    PGresult* result;
+    while ((result = PQgetResult(cnxn->pgconn)) != 0)
+        PQclear(result);
+    Py_END_ALLOW_THREADS
+}
+
+static void Finish(Stream* stream, bool cancel)
+{
+    // Called when we are done with the results.  If `cancel` is true, the server is asked to
+    // stop sending the remaining rows.
+
+    if (stream->cnxn == 0)
+        return;
+
+    if (cancel && stream->cnxn->pgconn)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        PGcancel* pgcancel = PQgetCancel(stream->cnxn->pgconn);
+        if (pgcancel)
+        {
+            char szErr[256];
+            PQcancel(pgcancel, szErr, sizeof(szErr));
+            PQfreeCancel(pgcancel);
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    if (stream->cnxn->pgconn)
+        DrainResults(stream->cnxn);
+
+    stream->cnxn->busy = false;
+    Py_CLEAR(stream->cnxn);
+}
+
+PyObject* Stream_New(Connection* cnxn, int chunk_rows)
+{
+    int ok;
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    if (chunk_rows > 1)
+        ok = PQsetChunkedRowsMode(cnxn->pgconn, chunk_rows);
+    else
+        ok = PQsetSingleRowMode(cnxn->pgconn);
+#else
+    UNUSED(chunk_rows);
+    ok = PQsetSingleRowMode(cnxn->pgconn);
+#endif
+
+    if (!ok)
+    {
+        SetConnectionError(cnxn);
+        DrainResults(cnxn);
+        return 0;
+    }
+
+    Stream* stream = PyObject_NEW(Stream, &StreamType);
+    if (stream == 0)
+    {
+        DrainResults(cnxn);
+        return 0;
+    }
+
+    stream->cnxn = cnxn;
+    Py_INCREF(cnxn);
+    cnxn->busy = true;
+    stream->rset    = 0;
+    stream->iRow    = 0;
+    stream->columns = 0;
+    stream->plan = 0;
+
+    return reinterpret_cast<PyObject*>(stream);
+}
+
+static void Stream_dealloc(PyObject* self)
+{
+    Stream* stream = (Stream*)self;
+
+    // If we were not iterated to the end, the server may still be sending rows.
+    Finish(stream, true);
+
+    Py_XDECREF(stream->rset);
+    Py_XDECREF(stream->columns);
+    Py_XDECREF(stream->plan);
+    PyObject_Del(self);
+}
+
+static PyObject* Stream_iter(PyObject* self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static bool NextChunk(Stream* stream)
+{
+    // Reads the next chunk of rows into stream->rset.  Returns false when there are no more
+    // rows or if an error occurs, in which case an exception will be set.
+
+    Py_CLEAR(stream->rset);
+    stream->iRow = 0;
+
+    if (stream->cnxn == 0)
+        return false;
+
+    for (;;)
+    {
+        PGresult* result;
+        Py_BEGIN_ALLOW_THREADS
+        result = PQgetResult(stream->cnxn->pgconn);
+        Py_END_ALLOW_THREADS
+
+        if (result == 0)
+        {
+            Finish(stream, false);
+            return false;
+        }
+
+        switch (PQresultStatus(result))
+        {
+        case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        case PGRES_TUPLES_CHUNK:
+#endif
+        {
+            PyObject* rset = ResultSet_New(stream->cnxn, result, stream->columns, stream->plan);
+            if (rset == 0)
+            {
+                Finish(stream, true);
+                return false;
+            }
+
+            stream->rset = (ResultSet*)rset;
+
+            if (stream->columns == 0)
+            {
+                stream->columns = stream->rset->columns;
+                Py_XINCREF(stream->columns);
+                stream->plan = stream->rset->planobj;
+                Py_XINCREF(stream->plan);
+            }
+
+            if (PQntuples(result) > 0)
+                return true;
+
+            Py_CLEAR(stream->rset);
+            break;
+        }
+
+        case PGRES_TUPLES_OK:
+        case PGRES_COMMAND_OK:
+        case PGRES_EMPTY_QUERY:
+            // The end of the rows, or the statement wasn't a query.  The next result should
+            // be the NULL that ends the results.
+            PQclear(result);
+            break;
+
+        case PGRES_BAD_RESPONSE:
+        case PGRES_NONFATAL_ERROR:
+        case PGRES_FATAL_ERROR:
+        default:
+            Finish(stream, false);
+            SetResultError(result);
+            return false;
+        }
+    }
+}
+
+static PyObject* Stream_iternext(PyObject* self)
+{
+    Stream* stream = (Stream*)self;
+
+    if (stream->rset == 0 || stream->iRow >= PQntuples(stream->rset->result))
+    {
+        if (!NextChunk(stream))
+            return 0;
+    }
+
+    return Row_New(stream->rset, stream->iRow++);
+}
+
+static PyObject* Stream_close(PyObject* self, PyObject* args)
+{
+    UNUSED(args);
+    Stream* stream = (Stream*)self;
+    Py_CLEAR(stream->rset);
+    Finish(stream, true);
+    Py_RETURN_NONE;
+}
+
+static PyObject* Stream_getcolumns(Stream* self, void* closure)
+{
+    UNUSED(closure);
+
+    if (self->columns == 0)
+    {
+        Py_RETURN_NONE;
+    }
+
+    Py_INCREF(self->columns);
+    return self->columns;
+}
+
+static PyObject* Stream_enter(PyObject* self, PyObject* args)
+{
+    UNUSED(args);
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject* Stream_exit(PyObject* self, PyObject* args)
+{
+    return Stream_close(self, 0);
+}
+
+static PyGetSetDef Stream_getsetters[] =
+{
+    { (char*)"columns", (getter)Stream_getcolumns, 0, (char*)"tuple of column names, or None until the first row is read", 0 },
+    { 0 }
+};
+
+static struct PyMethodDef Stream_methods[] =
+{
+    { "close",     Stream_close, METH_NOARGS,  "Stops reading rows, canceling the query if necessary." },
+    { "__enter__", Stream_enter, METH_NOARGS,  0 },
+    { "__exit__",  Stream_exit,  METH_VARARGS, 0 },
+    { 0, 0, 0, 0 }
+};
+
+PyTypeObject StreamType =
+{
+    PyVarObject_HEAD_INIT(0, 0)
+    "pglib.Stream",             // tp_name
+    sizeof(Stream),             // tp_basicsize
+    0,                          // tp_itemsize
+    Stream_dealloc,             // destructor tp_dealloc
+    0,                          // tp_print
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_compare
+    0,                          // tp_repr
+    0,                          // tp_as_number
+    0,                          // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    0,                          // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,         // tp_flags
+    0,                          // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    Stream_iter,                // tp_iter
+    Stream_iternext,            // tp_iternext
+    Stream_methods,             // tp_methods
+    0,                          // tp_members
+    Stream_getsetters,          // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    0,                          // tp_new
+    0,                          // tp_free
+    0,                          // tp_is_gc
+    0,                          // tp_bases
+    0,                          // tp_mro
+    0,                          // tp_cache
+    0,                          // tp_subclasses
+    0,                          // tp_weaklist
+};
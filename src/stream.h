@@ -0,0 +1,14 @@
+
+#ifndef STREAM_H
+#define STREAM_H
+
+struct Connection;
+
+extern PyTypeObject StreamType;
+
+PyObject* Stream_New(Connection* cnxn, int chunk_rows);
+// Creates an iterator over the results of the query that was just sent on `cnxn` with
+// PQsendQueryParams.  The caller must not have requested single-row or chunked mode - this
+// does it.
+
+#endif // STREAM_H
@@ -0,0 +1,895 @@
+// Writes results as CSV or JSON lines.
+//
+// Values are read from the binary PGresult and formatted straight into a chunk of output that
+// is written each time it holds about WRITE_CHUNK_SIZE bytes.  Formatting does not touch any
+// Python objects, so it is done with the GIL released.
+//
+// CSV values are formatted the way COPY ... TO STDOUT (FORMAT csv) formats them with DateStyle
+// set to ISO and TimeZone set to UTC, so files can be read back with copy_from_csv.  JSON values
+// are formatted the way PostgreSQL's to_json formats them.
+
+#include "pglib.h"
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <math.h>
+#include <float.h>
+#include <locale.h>
+#include "writer.h"
+#include "copy.h"
+#include "errors.h"
+#include "byteswap.h"
+#include "juliandate.h"
+
+static const size_t WRITE_CHUNK_SIZE = 64 * 1024;
+
+static const int64_t USECS_PER_DAY = 86400LL * 1000000;
+
+enum
+{
+    NUMERIC_NEG  = 0x4000,
+    NUMERIC_NAN  = 0xC000,
+    NUMERIC_PINF = 0xD000,
+    NUMERIC_NINF = 0xF000
+};
+
+enum Kind
+{
+    KIND_UNSUPPORTED,
+    KIND_BOOL,
+    KIND_INT2,
+    KIND_INT4,
+    KIND_INT8,
+    KIND_FLOAT4,
+    KIND_FLOAT8,
+    KIND_NUMERIC,
+    KIND_CASH,
+    KIND_DATE,
+    KIND_TIME,
+    KIND_TIMESTAMP,
+    KIND_TIMESTAMPTZ,
+    KIND_UUID,
+    KIND_BYTEA,
+    KIND_TEXT,
+    KIND_JSON,
+    KIND_JSONB
+    // The binary format of jsonb is a version byte followed by the text.
+};
+
+static Kind GetKind(Oid oid, int format)
+{
+    // Columns returned in text format are written as text, except JSON, which is written as is
+    // in JSON output.
+
+    if (format == FORMAT_TEXT)
+        return (oid == JSONOID || oid == JSONBOID) ? KIND_JSON : KIND_TEXT;
+
+    switch (oid)
+    {
+    case BOOLOID:        return KIND_BOOL;
+    case INT2OID:        return KIND_INT2;
+    case INT4OID:        return KIND_INT4;
+    case INT8OID:        return KIND_INT8;
+    case FLOAT4OID:      return KIND_FLOAT4;
+    case FLOAT8OID:      return KIND_FLOAT8;
+    case NUMERICOID:     return KIND_NUMERIC;
+    case CASHOID:        return KIND_CASH;
+    case DATEOID:        return KIND_DATE;
+    case TIMEOID:        return KIND_TIME;
+    case TIMESTAMPOID:   return KIND_TIMESTAMP;
+    case TIMESTAMPTZOID: return KIND_TIMESTAMPTZ;
+    case UUIDOID:        return KIND_UUID;
+    case BYTEAOID:       return KIND_BYTEA;
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case NAMEOID:        return KIND_TEXT;
+    case JSONOID:        return KIND_JSON;
+    case JSONBOID:       return KIND_JSONB;
+    }
+
+    return KIND_UNSUPPORTED;
+}
+
+struct Output
+{
+    char* data;
+    size_t len;
+    size_t cap;
+
+    Output()
+    {
+        data = 0;
+        len  = 0;
+        cap  = 0;
+    }
+
+    ~Output()
+    {
+        free(data);
+    }
+
+    char* Reserve(size_t cb)
+    {
+        // Returns a pointer to the end of the data with room for at least `cb` more bytes, or
+        // zero if out of memory.  The caller sets `len` after writing.
+
+        if (len + cb > cap)
+        {
+            size_t newcap = MAX(cap * 2, MAX(len + cb, WRITE_CHUNK_SIZE * 2));
+            char* newdata = (char*)realloc(data, newcap);
+            if (newdata == 0)
+                return 0;
+            data = newdata;
+            cap  = newcap;
+        }
+        return &data[len];
+    }
+};
+
+// -----------------------------------------------------------------------------------------------
+// Formatting
+//
+// Each of these writes a value at `p` and returns the end of it.  The caller must have reserved
+// room for MaxLength bytes.
+
+static const char HEX[] = "0123456789abcdef";
+
+static char* PutDigits(char* p, int value, int width)
+{
+    // Writes a non-negative value zero padded to `width` digits.
+
+    for (int i = width - 1; i >= 0; i--)
+    {
+        p[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    return p + width;
+}
+
+static char* PutUnsigned(char* p, uint64_t value)
+{
+    char sz[20];
+    int cch = 0;
+    do
+    {
+        sz[cch++] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    while (value);
+
+    while (cch)
+        *p++ = sz[--cch];
+    return p;
+}
+
+static char* PutInteger(char* p, int64_t value)
+{
+    if (value < 0)
+    {
+        *p++ = '-';
+        return PutUnsigned(p, 0 - (uint64_t)value);
+    }
+    return PutUnsigned(p, (uint64_t)value);
+}
+
+static char* PutString(char* p, const char* sz, bool quote)
+{
+    if (quote)
+        *p++ = '"';
+    while (*sz)
+        *p++ = *sz++;
+    if (quote)
+        *p++ = '"';
+    return p;
+}
+
+static int FixDecimalPoint(char* p, int cch)
+{
+    // snprintf and strtod use the LC_NUMERIC decimal point, which is a comma in many locales
+    // once Python calls setlocale.  The number is formatted and checked in the locale and then
+    // the decimal point is replaced with a period.  Neither CSV nor JSON readers expect the
+    // locale's.
+
+    const char* point = localeconv()->decimal_point;
+    if (point[0] == '.' && point[1] == 0)
+        return cch;
+
+    char* found = strstr(p, point);
+    if (found == 0)
+        return cch;
+
+    size_t cb = strlen(point);
+    *found = '.';
+    memmove(found + 1, found + cb, (size_t)(p + cch - (found + cb)));
+    return cch - (int)(cb - 1);
+}
+
+static char* PutDouble(char* p, double value, bool json)
+{
+    // JSON has no NaN or infinity, so like to_json they are written as strings.
+
+    if (value != value)
+        return PutString(p, "NaN", json);
+    if (value == HUGE_VAL || value == -HUGE_VAL)
+        return PutString(p, value > 0 ? "Infinity" : "-Infinity", json);
+
+    // Use the fewest significant digits that read back as the same value.  Every double is
+    // exact with 17 and most need 15 or fewer.  %g drops trailing zeros, so a value that needs
+    // fewer than 15 digits is written with fewer.  Subnormals have less precision, so they
+    // search from 1.
+
+    int cch = 0;
+    int first = (value > -DBL_MIN && value < DBL_MIN) ? 1 : 15;
+    for (int precision = first; precision <= 17; precision++)
+    {
+        cch = snprintf(p, 32, "%.*g", precision, value);
+        if (strtod(p, 0) == value)
+            break;
+    }
+    return p + FixDecimalPoint(p, cch);
+}
+
+static char* PutFloat(char* p, float value, bool json)
+{
+    if (value != value || value == HUGE_VALF || value == -HUGE_VALF)
+        return PutDouble(p, value, json);
+
+    int cch = 0;
+    for (int precision = 6; precision <= 9; precision++)
+    {
+        cch = snprintf(p, 32, "%.*g", precision, (double)value);
+        if ((float)strtod(p, 0) == value)
+            break;
+    }
+    return p + FixDecimalPoint(p, cch);
+}
+
+static size_t NumericLength(const char* value)
+{
+    const int16_t* pi = (const int16_t*)value;
+    int weight = swaps2(pi[1]);
+    int dscale = swaps2(pi[3]);
+    return (size_t)(4 * (MAX(weight, 0) + 1) + dscale) + 16;
+}
+
+static char* PutNumeric(char* p, const char* value, bool json)
+{
+    // The binary format is:
+    //
+    //   int16 ndigits, int16 weight, uint16 sign, uint16 dscale, int16 digits[ndigits]
+    //
+    // The digits are base 10000 and weight is the power of 10000 of the first one.  dscale is
+    // the number of decimal digits after the point.
+
+    const int16_t* pi = (const int16_t*)value;
+
+    int ndigits = swaps2(pi[0]);
+    int weight  = swaps2(pi[1]);
+    int sign    = (uint16_t)swaps2(pi[2]);
+    int dscale  = swaps2(pi[3]);
+
+    if (sign == NUMERIC_NAN)
+        return PutString(p, "NaN", json);
+    if (sign == NUMERIC_PINF)
+        return PutString(p, "Infinity", json);
+    if (sign == NUMERIC_NINF)
+        return PutString(p, "-Infinity", json);
+
+    if (sign == NUMERIC_NEG)
+        *p++ = '-';
+
+    if (weight < 0)
+    {
+        *p++ = '0';
+    }
+    else
+    {
+        for (int i = 0; i <= weight; i++)
+        {
+            int digit = (i < ndigits) ? swaps2(pi[4 + i]) : 0;
+            p = (i == 0) ? PutUnsigned(p, (uint64_t)digit) : PutDigits(p, digit, 4);
+        }
+    }
+
+    if (dscale > 0)
+    {
+        *p++ = '.';
+
+        // Digit i is worth 10000^(weight - i), so the fraction starts with digit weight + 1,
+        // which is negative if there are leading zeros.
+
+        char* end = p + dscale;
+        for (int i = weight + 1; p < end; i++)
+        {
+            int digit = (i >= 0 && i < ndigits) ? swaps2(pi[4 + i]) : 0;
+            char sz[4];
+            PutDigits(sz, digit, 4);
+            for (int j = 0; j < 4 && p < end; j++)
+                *p++ = sz[j];
+        }
+    }
+
+    return p;
+}
+
+static char* PutCash(char* p, const char* value)
+{
+    // A 64-bit integer * 100.
+
+    int64_t n = FromNetwork(*(int64_t*)value);
+
+    uint64_t u = (uint64_t)n;
+    if (n < 0)
+    {
+        *p++ = '-';
+        u = 0 - u;
+    }
+
+    p = PutUnsigned(p, u / 100);
+    *p++ = '.';
+    return PutDigits(p, (int)(u % 100), 2);
+}
+
+static char* PutDate(char* p, int days, bool& bc)
+{
+    // Writes the date `days` after 2000-01-01 as YYYY-MM-DD.  Sets `bc` for years before 1 AD,
+    // which PostgreSQL writes with a " BC" suffix after the whole value.
+
+    int year, month, day;
+    julianToDate(days + JULIAN_START, year, month, day);
+
+    // julianToDate has no year 0, so 1 BC is -1.
+
+    bc = (year < 0);
+    if (bc)
+        year = -year;
+
+    p = (year < 10000) ? PutDigits(p, year, 4) : PutUnsigned(p, (uint64_t)year);
+    *p++ = '-';
+    p = PutDigits(p, month, 2);
+    *p++ = '-';
+    return PutDigits(p, day, 2);
+}
+
+static char* PutTime(char* p, int64_t usecs)
+{
+    // Writes a time of day in microseconds as HH:MM:SS with a fraction only if needed.
+
+    int64_t seconds = usecs / 1000000;
+    int fraction = (int)(usecs % 1000000);
+
+    p = PutDigits(p, (int)(seconds / 3600), 2);
+    *p++ = ':';
+    p = PutDigits(p, (int)(seconds / 60 % 60), 2);
+    *p++ = ':';
+    p = PutDigits(p, (int)(seconds % 60), 2);
+
+    if (fraction)
+    {
+        *p++ = '.';
+        p = PutDigits(p, fraction, 6);
+        while (p[-1] == '0')
+            p--;
+    }
+
+    return p;
+}
+
+static char* PutTimestamp(char* p, int64_t usecs, bool utc, bool json)
+{
+    // Writes microseconds since 2000-01-01.  A timestamptz is always written in UTC.
+
+    if (usecs == INT64_MAX)
+        return PutString(p, "infinity", json);
+    if (usecs == INT64_MIN)
+        return PutString(p, "-infinity", json);
+
+    int64_t days = usecs / USECS_PER_DAY;
+    int64_t time = usecs % USECS_PER_DAY;
+    if (time < 0)
+    {
+        time += USECS_PER_DAY;
+        days -= 1;
+    }
+
+    if (json)
+        *p++ = '"';
+
+    bool bc;
+    p = PutDate(p, (int)days, bc);
+    *p++ = json ? 'T' : ' ';
+    p = PutTime(p, time);
+
+    if (utc)
+        p = PutString(p, json ? "+00:00" : "+00", false);
+    if (bc)
+        p = PutString(p, " BC", false);
+
+    if (json)
+        *p++ = '"';
+
+    return p;
+}
+
+static char* PutUuid(char* p, const char* value, bool json)
+{
+    if (json)
+        *p++ = '"';
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+            *p++ = '-';
+        uint8_t b = (uint8_t)value[i];
+        *p++ = HEX[b >> 4];
+        *p++ = HEX[b & 0x0F];
+    }
+
+    if (json)
+        *p++ = '"';
+
+    return p;
+}
+
+static char* PutBytea(char* p, const char* value, int len, bool json)
+{
+    // PostgreSQL's hex format: \x followed by two hex digits per byte.  The backslash must be
+    // escaped in JSON.
+
+    p = PutString(p, json ? "\"\\\\x" : "\\x", false);
+
+    for (int i = 0; i < len; i++)
+    {
+        uint8_t b = (uint8_t)value[i];
+        *p++ = HEX[b >> 4];
+        *p++ = HEX[b & 0x0F];
+    }
+
+    if (json)
+        *p++ = '"';
+
+    return p;
+}
+
+static char* PutCsvText(char* p, const char* value, int len, char delimiter)
+{
+    // Like COPY, quotes values that are empty (so they can be told apart from NULL), contain the
+    // delimiter, a quote, or a line break, or are the end-of-data marker.
+
+    bool quote = (len == 0) || (len == 2 && value[0] == '\\' && value[1] == '.');
+
+    for (int i = 0; i < len && !quote; i++)
+    {
+        char ch = value[i];
+        quote = (ch == delimiter || ch == '"' || ch == '\n' || ch == '\r');
+    }
+
+    if (!quote)
+    {
+        memcpy(p, value, (size_t)len);
+        return p + len;
+    }
+
+    *p++ = '"';
+    for (int i = 0; i < len; i++)
+    {
+        if (value[i] == '"')
+            *p++ = '"';
+        *p++ = value[i];
+    }
+    *p++ = '"';
+
+    return p;
+}
+
+static char* PutJsonText(char* p, const char* value, int len)
+{
+    *p++ = '"';
+
+    for (int i = 0; i < len; i++)
+    {
+        uint8_t ch = (uint8_t)value[i];
+
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+        {
+            *p++ = (char)ch;
+            continue;
+        }
+
+        *p++ = '\\';
+        switch (ch)
+        {
+        case '"':  *p++ = '"';  break;
+        case '\\': *p++ = '\\'; break;
+        case '\b': *p++ = 'b';  break;
+        case '\f': *p++ = 'f';  break;
+        case '\n': *p++ = 'n';  break;
+        case '\r': *p++ = 'r';  break;
+        case '\t': *p++ = 't';  break;
+        default:
+            p = PutString(p, "u00", false);
+            *p++ = HEX[ch >> 4];
+            *p++ = HEX[ch & 0x0F];
+        }
+    }
+
+    *p++ = '"';
+    return p;
+}
+
+static size_t MaxLength(Kind kind, const char* value, int len)
+{
+    // Returns the most bytes that formatting the value could take.
+
+    switch (kind)
+    {
+    case KIND_NUMERIC:
+        return NumericLength(value);
+
+    case KIND_BYTEA:
+        return (size_t)len * 2 + 6;
+
+    case KIND_TEXT:
+    case KIND_JSON:
+    case KIND_JSONB:
+        // A control character in JSON takes 6.
+        return (size_t)len * 6 + 2;
+
+    default:
+        return 64;
+    }
+}
+
+static char* PutValue(char* p, Kind kind, const char* value, int len, const WriteOptions& options)
+{
+    bool json = (options.style == WRITE_JSONL);
+
+    switch (kind)
+    {
+    case KIND_BOOL:
+        if (json)
+            return PutString(p, *value ? "true" : "false", false);
+        *p++ = *value ? 't' : 'f';
+        return p;
+
+    case KIND_INT2:
+        return PutInteger(p, FromNetwork(*(int16_t*)value));
+
+    case KIND_INT4:
+        return PutInteger(p, FromNetwork(*(int32_t*)value));
+
+    case KIND_INT8:
+        return PutInteger(p, FromNetwork(*(int64_t*)value));
+
+    case KIND_FLOAT4:
+        return PutFloat(p, FromNetwork(*(float*)value), json);
+
+    case KIND_FLOAT8:
+        return PutDouble(p, FromNetwork(*(double*)value), json);
+
+    case KIND_NUMERIC:
+        return PutNumeric(p, value, json);
+
+    case KIND_CASH:
+        return PutCash(p, value);
+
+    case KIND_DATE:
+    {
+        int32_t days = FromNetwork(*(int32_t*)value);
+        if (days == INT32_MAX)
+            return PutString(p, "infinity", json);
+        if (days == INT32_MIN)
+            return PutString(p, "-infinity", json);
+
+        if (json)
+            *p++ = '"';
+        bool bc;
+        p = PutDate(p, days, bc);
+        if (bc)
+            p = PutString(p, " BC", false);
+        if (json)
+            *p++ = '"';
+        return p;
+    }
+
+    case KIND_TIME:
+        if (json)
+            *p++ = '"';
+        p = PutTime(p, FromNetwork(*(int64_t*)value));
+        if (json)
+            *p++ = '"';
+        return p;
+
+    case KIND_TIMESTAMP:
+    case KIND_TIMESTAMPTZ:
+        return PutTimestamp(p, FromNetwork(*(int64_t*)value), kind == KIND_TIMESTAMPTZ, json);
+
+    case KIND_UUID:
+        return PutUuid(p, value, json);
+
+    case KIND_BYTEA:
+        return PutBytea(p, value, len, json);
+
+    case KIND_JSONB:
+        if (len > 0)
+        {
+            value += 1;
+            len -= 1;
+        }
+        // fall through
+
+    case KIND_JSON:
+        if (json)
+        {
+            memcpy(p, value, (size_t)len);
+            return p + len;
+        }
+        return PutCsvText(p, value, len, options.delimiter);
+
+    case KIND_TEXT:
+        if (json)
+            return PutJsonText(p, value, len);
+        return PutCsvText(p, value, len, options.delimiter);
+
+    case KIND_UNSUPPORTED:
+        break;
+    }
+
+    return p;
+}
+
+// -----------------------------------------------------------------------------------------------
+// Writing
+
+struct Column
+{
+    Kind kind;
+
+    std::string prefix;
+    // What is written before the value: the delimiter in CSV or the key in JSON.
+};
+
+struct Writer
+{
+    PGresult* result;
+    WriteOptions options;
+    std::vector<Column> columns;
+    int cRows;
+    int iRow;
+    // The next row to format.
+    Output out;
+};
+
+static bool FormatRows(Writer& w)
+{
+    // Formats rows until the output holds at least WRITE_CHUNK_SIZE bytes or there are no more
+    // rows.  Returns false if out of memory.  Does not use the GIL.
+
+    bool json = (w.options.style == WRITE_JSONL);
+    int cColumns = (int)w.columns.size();
+
+    while (w.iRow < w.cRows && w.out.len < WRITE_CHUNK_SIZE)
+    {
+        int iRow = w.iRow++;
+
+        if (json)
+        {
+            char* p = w.out.Reserve(1);
+            if (p == 0)
+                return false;
+            *p = '{';
+            w.out.len += 1;
+        }
+
+        for (int iCol = 0; iCol < cColumns; iCol++)
+        {
+            const Column& column = w.columns[iCol];
+            bool null = PQgetisnull(w.result, iRow, iCol);
+            const char* value = null ? 0 : PQgetvalue(w.result, iRow, iCol);
+            int len = null ? 0 : PQgetlength(w.result, iRow, iCol);
+
+            size_t cb = column.prefix.size() + (null ? 4 : MaxLength(column.kind, value, len));
+            char* p = w.out.Reserve(cb);
+            if (p == 0)
+                return false;
+
+            memcpy(p, column.prefix.data(), column.prefix.size());
+            p += column.prefix.size();
+
+            if (!null)
+                p = PutValue(p, column.kind, value, len, w.options);
+            else if (json)
+                p = PutString(p, "null", false);
+
+            w.out.len = (size_t)(p - w.out.data);
+        }
+
+        char* p = w.out.Reserve(2);
+        if (p == 0)
+            return false;
+        if (json)
+            *p++ = '}';
+        *p++ = '\n';
+        w.out.len = (size_t)(p - w.out.data);
+    }
+
+    return true;
+}
+
+static bool PutHeader(Writer& w)
+{
+    // Writes the CSV header line.  Returns false if out of memory.
+
+    int cColumns = (int)w.columns.size();
+    for (int iCol = 0; iCol < cColumns; iCol++)
+    {
+        const char* szName = PQfname(w.result, iCol);
+        int len = (int)strlen(szName);
+
+        char* p = w.out.Reserve((size_t)len * 2 + 4);
+        if (p == 0)
+            return false;
+        if (iCol > 0)
+            *p++ = w.options.delimiter;
+        p = PutCsvText(p, szName, len, w.options.delimiter);
+        w.out.len = (size_t)(p - w.out.data);
+    }
+
+    char* p = w.out.Reserve(1);
+    if (p == 0)
+        return false;
+    *p = '\n';
+    w.out.len += 1;
+    return true;
+}
+
+static bool InitColumns(Writer& w, bool integer_datetimes)
+{
+    bool json = (w.options.style == WRITE_JSONL);
+    int cColumns = PQnfields(w.result);
+
+    w.columns.resize((size_t)cColumns);
+
+    for (int iCol = 0; iCol < cColumns; iCol++)
+    {
+        Column& column = w.columns[iCol];
+        Oid oid = PQftype(w.result, iCol);
+
+        column.kind = GetKind(oid, PQfformat(w.result, iCol));
+
+        if (column.kind == KIND_UNSUPPORTED)
+        {
+            PyErr_Format(Error, "Column %d has type %d, which cannot be written", iCol, (int)oid);
+            return false;
+        }
+
+        if ((column.kind == KIND_TIMESTAMP || column.kind == KIND_TIMESTAMPTZ) && !integer_datetimes)
+        {
+            PyErr_Format(Error, "Column %d is a floating point timestamp, which is not supported", iCol);
+            return false;
+        }
+
+        if (json)
+        {
+            const char* szName = PQfname(w.result, iCol);
+            int len = (int)strlen(szName);
+            std::vector<char> key((size_t)len * 6 + 4);
+            char* p = &key[0];
+            if (iCol > 0)
+                *p++ = ',';
+            p = PutJsonText(p, szName, len);
+            *p++ = ':';
+            column.prefix.assign(&key[0], p);
+        }
+        else if (iCol > 0)
+        {
+            column.prefix = w.options.delimiter;
+        }
+    }
+
+    return true;
+}
+
+PyObject* Writer_Write(PGresult* result, bool integer_datetimes, PyObject* dest, const WriteOptions& options)
+{
+    int fd = -1;
+    Object write_method;
+    bool text = false;
+
+    if (PyBool_Check(dest))
+    {
+        // bool is a subclass of int, but True is almost certainly not meant to be stdout.
+        return SetStringError(PyExc_TypeError, "dest cannot be a bool");
+    }
+
+    if (PyLong_Check(dest))
+    {
+        long l = PyLong_AsLong(dest);
+        if (l == -1 && PyErr_Occurred())
+            return 0;
+        if (l < 0 || l > INT_MAX)
+            return SetStringError(PyExc_ValueError, "dest is not a valid file descriptor");
+        fd = (int)l;
+    }
+    else
+    {
+        write_method.Attach(PyObject_GetAttrString(dest, "write"));
+        if (!write_method)
+        {
+            PyErr_Clear();
+            return SetStringError(PyExc_TypeError, "dest must be a file descriptor or an object with a write method");
+        }
+
+        // Text files, such as those opened with 'w' and sys.stdout, are passed str instead of
+        // bytes.  Each call writes whole rows, so the UTF-8 can always be decoded.
+
+        Object io(PyImport_ImportModule("io"));
+        Object textbase(io ? PyObject_GetAttrString(io, "TextIOBase") : 0);
+        if (!textbase)
+            return 0;
+        int isText = PyObject_IsInstance(dest, textbase);
+        if (isText == -1)
+            return 0;
+        text = (isText == 1);
+    }
+
+    Writer w;
+    w.result  = result;
+    w.options = options;
+    w.cRows   = PQntuples(result);
+    w.iRow    = 0;
+
+    if (!InitColumns(w, integer_datetimes))
+        return 0;
+
+    if (options.style == WRITE_CSV && options.header && !PutHeader(w))
+        return PyErr_NoMemory();
+
+    bool ok = true;
+
+    if (fd != -1)
+    {
+        FdSink sink = { fd, 0 };
+
+        Py_BEGIN_ALLOW_THREADS
+        do
+        {
+            ok = FormatRows(w);
+            if (ok && w.out.len != 0)
+                ok = WriteFd(&sink, w.out.data, w.out.len);
+            w.out.len = 0;
+        }
+        while (ok && w.iRow < w.cRows);
+        Py_END_ALLOW_THREADS
+
+        if (sink.error)
+        {
+            errno = sink.error;
+            return PyErr_SetFromErrno(PyExc_OSError);
+        }
+    }
+    else
+    {
+        do
+        {
+            Py_BEGIN_ALLOW_THREADS
+            ok = FormatRows(w);
+            Py_END_ALLOW_THREADS
+
+            if (ok && w.out.len != 0)
+            {
+                Object written(PyObject_CallFunction(write_method, text ? "s#" : "y#", w.out.data, (Py_ssize_t)w.out.len));
+                if (!written)
+                    return 0;
+                w.out.len = 0;
+            }
+        }
+        while (ok && w.iRow < w.cRows);
+    }
+
+    if (!ok)
+        return PyErr_NoMemory();
+
+    return PyLong_FromLong(w.cRows);
+}
@@ -0,0 +1,30 @@
+
+#ifndef WRITER_H
+#define WRITER_H
+
+// Writes results as CSV or JSON lines directly from the PGresult, without creating a Python
+// object for each value.
+
+enum WriteStyle
+{
+    WRITE_CSV,
+    WRITE_JSONL
+};
+
+struct WriteOptions
+{
+    WriteStyle style;
+
+    bool header;
+    // CSV only: write a line of column names first.
+
+    char delimiter;
+    // CSV only.
+};
+
+PyObject* Writer_Write(PGresult* result, bool integer_datetimes, PyObject* dest, const WriteOptions& options);
+// Writes the result to `dest`, which must be an integer file descriptor or an object with a
+// write method, and returns the number of rows written.  Values are formatted with the GIL
+// released.  When writing to a file descriptor the GIL is not held at all.
+
+#endif // WRITER_H